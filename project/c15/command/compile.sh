@@ -13,7 +13,7 @@ BIN="prog_arg"
 CFLAGS="-Wall -m32 -c -fno-builtin -W -Wstrict-prototypes 
     -Wmissing-prototypes -Wsystem-headers"
 LIB="-I ../lib -I ../lib/user -I ../fs"
-OBJS="../build/string.o ../build/syscall.o \
+OBJS="../build/string.o ../build/syscall.o ../build/malloc.o \
     ../build/stdio.o ../build/assert.o start.o"
 DD_IN=$BIN
 DD_OUT="/home/book/bochsken/hd60M.img"
@@ -0,0 +1,56 @@
+#include "stdio.h"
+#include "syscall.h"
+#include "string.h"
+
+/* 比较用户态 malloc/free 与陷入内核的 malloc_syscall/free_syscall 的耗时,
+ * 用 rdtsc 读时间戳计数器, 结果以 1024 个时钟周期为单位 */
+
+#define ROUNDS 64
+#define BATCH 32
+
+typedef void* (*alloc_func)(uint32_t size);
+typedef void (*free_func)(void* ptr);
+
+static uint64_t rdtsc(void) {
+    uint32_t low, high;
+    asm volatile ("rdtsc" : "=a" (low), "=d" (high));
+    return ((uint64_t) high << 32) | low;
+}
+
+/* 每轮申请 BATCH 块大小不一的内存, 写一下再全部释放, 返回总耗时(单位为1024个时钟周期) */
+static uint32_t bench(alloc_func alloc, free_func release, uint32_t max_size) {
+    void* ptrs[BATCH];
+    uint64_t start = rdtsc();
+    uint32_t round = 0;
+    while (round < ROUNDS) {
+        uint32_t idx = 0;
+        while (idx < BATCH) {
+            uint32_t size = 8 + (idx * 37 + round * 11) % max_size;
+            ptrs[idx] = alloc(size);
+            if (ptrs[idx] == NULL) {
+                printf("alloc %d bytes failed\n", size);
+                return 0;
+            }
+            memset(ptrs[idx], idx, 8);
+            idx++;
+        }
+        while (idx-- > 0) {
+            release(ptrs[idx]);
+        }
+        round++;
+    }
+    return (uint32_t) ((rdtsc() - start) >> 10);
+}
+
+int main(void) {
+    uint32_t max_sizes[] = {64, 1024, 8192};
+    uint32_t case_idx = 0;
+    printf("%d rounds x %d allocations, time in 1024 cycles\n", ROUNDS, BATCH);
+    while (case_idx < sizeof(max_sizes) / sizeof(max_sizes[0])) {
+        uint32_t user_time = bench(malloc, free, max_sizes[case_idx]);
+        uint32_t sys_time = bench(malloc_syscall, free_syscall, max_sizes[case_idx]);
+        printf("size <= %d: malloc %d, malloc_syscall %d\n", max_sizes[case_idx], user_time, sys_time);
+        case_idx++;
+    }
+    return 0;
+}
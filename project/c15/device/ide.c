@@ -131,18 +131,35 @@ static void write2sector(struct disk* hd, void* buf, uint8_t sec_cnt) {
    outsw(reg_data(hd->my_channel), buf, size_in_byte / 2);
 }
 
-/* 等待30秒 */
+#define DISK_TIMEOUT_MS (30 * 1000)	     // 等待硬盘的最长毫秒数
+
+/* 等待30秒, 硬盘忙时睡眠10毫秒再查, 睡眠期间不占处理器 */
 static bool busy_wait(struct disk* hd) {
    struct ide_channel* channel = hd->my_channel;
-   uint16_t time_limit = 30 * 1000;	     // 可以等待30000毫秒
-   while (time_limit -= 10 >= 0) {
-      if (!(inb(reg_status(channel)) & BIT_STAT_BSY)) {
-	 return (inb(reg_status(channel)) & BIT_STAT_DRQ);
-      } else {
-	 mtime_sleep(10);		     // 睡眠10毫秒
+   uint32_t deadline = ticks + msecs_to_ticks(DISK_TIMEOUT_MS);
+   while (inb(reg_status(channel)) & BIT_STAT_BSY) {
+      if ((int32_t)(ticks - deadline) >= 0) {
+	 return false;
       }
+      mtime_sleep(10);			     // 睡眠10毫秒
    }
-   return false;
+   return (inb(reg_status(channel)) & BIT_STAT_DRQ);
+}
+
+/* 硬盘迟迟不发中断时由定时器唤醒等待的线程, 醒来后由 busy_wait 检查硬盘状态 */
+static void disk_intr_timeout(void* arg) {
+   struct ide_channel* channel = arg;
+   if (channel->expecting_intr) {
+      channel->expecting_intr = false;
+      sema_up(&channel->disk_done);
+   }
+}
+
+/* 发出命令后阻塞, 直到硬盘中断或超时 */
+static void wait_disk_intr(struct ide_channel* channel) {
+   timer_add(&channel->intr_timer, ticks + msecs_to_ticks(DISK_TIMEOUT_MS));
+   sema_down(&channel->disk_done);
+   timer_del(&channel->intr_timer);
 }
 
 /* 从硬盘读取sec_cnt个扇区到buf */
@@ -172,7 +189,7 @@ void ide_read(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt) {   //
    /*********************   阻塞自己的时机  ***********************
       在硬盘已经开始工作(开始在内部读数据或写数据)后才能阻塞自己,现在硬盘已经开始忙了,
       将自己阻塞,等待硬盘完成读操作后通过中断处理程序唤醒自己*/
-      sema_down(&hd->my_channel->disk_done);
+      wait_disk_intr(hd->my_channel);
    /*************************************************************/
 
    /* 4 检测硬盘状态是否可读 */
@@ -225,7 +242,7 @@ void ide_write(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt) {
       write2sector(hd, (void*)((uint32_t)buf + secs_done * 512), secs_op);
 
       /* 在硬盘响应期间阻塞自己 */
-      sema_down(&hd->my_channel->disk_done);
+      wait_disk_intr(hd->my_channel);
       secs_done += secs_op;
    }
    /* 醒来后开始释放锁*/
@@ -250,7 +267,7 @@ static void identify_disk(struct disk* hd) {
    cmd_out(hd->my_channel, CMD_IDENTIFY);
 /* 向硬盘发送指令后便通过信号量阻塞自己,
  * 待硬盘处理完成后,通过中断处理程序将自己唤醒 */
-   sema_down(&hd->my_channel->disk_done);
+   wait_disk_intr(hd->my_channel);
 
 /* 醒来后开始执行下面代码*/
    if (!busy_wait(hd)) {     //  若失败
@@ -294,6 +311,7 @@ static void partition_scan(struct disk* hd, uint32_t ext_lba) {
 	 if (ext_lba == 0) {	 // 此时全是主分区
 	    hd->prim_parts[p_no].start_lba = ext_lba + p->start_lba;
 	    hd->prim_parts[p_no].sec_cnt = p->sec_cnt;
+	    hd->prim_parts[p_no].fs_type = p->fs_type;
 	    hd->prim_parts[p_no].my_disk = hd;
 	    list_append(&partition_list, &hd->prim_parts[p_no].part_tag);
 	    sprintf(hd->prim_parts[p_no].name, "%s%d", hd->name, p_no + 1);
@@ -302,6 +320,7 @@ static void partition_scan(struct disk* hd, uint32_t ext_lba) {
 	 } else {
 	    hd->logic_parts[l_no].start_lba = ext_lba + p->start_lba;
 	    hd->logic_parts[l_no].sec_cnt = p->sec_cnt;
+	    hd->logic_parts[l_no].fs_type = p->fs_type;
 	    hd->logic_parts[l_no].my_disk = hd;
 	    list_append(&partition_list, &hd->logic_parts[l_no].part_tag);
 	    sprintf(hd->logic_parts[l_no].name, "%s%d", hd->name, l_no + 5);	 // 逻辑分区数字是从5开始,主分区是1～4.
@@ -377,6 +396,7 @@ void ide_init() {
    /* 初始化为0,目的是向硬盘控制器请求数据后,硬盘驱动sema_down此信号量会阻塞线程,
    直到硬盘完成后通过发中断,由中断处理程序将此信号量sema_up,唤醒线程. */
       sema_init(&channel->disk_done, 0);
+      timer_setup(&channel->intr_timer, disk_intr_timeout, channel);
 
       register_handler(channel->irq_no, intr_hd_handler);
 
@@ -4,11 +4,13 @@
 #include "../thread/sync.h"
 #include "list.h"
 #include "bitmap.h"
+#include "timer.h"
 
 /* 分区结构 */
 struct partition {
    uint32_t start_lba;		 // 起始扇区
    uint32_t sec_cnt;		 // 扇区数
+   uint8_t fs_type;		 // 分区表中登记的分区类型
    struct disk* my_disk;	 // 分区所属的硬盘
    struct list_elem part_tag;	 // 用于队列中的标记
    char name[8];		 // 分区名称
@@ -35,6 +37,7 @@ struct ide_channel {
    struct lock lock;
    bool expecting_intr;		 // 向硬盘发完命令后等待来自硬盘的中断
    struct semaphore disk_done;	 // 硬盘处理完成.线程用这个信号量来阻塞自己，由硬盘完成后产生的中断将线程唤醒
+   struct timer_list intr_timer;	 // 等待硬盘中断的超时定时器
    struct disk devices[2];	 // 一个通道上连接两个硬盘，一主一从
 };
 
@@ -2,36 +2,138 @@
 #include "io.h"
 #include "print.h"
 #include "../thread/thread.h"
+#include "../thread/sched.h"
 #include "debug.h"
 #include "interrupt.h"
+#include "list.h"
+
+/* 每秒的嘀嗒数, 可在编译时用 -DTIMER_HZ=1000 修改. 计数初值只有16位, 所以不能低于19 */
+#ifndef TIMER_HZ
+#define TIMER_HZ                100
+#endif
+#if TIMER_HZ < 19 || TIMER_HZ > 1000
+#error "TIMER_HZ must be between 19 and 1000"
+#endif
 
-#define IRQ0_FREQUENCY          100                                 // IRQ0 频率
 #define INPUT_FREQUENCY         1193180                             // 8253input频率
-#define COUNTER0_VALUE          INPUT_FREQUENCY / IRQ0_FREQUENCY    // IRQ0计数初值
 #define COUNTER0_PORT           0x40                                // 计数器端口
 #define COUNTER0_NO             0                                   // 控制字中使用的计数器号码
-#define COUNTER_MODE            2                                   // 计数器工作方式
+#define COUNTER_MODE_ONESHOT    0                                   // 计数到0时发一次中断
+#define COUNTER_MODE_PERIODIC   2                                   // 周期性地发中断
+#define COUNTER_MAX             0xffff                              // 16位计数初值的最大值
 #define READ_WRITE_LATCH        3                                   // 读写方式, 先读写低8位, 再读写高8位
 #define PIT_CONTROL_PORT        0x43                                // 控制字寄存器端口
+#define PIT_READ_BACK_COUNTER0  0xc2                                // 8254回读命令: 锁存计数器0的状态和计数值
+#define PIT_STATUS_OUT          0x80                                // 回读状态中的OUT引脚, 单次模式计数到0后为1
+#define PIT_LATCH_COUNTER0      0x00                                // 锁存计数器0的计数值
+#define PIC_M_CTRL              0x20                                // 8259A主片的控制端口
+#define PIC_READ_IRR            0x0a                                // OCW3: 下次读控制端口得到中断请求寄存器
+#define COUNTER2_PORT           0x42                                // 计数器2端口, 用来校准 TSC
+#define COUNTER2_NO             2
+#define PIT_GATE_PORT           0x61                                // 第0位是计数器2的门, 第1位接扬声器, 第5位是计数器2的OUT
 
 
 uint32_t ticks; // ticks 是内核自中断开启以来总共的嘀嗒数
+uint32_t timer_hz = TIMER_HZ;           // 每秒的嘀嗒数
+static uint32_t counter_per_tick;       // 每个嘀嗒的计数初值
 
-/* 时钟的中断处理函数 */
-static void intr_timer_handler(void) {
-    struct task_struct* cur_thread = running_thread();
+/***********************   分级时间轮   *****************************
+ * 定时器按到期嘀嗒挂在时间轮上: 共 WHEEL_LEVELS 级, 每级 WHEEL_SIZE 个槽,
+ * 第 0 级每槽一个嘀嗒, 第 n 级每槽 WHEEL_SIZE^n 个嘀嗒.
+ * 加入定时器时按距到期的嘀嗒数直接算出级别和槽, 删除只是从槽的链表中摘下, 都是 O(1).
+ * 每个嘀嗒只处理第 0 级的一个槽; 第 0 级转完一圈时把第 1 级的下一个槽
+ * 重新分散到第 0 级, 依此类推逐级下放.
+ * 五级共覆盖 2^30 个嘀嗒, 更远的定时器先挂在最高级, 下放时再重新计算位置.
+ ********************************************************************/
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 5
+#define WHEEL_MAX_DELTA ((1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
 
-    ASSERT(cur_thread->stack_magic == 0x19870916);      // 检查栈是否溢出
+static struct list wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static uint32_t wheel_ticks;	 // 时间轮下一个要处理的嘀嗒
 
-    cur_thread->elapsed_ticks++;        // 记录此线程占用的 cpu 时间
-    ticks++;                            // 内核态和用户态总共的嘀嗒数
+/* 按到期时间把 timer 挂到时间轮的槽上, 须在关中断下调用 */
+static void wheel_insert(struct timer_list* timer) {
+   uint32_t delta = timer->expires - wheel_ticks;
+   struct list* slot;
+   if ((int32_t)delta < 0) {
+      // 已经过期的放到下一个要处理的槽中
+      slot = &wheel[0][wheel_ticks & WHEEL_MASK];
+   } else {
+      uint32_t expires = timer->expires;
+      if (delta > WHEEL_MAX_DELTA) {
+	 expires = wheel_ticks + WHEEL_MAX_DELTA;
+	 delta = WHEEL_MAX_DELTA;
+      }
+      uint32_t level = 0;
+      while (delta >> (WHEEL_BITS * (level + 1)) != 0) {
+	 level++;
+      }
+      slot = &wheel[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+   }
+   list_append(slot, &timer->elem);
+}
 
-    if(cur_thread->ticks == 0) {
-        // 若进程时间片用完, 就开始调度新的进程上 cpu
-        schedule();
-    } else {
-        cur_thread->ticks--;
-    }
+/* 把第 level 级的第 idx 个槽中的定时器下放到低级别, 返回 idx */
+static uint32_t wheel_cascade(uint32_t level, uint32_t idx) {
+   struct list* slot = &wheel[level][idx];
+   while (!list_empty(slot)) {
+      wheel_insert(elem2entry(struct timer_list, elem, list_pop(slot)));
+   }
+   return idx;
+}
+
+/* 时钟中断中调用, 处理到当前 ticks 为止到期的定时器 */
+static void wheel_run(void) {
+   while ((int32_t)(ticks - wheel_ticks) >= 0) {
+      uint32_t idx = wheel_ticks & WHEEL_MASK;
+      uint32_t level = 1;
+      // 第 level-1 级转完一圈时下放第 level 级的下一个槽
+      while (idx == 0 && level < WHEEL_LEVELS) {
+	 idx = wheel_cascade(level, (wheel_ticks >> (WHEEL_BITS * level)) & WHEEL_MASK);
+	 level++;
+      }
+      struct list* slot = &wheel[0][wheel_ticks & WHEEL_MASK];
+      wheel_ticks++;
+      while (!list_empty(slot)) {
+	 struct timer_list* timer = elem2entry(struct timer_list, elem, list_pop(slot));
+	 timer->pending = false;
+	 timer->function(timer->arg);
+      }
+   }
+}
+
+/* 初始化定时器 timer, 到期时在时钟中断中调用 function(arg) */
+void timer_setup(struct timer_list* timer, void (*function)(void* arg), void* arg) {
+   timer->function = function;
+   timer->arg = arg;
+   timer->pending = false;
+}
+
+/* 让 timer 在第 expires 个嘀嗒到期, 已在等待的先取消 */
+void timer_add(struct timer_list* timer, uint32_t expires) {
+   enum intr_status old_status = intr_disable();
+   if (timer->pending) {
+      list_remove(&timer->elem);
+   }
+   timer->expires = expires;
+   timer->pending = true;
+   wheel_insert(timer);
+   intr_set_status(old_status);
+}
+
+/* 取消 timer, 它还没有到期返回 true */
+bool timer_del(struct timer_list* timer) {
+   enum intr_status old_status = intr_disable();
+   bool pending = timer->pending;
+   if (pending) {
+      list_remove(&timer->elem);
+      timer->pending = false;
+   }
+   intr_set_status(old_status);
+   return pending;
 }
 
 /* 把操作的计数器counter_no、读写锁属性rwl、计数器模式counter_mode写入模式控制寄存器井赋予初始值counter_value */
@@ -48,7 +150,219 @@ static void frequency_set(uint8_t counter_port,
     outb(counter_port, (uint8_t) counter_value);
 
     // 再写入高8位
-    outb(counter_port, (uint8_t) counter_value >> 8);
+    outb(counter_port, (uint8_t) (counter_value >> 8));
+}
+
+/***********************   高精度时钟   *****************************
+ * 嘀嗒只能分辨到 1000 / timer_hz 毫秒, 计时改用 TSC.
+ * 启动时让计数器2单次计数 CALIBRATE_MS 毫秒, 数这期间 TSC 走了多少, 得到 tsc_khz.
+ * TSC 的增量按 ns = cycles * clock_mult >> CLOCK_SHIFT 折算, 不用64位除法;
+ * 每次读时钟和每个时钟中断都把增量并入 clock_base_ns, 所以乘积不会溢出,
+ * 移位舍去的部分留在 clock_frac 里下次再算, 长时间运行也不会累积误差.
+ * 校准失败时 tsc_khz 为0, 退回按嘀嗒计时.
+ ******************************************************************/
+#define CALIBRATE_MS            10
+#define CALIBRATE_MAX_LOOPS     10000000    // 计数器2不工作时不至于一直等下去
+#define CLOCK_SHIFT             20
+#define NSEC_PER_MSEC           1000000
+
+static uint32_t tsc_khz;        // TSC 的频率, 单位 kHz
+static uint32_t clock_mult;     // 每个 TSC 周期的纳秒数左移 CLOCK_SHIFT 位
+static uint64_t clock_last_tsc; // 上次折算时的 TSC
+static uint64_t clock_base_ns;  // 上次折算时的时钟
+static uint32_t clock_frac;     // 上次折算移位舍去的部分
+
+static uint64_t rdtsc(void) {
+   uint64_t tsc;
+   asm volatile ("rdtsc" : "=A" (tsc));
+   return tsc;
+}
+
+/* 64位数 dividend 除以32位数 divisor, 余数存入 remainder(可为 NULL), 返回商.
+ * 用两次 divl 实现, 内核没有链接 libgcc 的64位除法 */
+uint64_t div_u64_rem(uint64_t dividend, uint32_t divisor, uint32_t* remainder) {
+   uint32_t high = dividend >> 32;
+   uint32_t quot_high = high / divisor;
+   uint32_t quot_low, rem;
+   asm ("divl %4" : "=a" (quot_low), "=d" (rem) : "a" ((uint32_t)dividend), "d" (high % divisor), "rm" (divisor));
+   if (remainder != NULL) {
+      *remainder = rem;
+   }
+   return (uint64_t)quot_high << 32 | quot_low;
+}
+
+/* 用计数器2校准 TSC, 返回 TSC 的频率(kHz), 失败返回0. 须在关中断下调用 */
+static uint32_t tsc_calibrate(void) {
+   // 打开计数器2的门, 关掉扬声器
+   outb(PIT_GATE_PORT, (inb(PIT_GATE_PORT) & ~0x02) | 0x01);
+   frequency_set(COUNTER2_PORT, COUNTER2_NO, READ_WRITE_LATCH, COUNTER_MODE_ONESHOT, \
+                 INPUT_FREQUENCY / 1000 * CALIBRATE_MS);
+   uint64_t start = rdtsc();
+   uint32_t loops = 0;
+   while (!(inb(PIT_GATE_PORT) & 0x20)) {
+      if (++loops == CALIBRATE_MAX_LOOPS) {
+         return 0;
+      }
+   }
+   uint64_t cycles = rdtsc() - start;
+   if (cycles >> 32 != 0) {
+      return 0;
+   }
+   return (uint32_t)cycles / CALIBRATE_MS;
+}
+
+/* 把上次折算以来 TSC 的增量并入 clock_base_ns, 须在关中断下调用 */
+static void clock_update(void) {
+   if (tsc_khz == 0) {
+      return;
+   }
+   uint64_t now = rdtsc();
+   uint64_t scaled = (now - clock_last_tsc) * clock_mult + clock_frac;
+   clock_last_tsc = now;
+   clock_base_ns += scaled >> CLOCK_SHIFT;
+   clock_frac = (uint32_t)scaled & ((1 << CLOCK_SHIFT) - 1);
+}
+
+/* 自 timer_init 以来单调递增的纳秒数 */
+uint64_t clock_ns(void) {
+   enum intr_status old_status = intr_disable();
+   uint64_t ns;
+   if (tsc_khz == 0) {
+      ns = (uint64_t)ticks * (NSEC_PER_SEC / timer_hz);
+   } else {
+      clock_update();
+      ns = clock_base_ns;
+   }
+   intr_set_status(old_status);
+   return ns;
+}
+
+/* 把 clock_id 时钟的当前值以秒和纳秒存入 tp, 成功返回0, 不支持的时钟返回-1 */
+int32_t sys_clock_gettime(int32_t clock_id, struct timespec* tp) {
+   uint64_t ns;
+   if (clock_id == CLOCK_MONOTONIC) {
+      ns = clock_ns();
+   } else if (clock_id == CLOCK_THREAD_CPUTIME_ID) {
+      // 已记入的运行时间加上这次上处理器以来的时间
+      struct task_struct* cur = running_thread();
+      enum intr_status old_status = intr_disable();
+      ns = cur->runtime_ns + (clock_ns() - cur->exec_start);
+      intr_set_status(old_status);
+   } else {
+      return -1;
+   }
+   tp->tv_sec = div_u64_rem(ns, NSEC_PER_SEC, &tp->tv_nsec);
+   return 0;
+}
+
+/***********************   动态嘀嗒   *****************************
+ * 只有 idle 可运行时, 周期性的时钟中断什么也不做, 在模拟器中还要为每次中断退出一次.
+ * 这时把计数器0改为单次模式, 定在时间轮上最近一个要处理的嘀嗒,
+ * 中间的嘀嗒都不发中断. 计数到0或者其它中断先把 idle 唤醒时,
+ * 按实际经过的计数补上 ticks 并处理到期的定时器, 再恢复周期模式.
+ * 计数初值只有16位, 一次最多停 COUNTER_MAX / counter_per_tick 个嘀嗒.
+ * 进入时这个周期已经过去的计数、提前唤醒时不足一个嘀嗒的计数都不丢:
+ * 单次计数从上一个已记入的嘀嗒算起, 提前唤醒后再用一次单次计数补齐这个嘀嗒,
+ * 它到期时才恢复周期模式, 所以 ticks 不会比实际时间越落越多.
+ ******************************************************************/
+static uint32_t nohz_ticks;     // 单次计数到0时要记入的嘀嗒数, 为0表示周期模式
+static uint32_t nohz_counter;   // 单次模式写入的计数初值
+static uint32_t nohz_base;      // 写入单次计数时, 距上一个已记入的嘀嗒已经过去的计数
+
+/* 改为单次模式, 从上一个已记入的嘀嗒算起 cnt_ticks 个嘀嗒后到期, 其中 base 个计数已经过去 */
+static void nohz_arm(uint32_t base, uint32_t cnt_ticks) {
+   nohz_base = base;
+   nohz_ticks = cnt_ticks;
+   nohz_counter = cnt_ticks * counter_per_tick - base;
+   frequency_set(COUNTER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, COUNTER_MODE_ONESHOT, nohz_counter);
+}
+
+/* 从下一个要处理的嘀嗒起, 最多 limit 个嘀嗒内第一个需要处理的是第几个 */
+static uint32_t wheel_idle_ticks(uint32_t limit) {
+   uint32_t cnt = 1;
+   while (cnt < limit) {
+      uint32_t idx = (wheel_ticks + cnt - 1) & WHEEL_MASK;
+      // 槽中有定时器, 或者第0级转完一圈要下放高级别的定时器
+      if (idx == 0 || !list_empty(&wheel[0][idx])) {
+	 break;
+      }
+      cnt++;
+   }
+   return cnt;
+}
+
+/* 结束单次计数, 返回上一个已记入的嘀嗒之后经过的整嘀嗒数.
+ * 正好停在嘀嗒上时恢复周期模式, 否则用单次计数补齐这个嘀嗒. 须在关中断下调用 */
+static uint32_t nohz_stop(void) {
+   outb(PIT_CONTROL_PORT, PIT_READ_BACK_COUNTER0);
+   uint8_t status = inb(COUNTER0_PORT);
+   uint32_t count = inb(COUNTER0_PORT);
+   count |= inb(COUNTER0_PORT) << 8;
+
+   uint32_t counts = nohz_counter;
+   if (!(status & PIT_STATUS_OUT)) {	 // 还没有计数到0, 是被其它中断唤醒的
+      counts = count > nohz_counter ? 0 : nohz_counter - count;
+   }
+   counts += nohz_base;
+   uint32_t partial = counts % counter_per_tick;
+   if (partial != 0) {
+      nohz_arm(partial, 1);
+   } else {
+      nohz_ticks = 0;
+      frequency_set(COUNTER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, COUNTER_MODE_PERIODIC, counter_per_tick);
+   }
+   return counts / counter_per_tick;
+}
+
+/* 时间前进 elapsed 个嘀嗒, 再处理到期的定时器 */
+static void tick_advance(uint32_t elapsed) {
+    ticks += elapsed;                       // 内核态和用户态总共的嘀嗒数
+    clock_update();                         // 至少每个时钟中断折算一次, 以免乘积溢出
+    wheel_run();
+}
+
+/* idle 在关中断下, 没有就绪任务时调用, 停掉周期时钟直到最近的定时器到期 */
+void timer_nohz_enter(void) {
+   ASSERT(intr_get_status() == INTR_OFF);
+   ASSERT(wheel_ticks == ticks + 1);
+   if (nohz_ticks != 0) {	 // 还在补齐上次提前唤醒剩下的嘀嗒, 不到一个嘀嗒就会到期
+      return;
+   }
+   // 时钟中断已在8259A中挂起, 说明刚过的嘀嗒还没记入, 先让它处理
+   outb(PIC_M_CTRL, PIC_READ_IRR);
+   if (inb(PIC_M_CTRL) & 0x01) {
+      return;
+   }
+   uint32_t max_ticks = COUNTER_MAX / counter_per_tick;
+   uint32_t idle_ticks = wheel_idle_ticks(max_ticks);
+   if (idle_ticks <= 1) {	 // 下一个嘀嗒就有事可做, 保持周期模式
+      return;
+   }
+   // 周期模式从 counter_per_tick 往下数, 已经数掉的部分属于下一个嘀嗒
+   outb(PIT_CONTROL_PORT, PIT_LATCH_COUNTER0);
+   uint32_t count = inb(COUNTER0_PORT);
+   count |= inb(COUNTER0_PORT) << 8;
+   nohz_arm(count > counter_per_tick ? 0 : counter_per_tick - count, idle_ticks);
+}
+
+/* idle 被唤醒后调用, 若单次计数还没有结束就补上经过的嘀嗒, 再恢复周期时钟 */
+void timer_nohz_exit(void) {
+   enum intr_status old_status = intr_disable();
+   if (nohz_ticks != 0) {
+      tick_advance(nohz_stop());
+   }
+   intr_set_status(old_status);
+}
+
+/* 时钟的中断处理函数 */
+static void intr_timer_handler(void) {
+    struct task_struct* cur_thread = running_thread();
+
+    ASSERT(cur_thread->stack_magic == 0x19870916);      // 检查栈是否溢出
+
+    // 单次模式下这次中断代表停掉的所有嘀嗒
+    tick_advance(nohz_ticks != 0 ? nohz_stop() : 1);    // 先唤醒到期的任务, 再决定是否换下当前任务
+    sched_tick();                       // 由当前任务的调度类决定是否换下它
 }
 
 
@@ -57,28 +371,57 @@ void timer_init() {
     put_str("timer_init start\n");
 
     // 设置8253的定时周期, 即发送中断的周期
-    frequency_set(COUNTER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, COUNTER_MODE, COUNTER0_VALUE);
+    // 先在关中断下校准 TSC, 高精度时钟从这里开始计时
+    tsc_khz = tsc_calibrate();
+    if (tsc_khz != 0) {
+        clock_mult = div_u64_rem((uint64_t)NSEC_PER_MSEC << CLOCK_SHIFT, tsc_khz, NULL);
+        clock_last_tsc = rdtsc();
+        put_str("   tsc khz: 0x");
+        put_int(tsc_khz);
+        put_str("\n");
+    } else {
+        put_str("   tsc calibration failed, clock falls back to ticks\n");
+    }
+
+    counter_per_tick = INPUT_FREQUENCY / timer_hz;
+    frequency_set(COUNTER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, COUNTER_MODE_PERIODIC, counter_per_tick);
+    uint32_t level, idx;
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        for (idx = 0; idx < WHEEL_SIZE; idx++) {
+            list_init(&wheel[level][idx]);
+        }
+    }
+    wheel_ticks = ticks + 1;             // 时间轮从下一个嘀嗒开始处理
     register_handler(0x20, intr_timer_handler);
     put_str("timer_init done\n");
 }
 
-#define IRQ0_FREQUENCY	   100
-
-#define mil_seconds_per_intr (1000 / IRQ0_FREQUENCY)	// 每多少毫秒发生一次中断
+/* 睡眠定时器到期, 唤醒睡眠的线程 */
+static void sleep_timeout(void* arg) {
+   thread_unblock((struct task_struct*)arg);
+}
 
 // 以 tick 为单位的 sleep, 任何时间形式的 sleep 会转换此 ticks 形式
+// 线程阻塞在时间轮上, 睡眠期间不在就绪队列中
 static void ticks_to_sleep(uint32_t sleep_ticks) {
-   uint32_t start_tick = ticks;
-   // 若间隔的 ticks 数不够便让出 cpu
-   while (ticks - start_tick < sleep_ticks) {
-      thread_yield();
-   }
+   struct timer_list timer;
+   timer_setup(&timer, sleep_timeout, running_thread());
+   enum intr_status old_status = intr_disable();
+   timer_add(&timer, ticks + sleep_ticks);
+   thread_block(TASK_BLOCKED);
+   intr_set_status(old_status);
+}
+
+/* 毫秒数换算成嘀嗒数, 不足一个嘀嗒按一个算 */
+uint32_t msecs_to_ticks(uint32_t m_seconds) {
+   // 分成整秒和余下的毫秒换算, 以免乘 timer_hz 时溢出
+   return m_seconds / 1000 * timer_hz + DIV_ROUND_UP(m_seconds % 1000 * timer_hz, 1000);
 }
 
 // 以毫秒为单位的 sleep
 void mtime_sleep(uint32_t m_seconds) {
    // 计算要休眠的 ticks数 
-   uint32_t sleep_ticks = DIV_ROUND_UP(m_seconds, mil_seconds_per_intr);
+   uint32_t sleep_ticks = msecs_to_ticks(m_seconds);
    ASSERT(sleep_ticks > 0);
    ticks_to_sleep(sleep_ticks);
 }
@@ -1,9 +1,60 @@
 #ifndef __DEVICE_TIME_H
 #define __DEVICE_TIME_H
 #include "stdint.h"
+#include "global.h"
+#include "list.h"
+
+extern uint32_t ticks;	 // 内核自中断开启以来总共的嘀嗒数
+extern uint32_t timer_hz;	 // 每秒的嘀嗒数
+
+#define NSEC_PER_SEC 1000000000
+
+/* clock_gettime 支持的时钟 */
+#define CLOCK_MONOTONIC 1		 // 自启动以来单调递增的时间
+#define CLOCK_THREAD_CPUTIME_ID 3	 // 当前任务占用处理器的时间
+
+struct timespec {
+   uint32_t tv_sec;
+   uint32_t tv_nsec;
+};
+
+/* 内核定时器, 到期时在时钟中断中以关中断调用 function(arg), function 不能阻塞 */
+struct timer_list {
+   struct list_elem elem;	 // 挂在时间轮的槽上
+   uint32_t expires;		 // 到期的嘀嗒
+   void (*function)(void* arg);
+   void* arg;
+   bool pending;		 // 已加入时间轮且尚未到期
+};
 
 void timer_init(void);
 
+void timer_setup(struct timer_list* timer, void (*function)(void* arg), void* arg);
+
+/* 让 timer 在第 expires 个嘀嗒到期, 已在等待的先取消 */
+void timer_add(struct timer_list* timer, uint32_t expires);
+
+/* 取消 timer, 它还没有到期返回 true */
+bool timer_del(struct timer_list* timer);
+
+/* 没有就绪任务时由 idle 在关中断下调用, 停掉周期时钟直到最近的定时器到期 */
+void timer_nohz_enter(void);
+
+/* idle 被唤醒后调用, 补上停掉的嘀嗒并恢复周期时钟 */
+void timer_nohz_exit(void);
+
+/* 自 timer_init 以来单调递增的纳秒数, 由 TSC 计时 */
+uint64_t clock_ns(void);
+
+/* 64位数除以32位数, 余数存入 remainder(可为 NULL), 返回商 */
+uint64_t div_u64_rem(uint64_t dividend, uint32_t divisor, uint32_t* remainder);
+
+/* 把 clock_id 时钟的当前值存入 tp, 成功返回0, 不支持的时钟返回-1 */
+int32_t sys_clock_gettime(int32_t clock_id, struct timespec* tp);
+
+/* 毫秒数换算成嘀嗒数, 不足一个嘀嗒按一个算 */
+uint32_t msecs_to_ticks(uint32_t m_seconds);
+
 void mtime_sleep(uint32_t m_seconds);
 
 #endif
@@ -10,10 +10,22 @@
 #include "string.h"
 #include "interrupt.h"
 #include "super_block.h"
+#include "slab.h"
 
 // 根目录
 struct dir root_dir;
 
+struct kmem_cache dir_cache;            // 打开的目录
+struct kmem_cache dir_sector_cache;     // 读目录项用的扇区缓冲区
+struct kmem_cache dir_blocks_cache;     // 目录的全部块地址(12 个直接块 + 128 个间接块)
+
+/* 创建目录及目录项缓冲区的对象缓存 */
+void dir_cache_init(void) {
+    kmem_cache_create(&dir_cache, "dir", sizeof(struct dir), NULL);
+    kmem_cache_create(&dir_sector_cache, "dir_sector", SECTOR_SIZE, NULL);
+    kmem_cache_create(&dir_blocks_cache, "dir_blocks", 48 + 512, NULL);
+}
+
 /* 打开根目录 */
 void open_root_dir(struct partition* part) {
     root_dir.inode = inode_open(part, part->sb->root_inode_no);
@@ -23,7 +35,7 @@ void open_root_dir(struct partition* part) {
 
 /* 在分区 part 上打开 i 结点为 inode_no 的目录并返回目录指针 */
 struct dir* dir_open(struct partition* part, uint32_t inode_no) {
-    struct dir* pdir = (struct dir*) sys_malloc(sizeof(struct dir));
+    struct dir* pdir = (struct dir*) kmem_cache_alloc(&dir_cache);
     pdir->inode = inode_open(part, inode_no);
     pdir->dir_pos = 0;
     return pdir;
@@ -36,9 +48,9 @@ bool search_dir_entry(struct partition* part, struct dir* pdir, const char* name
     // 12 个直接块 + 128 个一级间接块 = 140 块
     uint32_t block_cnt = 140;
     // 12 个直接块大小 + 128 个间接块, 共 560 字节
-    uint32_t* all_blocks = (uint32_t*) sys_malloc(48 + 512);
+    uint32_t* all_blocks = (uint32_t*) kmem_cache_alloc(&dir_blocks_cache);
     if(all_blocks == NULL) {
-        printk("search_dir_entry: sys_malloc for all_blocks failed");
+        printk("search_dir_entry: alloc for all_blocks failed");
         return false;
     }
 
@@ -52,12 +64,20 @@ bool search_dir_entry(struct partition* part, struct dir* pdir, const char* name
     if(pdir->inode->i_sectors[12] != 0) {
         // 若含有一级间接块表
         ide_read(part->my_disk, pdir->inode->i_sectors[12], all_blocks + 12, 1);
+    } else {
+        // 缓存分配的内存不清零, 没有间接块时要把间接块部分清 0
+        memset(all_blocks + 12, 0, 512);
     }
     // 至此, all_blocks 存储的是该文件或目录的所有扇区地址
 
     // 写目录项的时候已保证目录项不跨扇区
     // 这样读目录项时容易处理, 只申请容纳 1 个扇区的内存
-    uint8_t* buf = (uint8_t*) sys_malloc(SECTOR_SIZE);
+    uint8_t* buf = (uint8_t*) kmem_cache_alloc(&dir_sector_cache);
+    if(buf == NULL) {
+        printk("search_dir_entry: alloc for buf failed");
+        kmem_cache_free(&dir_blocks_cache, all_blocks);
+        return false;
+    }
     // p_de 为指向目录项的指针, 值为 buf 起始地址
     struct dir_entry* p_de = (struct dir_entry*) buf;
     uint32_t dir_entry_size = part->sb->dir_entry_size;
@@ -80,8 +100,8 @@ bool search_dir_entry(struct partition* part, struct dir* pdir, const char* name
             // 若找到了, 就直接复制整个目录项
             if (!strcmp(p_de->filename, name)) {
                 memcpy(dir_e, p_de, dir_entry_size);
-                sys_free(buf);
-                sys_free(all_blocks);
+                kmem_cache_free(&dir_sector_cache, buf);
+                kmem_cache_free(&dir_blocks_cache, all_blocks);
                 return true;
             }
             dir_entry_idx++;
@@ -93,8 +113,8 @@ bool search_dir_entry(struct partition* part, struct dir* pdir, const char* name
         // 将 buf 清 0, 下次再用
         memset(buf, 0, SECTOR_SIZE);
     }
-    sys_free(buf);
-    sys_free(all_blocks);
+    kmem_cache_free(&dir_sector_cache, buf);
+    kmem_cache_free(&dir_blocks_cache, all_blocks);
     return false;
 }
 
@@ -105,7 +125,7 @@ void dir_close(struct dir* dir) {
         return;
     }
     inode_close(dir->inode);
-    sys_free(dir);
+    kmem_cache_free(&dir_cache, dir);
 }
 
 
@@ -27,6 +27,9 @@ struct dir_entry {
 // 根目录
 extern struct dir root_dir;
 
+/* 创建目录及目录项缓冲区的对象缓存 */
+void dir_cache_init(void);
+
 /* 打开根目录 */
 void open_root_dir(struct partition* part);
 
@@ -9,12 +9,25 @@
 #include "string.h"
 #include "../thread/thread.h"
 #include "global.h"
+#include "../userprog/image_cache.h"
+#include "slab.h"
 
 #define DEFAULT_SECS    1
 
 /* 文件表 */
 struct file file_table[MAX_FILE_OPEN];
 
+/* 读写文件用的缓冲区取自内核内存池. 若在用户进程的堆中, 读写途中可能被换出,
+ * 而换入又要读盘 */
+struct kmem_cache file_sector_cache;    // 读写文件内容的扇区缓冲区
+struct kmem_cache file_blocks_cache;    // 文件的全部块地址(12 个直接块 + 128 个间接块)
+
+/* 创建读写文件用的缓冲区的对象缓存 */
+void file_cache_init(void) {
+    kmem_cache_create(&file_sector_cache, "file_sector", BLOCK_SIZE, NULL);
+    kmem_cache_create(&file_blocks_cache, "file_blocks", BLOCK_SIZE + 48, NULL);
+}
+
 /* 从文件表 file_table 中获取一个空闲位, 成功返回下标, 失败返回 -1 */
 int32_t get_free_slot_in_global(void) {
     uint32_t fd_idx = 3;
@@ -120,11 +133,11 @@ int32_t file_create(struct dir* parent_dir, char* filename, uint8_t flag) {
         return -1;
     }
 
-    // 此 inode 要从堆中申请内存, 不可生成局部变量(函数退出时会释放)
+    // 此 inode 要从 inode 缓存中申请内存, 不可生成局部变量(函数退出时会释放)
     // 因为 file_table 数组中的文件描述符的 inode 指针要指向它
-    struct inode* new_file_inode = (struct inode*) sys_malloc(sizeof(struct inode));
+    struct inode* new_file_inode = (struct inode*) kmem_cache_alloc(&inode_cache);
     if(new_file_inode == NULL) {
-        printk("file_create: sys_malloc for inode failed\n");
+        printk("file_create: alloc for inode failed\n");
         rollback_step = 1;
         goto rollback;
     }
@@ -190,7 +203,7 @@ rollback:
             memset(&file_table[fd_idx], 0, sizeof(struct file));
         
         case 2:
-            sys_free(new_file_inode);
+            kmem_cache_free(&inode_cache, new_file_inode);
 
         case 1:
             // 如果新文件的 inode 创建失败
@@ -282,18 +295,25 @@ int32_t file_write(struct file* file, const void* buf, uint32_t count) {
         return -1;
     }
 
-    uint8_t* io_buf = sys_malloc(512);
+    // 文件内容要变了, 缓存的映像页作废
+    image_cache_invalidate(file->fd_inode->i_no);
+
+    uint8_t* io_buf = kmem_cache_alloc(&file_sector_cache);
     if(io_buf == NULL) {
-        printk("file_write: sys_malloc for io_buf failed\n");
+        printk("file_write: kmem_cache_alloc for io_buf failed\n");
         return -1;
     }
 
     // 用来记录文件所有的块地址
-    uint32_t* all_blocks = (uint32_t*) sys_malloc(BLOCK_SIZE + 48);
+    uint32_t* all_blocks = (uint32_t*) kmem_cache_alloc(&file_blocks_cache);
     if(all_blocks == NULL) {
-        printk("file_write: sys_malloc for all_blocks failed\n");
+        printk("file_write: kmem_cache_alloc for all_blocks failed\n");
+        kmem_cache_free(&file_sector_cache, io_buf);
         return -1;
     }
+    // 对象缓存分配的内存不会清零
+    memset(io_buf, 0, BLOCK_SIZE);
+    memset(all_blocks, 0, BLOCK_SIZE + 48);
 
     const uint8_t* src = buf;       // 用 src 指向 buf 中待写入的数据
     uint32_t bytes_written = 0;     // 用来记录已写入数据大小
@@ -504,8 +524,8 @@ int32_t file_write(struct file* file, const void* buf, uint32_t count) {
 
     // 同步 inode
     inode_sync(cur_part, file->fd_inode, io_buf);
-    sys_free(all_blocks);
-    sys_free(io_buf);
+    kmem_cache_free(&file_blocks_cache, all_blocks);
+    kmem_cache_free(&file_sector_cache, io_buf);
     return bytes_written;
 }
 
@@ -524,18 +544,22 @@ int32_t file_read(struct file* file, void* buf, uint32_t count) {
         }
     }
 
-    uint8_t* io_buf = sys_malloc(BLOCK_SIZE);
+    uint8_t* io_buf = kmem_cache_alloc(&file_sector_cache);
     if(io_buf == NULL) {
-        printk("file_read: sys_malloc for io_buf failed\n");
+        printk("file_read: kmem_cache_alloc for io_buf failed\n");
         return -1;
     }
 
     // 用来记录文件所有的块地址
-    uint32_t* all_blocks = (uint32_t*) sys_malloc(BLOCK_SIZE + 48);
+    uint32_t* all_blocks = (uint32_t*) kmem_cache_alloc(&file_blocks_cache);
     if(all_blocks == NULL) {
-        printk("file_read: sys_malloc for all_blocks failed\n");
+        printk("file_read: kmem_cache_alloc for all_blocks failed\n");
+        kmem_cache_free(&file_sector_cache, io_buf);
         return -1;
     }
+    // 对象缓存分配的内存不会清零
+    memset(io_buf, 0, BLOCK_SIZE);
+    memset(all_blocks, 0, BLOCK_SIZE + 48);
 
     uint32_t block_read_start_idx = file->fd_pos / BLOCK_SIZE;          // 数据所在块的起始地址
     uint32_t block_read_end_idx = (file->fd_pos + size) / BLOCK_SIZE;   // 数据所在块的终止地址
@@ -625,8 +649,8 @@ int32_t file_read(struct file* file, void* buf, uint32_t count) {
         bytes_read += chunk_size;
         size_left -= chunk_size;
     }
-    sys_free(all_blocks);
-    sys_free(io_buf);
+    kmem_cache_free(&file_blocks_cache, all_blocks);
+    kmem_cache_free(&file_sector_cache, io_buf);
     return bytes_read;
 }
 
@@ -30,6 +30,9 @@ enum bitmap_type {
 
 extern struct file file_table[MAX_FILE_OPEN];
 
+/* 创建读写文件用的缓冲区的对象缓存 */
+void file_cache_init(void);
+
 /* 分配一个 i 结点, 返回 i 结点号 */
 int32_t inode_bitmap_alloc(struct partition* part);
 
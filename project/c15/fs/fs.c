@@ -10,6 +10,7 @@
 #include "global.h"
 #include "debug.h"
 #include "memory.h"
+#include "swap.h"
 #include "file.h"
 #include "console.h"
 #include "../thread/thread.h"
@@ -190,6 +191,8 @@ static bool mount_partition(struct list_elem* pelem, int arg) {
         cur_part->block_bitmap.btmp_bytes_len = sb_buf->block_bitmap_sects * SECTOR_SIZE;
         // 从硬盘上读入块位图到分区的 block_bitmap.bits
         ide_read(hd, sb_buf->block_bitmap_lba, cur_part->block_bitmap.bits, sb_buf->block_bitmap_sects);
+        // 位图内容是直接读入的, 需要重建二级摘要
+        bitmap_summary_rebuild(&cur_part->block_bitmap);
 
         // 将硬盘上的 inode 位图读入到内存
         cur_part->inode_bitmap.bits = (uint8_t*) sys_malloc(sb_buf->inode_bitmap_sects * SECTOR_SIZE);
@@ -199,6 +202,8 @@ static bool mount_partition(struct list_elem* pelem, int arg) {
         cur_part->inode_bitmap.btmp_bytes_len = sb_buf->inode_bitmap_sects * SECTOR_SIZE;
         // 从硬盘上读入 inode 位图到分区的 inode_bitmap.bits
         ide_read(hd, sb_buf->inode_bitmap_lba, cur_part->inode_bitmap.bits, sb_buf->inode_bitmap_sects);
+        // 位图内容是直接读入的, 需要重建二级摘要
+        bitmap_summary_rebuild(&cur_part->inode_bitmap);
 
         list_init(&cur_part->open_inodes);
         printk("mount %s done!\n", part->name);
@@ -219,6 +224,11 @@ void filesys_init() {
     if(sb_buf == NULL) {
         PANIC("alloc memory failed!");
     }
+    // 创建文件系统用到的对象缓存
+    inode_cache_init();
+    dir_cache_init();
+    file_cache_init();
+
     printk("searching filesystem......\n");
     while(channel_no < channel_cnt) {
         dev_no = 0;
@@ -238,8 +248,8 @@ void filesys_init() {
                     part = hd->logic_parts;
                 }
 
-                if(part->sec_cnt != 0) {
-                    // 如果分区存在
+                if(part->sec_cnt != 0 && part != swap_part) {
+                    // 如果分区存在, 用作交换区的分区不能格式化
                     memset(sb_buf, 0, SECTOR_SIZE);
                     // 读出分区的超级块, 根据魔数是否正确来判断是否存在文件系统
                     ide_read(hd, part->start_lba + 1, sb_buf, 1);
@@ -570,6 +580,18 @@ int32_t sys_unlink(const char* pathname) {
     }
     ASSERT(file_idx == MAX_FILE_OPEN);
 
+    // 不在文件表中, 但 inode 仍被打开着, 说明是运行中的程序的映像文件, 也不允许删除
+    struct list_elem* elem = cur_part->open_inodes.head.next;
+    while(elem != &cur_part->open_inodes.tail) {
+        struct inode* open_inode = elem2entry(struct inode, inode_tag, elem);
+        if(open_inode->i_no == (uint32_t) inode_no) {
+            dir_close(searched_record.parent_dir);
+            printk("file %s is in use, not allow to delete!\n", pathname);
+            return -1;
+        }
+        elem = elem->next;
+    }
+
     // 为 delete_dir_entry 申请缓冲区
     void* io_buf = sys_malloc(SECTOR_SIZE + SECTOR_SIZE);
     if (io_buf == NULL) {
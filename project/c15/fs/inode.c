@@ -7,10 +7,18 @@
 #include "interrupt.h"
 #include "list.h"
 #include "stdio-kernel.h"
+#include "../userprog/image_cache.h"
 #include "string.h"
 #include "super_block.h"
 #include "../thread/thread.h"
 
+struct kmem_cache inode_cache;     // 内存中 inode 的对象缓存
+
+/* 创建 inode 对象缓存 */
+void inode_cache_init(void) {
+    kmem_cache_create(&inode_cache, "inode", sizeof(struct inode), NULL);
+}
+
 /* 用来存储 inode 位置 */
 struct inode_position {
     bool two_sec;       // inode 是否跨扇区
@@ -112,15 +120,8 @@ struct inode* inode_open(struct partition* part, uint32_t inode_no) {
     // 包括 inode 所在扇区地址和扇区内的字节偏移量
     inode_locate(part, inode_no, &inode_pos);
 
-    // 为使通过 sys_malloc 创建的新 inode 被所有任务共享
-    // 需要将 inode 置于内核空间, 故需要临时将 cur_pbc->pgdir 置为 NULL
-    struct task_struct* cur = running_thread();
-    uint32_t* cur_pagedir_bak = cur->pgdir;
-    cur->pgdir = NULL;
-    // 以上三行代码完成后下面分配的内存将位于内核区
-    inode_found = (struct inode*) sys_malloc(sizeof(struct inode));
-    // 恢复 pgdir
-    cur->pgdir = cur_pagedir_bak;
+    // inode 要被所有任务共享, 所以从内核的 inode 缓存中分配
+    inode_found = (struct inode*) kmem_cache_alloc(&inode_cache);
 
     char* inode_buf;
     if(inode_pos.two_sec) {
@@ -152,14 +153,8 @@ void inode_close(struct inode* inode) {
     if (--inode->i_open_cnts == 0) {
         // 将 inode 结点从 part->open_inodes 中去掉
         list_remove(&inode->inode_tag);
-        // inode_open 时为实现 inode 被所有进程共享
-        // 已经在 sys_malloc 为 inode 分配了内核空间
-        // 释放 inode 时也要确保释放的是内核内存池
-        struct task_struct* cur = running_thread();
-        uint32_t* cur_pagedir_bak = cur->pgdir;
-        cur->pgdir = NULL;
-        sys_free(inode);
-        cur->pgdir = cur_pagedir_bak;
+        // 归还给 inode 缓存
+        kmem_cache_free(&inode_cache, inode);
     }
     intr_set_status(old_status);
 }
@@ -216,6 +211,9 @@ void inode_release(struct partition* part, uint32_t inode_no) {
     struct inode* inode_to_del = inode_open(part, inode_no);
     ASSERT(inode_to_del->i_no == inode_no);
 
+    // inode 编号以后会给别的文件用, 先丢掉此文件的映像缓存页
+    image_cache_invalidate(inode_no);
+
     // 1. 回收 inode 占用的所有块
     uint8_t block_idx = 0, block_cnt = 12;
     uint32_t block_bitmap_idx;
@@ -4,6 +4,7 @@
 #include "stdint.h"
 #include "list.h"
 #include "../device/ide.h"
+#include "slab.h"
 
 /* inode 结构 */
 struct inode {
@@ -23,6 +24,12 @@ struct inode {
     					            // 直接通过 list_elem 得到 inode 而不用再读取硬盘
 };
 
+// 所有内存中的 inode 都从这里分配
+extern struct kmem_cache inode_cache;
+
+/* 创建 inode 对象缓存 */
+void inode_cache_init(void);
+
 /* 根据 i 结点号返回相应的 i 结点 */
 struct inode* inode_open(struct partition* part, uint32_t inode_no);
 
@@ -3,6 +3,11 @@
 #include "interrupt.h"
 #include "../device/timer.h"
 #include "memory.h"
+#include "slab.h"
+#include "vma.h"
+#include "ksm.h"
+#include "swap.h"
+#include "../userprog/image_cache.h"
 #include "../thread/thread.h"
 #include "../device/console.h"
 #include "../device/keyboard.h"
@@ -16,13 +21,18 @@ void init_all() {
     put_str("init_all\n");
     idt_init();         // 初始化中断
     mem_init();         // 初始化内存管理系统
+    slab_init();        // 初始化 slab 分配器
+    vma_init();         // 初始化虚拟内存区的对象缓存
+    image_cache_init(); // 初始化可执行映像缓存
     thread_init();      // 初始化线程相关结构
     timer_init();       // 初始化 PIT
+    ksm_init();         // 启动合并相同用户页的 ksmd 线程
     console_init();     // 初始化终端
     keyboard_init();    // 键盘初始化
     tss_init();         // tss 初始化
     syscall_init();     // 初始化系统调用
     intr_enable();      // 后面的 ide_init 需要打开中断
     ide_init();         // 初始化硬盘
+    swap_init();        // 选定交换区, 要在格式化分区之前
     filesys_init();     // 初始化文件系统
 }
@@ -0,0 +1,275 @@
+#include "ksm.h"
+#include "memory.h"
+#include "global.h"
+#include "debug.h"
+#include "list.h"
+#include "slab.h"
+#include "string.h"
+#include "interrupt.h"
+#include "../thread/thread.h"
+#include "../device/timer.h"
+
+/*********************  合并内容相同的用户页  ****************************
+ * 同一个小程序常常同时跑好几份, 它们的数据、栈和清0的页很多是逐字节相同的.
+ * 内核线程 ksmd 在后台按页框号扫描 mem_map, 对只被一个进程映射的用户页框
+ * 计算内容的哈希, 到两张表中找内容相同的页框:
+ *   稳定表: 已经合并成的共享页框, ksmd 自己占它一个引用;
+ *   不稳定表: 本遍扫描中见过的独占页框, 每遍开始时清空.
+ * 在稳定表中找到就把当前页改为映射那个共享页框并释放自己的页框;
+ * 在不稳定表中找到就先把那个页框升级为共享页框移入稳定表, 再把当前页并过去.
+ * 共享页框以只读+写时复制的方式映射, 以后谁写谁在缺页异常中复制出自己的页框,
+ * 与 fork 共享的页走同一条路.
+ * 哈希只用来查找, 合并前在关中断下比较整页内容并重新检查映射关系.
+ * 被改动页表的进程此时一定不在运行, 切换回它时会重新加载 cr3, 不需要刷新 tlb.
+ * 只剩 ksmd 自己引用的共享页框在每遍扫描开始时释放.
+ ************************************************************************/
+
+#define KSM_HASH_SIZE 64
+#define KSM_PAGES_DEFAULT 64	 // 默认每轮扫描的用户页数
+#define KSM_SLEEP_DEFAULT 500	 // 默认两轮之间休眠的毫秒数
+
+/* 稳定表或不稳定表中的一个页框 */
+struct ksm_item {
+   uint32_t hash;		 // 页框内容的哈希
+   uint32_t phy_addr;		 // 页框的物理地址
+   struct list_elem hash_tag;	 // 用于加入表中的桶
+};
+
+static struct list ksm_stable[KSM_HASH_SIZE];
+static struct list ksm_unstable[KSM_HASH_SIZE];
+static struct kmem_cache ksm_item_cache;
+
+static uint32_t ksm_pages_per_scan = KSM_PAGES_DEFAULT;
+static uint32_t ksm_sleep_ms = KSM_SLEEP_DEFAULT;
+static uint32_t ksm_cursor;	 // 下一个要扫描的页框在 mem_map 中的下标
+static uint32_t ksm_full_scans;
+static uint32_t ksm_pages_shared;
+static uint32_t ksm_pages_merged;
+uint32_t ksm_pages_unshared;	 // 由缺页异常处理程序在复制共享页框时累加
+
+/* 计算一页内容的哈希(FNV-1a, 按双字计算) */
+static uint32_t ksm_hash(const uint32_t* words) {
+   uint32_t hash = 2166136261u, idx = 0;
+   while (idx < PG_SIZE / 4) {
+      hash = (hash ^ words[idx++]) * 16777619;
+   }
+   return hash;
+}
+
+/* pg 是否可以合并: 已分配给用户并且只被一个进程映射 */
+static bool ksm_candidate(struct page* pg) {
+   return (pg->flags & (PAGE_USER | PAGE_KSM)) == PAGE_USER && \
+      pg->ref_cnt == 1 && pg->owner != NULL && pg->owner->pgdir != NULL;
+}
+
+/* 比较两个页框的内容是否相同, 须在关中断下调用 */
+static bool ksm_same(uint32_t phy_a, uint32_t phy_b) {
+   void* vaddr_a = kmap(phy_a);
+   void* vaddr_b = kmap(phy_b);
+   bool same = memcmp(vaddr_a, vaddr_b, PG_SIZE) == 0;
+   kunmap(vaddr_b);
+   kunmap(vaddr_a);
+   return same;
+}
+
+/* 把页表项 pte 改为映射共享页框 phy_addr, 可写的页改为只读+写时复制 */
+static void ksm_pte_set(uint32_t* pte, uint32_t phy_addr) {
+   uint32_t value = phy_addr | (*pte & 0x00000fff);
+   if (value & PG_RW_W) {
+      value = (value & ~PG_RW_W) | PG_COW;
+   }
+   *pte = value;
+   kunmap((void*)((uint32_t)pte & 0xfffff000));
+}
+
+/* 把独占页框 pg 升级为共享页框, ksmd 占它一个引用. 须在关中断下调用 */
+static bool ksm_stabilize(struct page* pg) {
+   uint32_t* pte = page_owner_pte(pg);
+   if (pte == NULL) {
+      return false;
+   }
+   uint32_t phy_addr = page_to_phy(pg);
+   ksm_pte_set(pte, phy_addr);
+   page_share(phy_addr);
+   pg->flags |= PAGE_KSM;
+   ksm_pages_shared++;
+   return true;
+}
+
+/* 把独占页框 pg 的映射改到共享页框 shared_phy 上并释放 pg. 须在关中断下调用 */
+static void ksm_merge(struct page* pg, uint32_t shared_phy) {
+   uint32_t* pte = page_owner_pte(pg);
+   if (pte == NULL) {
+      return;
+   }
+   ksm_pte_set(pte, shared_phy);
+   page_share(shared_phy);
+   pfree(page_to_phy(pg));
+   ksm_pages_merged++;
+}
+
+/* 在表 table 中找内容与页框 phy_addr 相同的另一个页框, 没有返回 NULL.
+ * 不稳定表中的页框可能已经变了, 要重新确认仍可合并. 须在关中断下调用 */
+static struct ksm_item* ksm_lookup(struct list* table, uint32_t hash, uint32_t phy_addr) {
+   struct list* bucket = &table[hash % KSM_HASH_SIZE];
+   struct list_elem* elem = bucket->head.next;
+   while (elem != &bucket->tail) {
+      struct ksm_item* item = elem2entry(struct ksm_item, hash_tag, elem);
+      if (item->hash == hash && item->phy_addr != phy_addr && \
+	    (table == ksm_stable || ksm_candidate(phy_to_page(item->phy_addr))) && \
+	    ksm_same(item->phy_addr, phy_addr)) {
+	 return item;
+      }
+      elem = elem->next;
+   }
+   return NULL;
+}
+
+/* 扫描页框 pg, 不是可合并的页框返回 false.
+ * 没有找到相同的页框时用 *spare 记入不稳定表, 并把 *spare 置为 NULL */
+static bool ksm_scan_page(struct page* pg, struct ksm_item** spare) {
+   enum intr_status old_status = intr_disable();
+   if (!ksm_candidate(pg)) {
+      intr_set_status(old_status);
+      return false;
+   }
+   uint32_t phy_addr = page_to_phy(pg);
+   uint32_t* words = kmap(phy_addr);
+   uint32_t hash = ksm_hash(words);
+   kunmap(words);
+
+   struct ksm_item* item = ksm_lookup(ksm_stable, hash, phy_addr);
+   if (item != NULL) {
+      ksm_merge(pg, item->phy_addr);
+   } else if ((item = ksm_lookup(ksm_unstable, hash, phy_addr)) != NULL) {
+      // 本遍见过内容相同的独占页框, 把它升级为共享页框移入稳定表
+      if (ksm_stabilize(phy_to_page(item->phy_addr))) {
+	 list_remove(&item->hash_tag);
+	 list_push(&ksm_stable[hash % KSM_HASH_SIZE], &item->hash_tag);
+	 ksm_merge(pg, item->phy_addr);
+      }
+   } else if (*spare != NULL) {
+      (*spare)->hash = hash;
+      (*spare)->phy_addr = phy_addr;
+      list_push(&ksm_unstable[hash % KSM_HASH_SIZE], &(*spare)->hash_tag);
+      *spare = NULL;
+   }
+   intr_set_status(old_status);
+   return true;
+}
+
+/* 从 bucket 中摘下一项: 不稳定表的任意一项, 或稳定表中只剩 ksmd 引用的共享页框
+ * (同时释放该页框), 没有返回 NULL */
+static struct ksm_item* ksm_bucket_take(struct list* bucket, bool stable) {
+   struct ksm_item* found = NULL;
+   enum intr_status old_status = intr_disable();
+   struct list_elem* elem = bucket->head.next;
+   while (elem != &bucket->tail) {
+      struct ksm_item* item = elem2entry(struct ksm_item, hash_tag, elem);
+      if (!stable) {
+	 found = item;
+	 break;
+      }
+      if (page_map_cnt(item->phy_addr) == 1) {
+	 phy_to_page(item->phy_addr)->flags &= ~PAGE_KSM;
+	 pfree(item->phy_addr);
+	 ksm_pages_shared--;
+	 found = item;
+	 break;
+      }
+      elem = elem->next;
+   }
+   if (found != NULL) {
+      list_remove(&found->hash_tag);
+   }
+   intr_set_status(old_status);
+   return found;
+}
+
+/* 每遍扫描开始时清空不稳定表, 释放没有进程再映射的共享页框 */
+static void ksm_pass_start(void) {
+   uint32_t bucket_idx = 0;
+   while (bucket_idx < KSM_HASH_SIZE) {
+      struct ksm_item* item;
+      while ((item = ksm_bucket_take(&ksm_unstable[bucket_idx], false)) != NULL) {
+	 kmem_cache_free(&ksm_item_cache, item);
+      }
+      while ((item = ksm_bucket_take(&ksm_stable[bucket_idx], true)) != NULL) {
+	 kmem_cache_free(&ksm_item_cache, item);
+      }
+      bucket_idx++;
+   }
+}
+
+/* ksmd 线程: 每轮扫描 ksm_pages_per_scan 个用户页后休眠 ksm_sleep_ms 毫秒 */
+static void ksmd(void* arg UNUSED) {
+   struct ksm_item* spare = NULL;
+   while (1) {
+      uint32_t scanned = 0;
+      bool wrapped = false;	 // 一轮最多走完一遍 mem_map, 没有用户页时不空转
+      while (scanned < ksm_pages_per_scan && !wrapped) {
+	 if (ksm_cursor == 0) {
+	    ksm_pass_start();
+	 }
+	 if (spare == NULL) {
+	    spare = kmem_cache_alloc(&ksm_item_cache);
+	 }
+	 if (ksm_scan_page(&mem_map[ksm_cursor], &spare)) {
+	    scanned++;
+	 }
+	 if (++ksm_cursor == mem_map_cnt) {
+	    ksm_cursor = 0;
+	    ksm_full_scans++;
+	    wrapped = true;
+	 }
+      }
+      mtime_sleep(ksm_sleep_ms);
+   }
+}
+
+/* 初始化并启动扫描线程 ksmd */
+void ksm_init(void) {
+   uint32_t idx = 0;
+   while (idx < KSM_HASH_SIZE) {
+      list_init(&ksm_stable[idx]);
+      list_init(&ksm_unstable[idx]);
+      idx++;
+   }
+   kmem_cache_create(&ksm_item_cache, "ksm_item", sizeof(struct ksm_item), NULL);
+   thread_start("ksmd", 10, ksmd, NULL);
+}
+
+/* 设置扫描速率, 参数为负表示不修改; stat 不为 NULL 时填入当前情况. 返回0 */
+int32_t sys_ksm_ctl(int32_t pages_per_scan, int32_t sleep_ms, struct ksm_stat* stat) {
+   if (pages_per_scan >= 0) {
+      ksm_pages_per_scan = pages_per_scan;	 // 为0时 ksmd 只休眠不扫描
+   }
+   if (sleep_ms > 0) {
+      ksm_sleep_ms = sleep_ms;
+   }
+   if (stat == NULL) {
+      return 0;
+   }
+   stat->pages_per_scan = ksm_pages_per_scan;
+   stat->sleep_ms = ksm_sleep_ms;
+   stat->full_scans = ksm_full_scans;
+   stat->pages_merged = ksm_pages_merged;
+   stat->pages_unshared = ksm_pages_unshared;
+
+   /* 每个共享页框中 ksmd 自己占一个引用, 其余都是进程的映射 */
+   enum intr_status old_status = intr_disable();
+   stat->pages_shared = ksm_pages_shared;
+   stat->pages_sharing = 0;
+   uint32_t bucket_idx = 0;
+   while (bucket_idx < KSM_HASH_SIZE) {
+      struct list_elem* elem = ksm_stable[bucket_idx].head.next;
+      while (elem != &ksm_stable[bucket_idx].tail) {
+	 struct ksm_item* item = elem2entry(struct ksm_item, hash_tag, elem);
+	 stat->pages_sharing += page_map_cnt(item->phy_addr) - 1;
+	 elem = elem->next;
+      }
+      bucket_idx++;
+   }
+   intr_set_status(old_status);
+   return 0;
+}
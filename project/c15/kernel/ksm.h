@@ -0,0 +1,24 @@
+#ifndef __KERNEL_KSM_H
+#define __KERNEL_KSM_H
+#include "stdint.h"
+
+/* ksm_ctl 返回的合并相同页的情况 */
+struct ksm_stat {
+   uint32_t pages_per_scan;	 // 每轮扫描的用户页数, 为0时暂停扫描
+   uint32_t sleep_ms;		 // 两轮扫描之间休眠的毫秒数
+   uint32_t full_scans;		 // 完整扫描全部物理内存的遍数
+   uint32_t pages_shared;	 // 当前被合并成共享页框的页框数
+   uint32_t pages_sharing;	 // 当前映射着共享页框的页表项数, 减去 pages_shared 即省下的页框数
+   uint32_t pages_merged;	 // 累计因合并而释放的页框数
+   uint32_t pages_unshared;	 // 累计因写入而从共享页框复制出去的次数
+};
+
+extern uint32_t ksm_pages_unshared;
+
+/* 初始化并启动扫描线程 ksmd */
+void ksm_init(void);
+
+/* 设置扫描速率, 参数为负表示不修改; stat 不为 NULL 时填入当前情况. 返回0 */
+int32_t sys_ksm_ctl(int32_t pages_per_scan, int32_t sleep_ms, struct ksm_stat* stat);
+
+#endif
@@ -8,30 +8,82 @@
 #include "interrupt.h"
 #include "../thread/sync.h"
 #include "../thread/thread.h"
-
-
-/***************  位图地址 ********************
- * 因为0xc009f000是内核主线程栈顶，0xc009e000是内核主线程的pcb.
- * 一个页框大小的位图可表示128M内存, 位图位置安排在地址0xc009a000,
- * 这样本系统最大支持4个页框的位图,即512M */
-#define MEM_BITMAP_BASE 0xc009a000
+#include "../userprog/process.h"
+#include "../userprog/exec.h"
+#include "../userprog/image_cache.h"
+#include "slab.h"
+#include "vma.h"
+#include "ksm.h"
+#include "swap.h"
+
+
+/***************  物理内存布局 ********************
+ * loader 用 BIOS 的 e820 功能得到的 ARDS 存放在 ARDS_BUF 处, 数量在 ARDS_NR 处,
+ * 总容量在 TOTAL_MEM_BYTES 处(e820 失败时只有它可用).
+ * 低端1M和其后loader建立的页目录表及页表共2M不参与分配, 其余的可用内存
+ * 最前面是伙伴系统和位图等元信息, 大小随内存容量而定, 之后的可用内存按4M分块,
+ * 由内核内存池、用户内存池和公共储备动态划分, 见下面的"内存池的动态平衡".
+ **************************************************/
+#define TOTAL_MEM_BYTES 0xb00
+#define ARDS_BUF 0xb0a
+#define ARDS_NR 0xbfe
+#define ARDS_MAX 12		   // ARDS_BUF 244字节最多放12个ARDS
+#define ARDS_TYPE_RAM 1	   // 可供操作系统使用的内存
+#define MEM_RESERVED_END 0x200000  // 低端1M + 页目录表和255个页表
+#define PHY_ADDR_MAX 0xfffff000    // 4G以下最后一个页框, 以上的内存32位地址用不到
+
+/* 内核池的页框都要在内核虚拟地址池中有对应的虚拟页, 内核堆在 K_HEAP_START 到
+ * 页目录项1023(页表自映射)之间, 所以内核池连同元信息最多这么多页 */
+#define KERNEL_VPAGES_MAX ((0xffc00000 - K_HEAP_START) / PG_SIZE)
 /*************************************/
 
 #define PDE_IDX(addr) ((addr & 0xffc00000) >> 22)
 #define PTE_IDX(addr) ((addr & 0x003ff000) >> 12)
 
-/* 0xc0000000是内核从虚拟地址3G起. 0x100000意指跨过低端1M内存,使虚拟地址在逻辑上连续 */
-#define K_HEAP_START 0xc0100000
+/* 0xc0000000是内核从虚拟地址3G起. 0x400000意指跨过低端4M,
+ * 页目录项768在支持PSE时整个映射为一个4M大页, 内核堆从下一个页目录项开始 */
+#define K_HEAP_START 0xc0400000
+
+#define CR4_PSE 0x00000010	   // CR4 的 PSE 位, 置1后页目录项可以映射4M大页
+#define CPUID_PSE 0x00000008	   // cpuid 1号功能 edx 中的 PSE 支持位
+
+#define CR0_WP 0x00010000	 // CR0 的写保护位, 置1后特权级0写只读页也会触发异常
+
+/* 缺页异常错误码中的位 */
+#define PF_ERR_P 1		 // 为1表示页存在但违反了保护, 为0表示页不存在
+#define PF_ERR_W 2		 // 为1表示由写操作引起
+
+/* 伙伴系统中每一阶的空闲块链表 */
+struct free_area {
+   struct list free_list;	 // 该阶空闲块首页框的 struct page 链表
+   uint32_t nr_free;		 // 该阶空闲块的数量
+};
 
-/* 内存池结构,生成两个实例用于管理内核内存池和用户内存池 */
+/* 内存池结构,生成两个实例用于管理内核内存池和用户内存池.
+ * 两个池共用覆盖全部可管理物理内存的位图和 mem_map 数组, 池只拥有其中归属于它的块 */
 struct pool {
-   struct bitmap pool_bitmap;	 // 本内存池用到的位图结构,用于管理物理内存
-   uint32_t phy_addr_start;	 // 本内存池所管理物理内存的起始地址
-   uint32_t pool_size;		 // 本内存池字节容量
+   struct bitmap pool_bitmap;	 // 可管理物理内存的位图,两个池共用
+   uint32_t phy_addr_start;	 // 可管理物理内存的起始地址,两个池相同
+   uint32_t pool_size;		 // 可管理物理内存的字节数,两个池相同
    struct lock lock;		 // 申请内存时互斥
+   uint8_t owner;		 // 本池拥有的块在 chunk_owners 中的标记
+   uint32_t floor_pages;	 // 本池至少保有的页框数, 达到下限就不再把块还给储备
+   struct free_area free_area[BUDDY_MAX_ORDER + 1];   // 0~BUDDY_MAX_ORDER 阶空闲块链表
+   uint32_t free_pages;		 // 本内存池空闲页框数
+   struct list zeroed_list;	 // 已清0的空闲页框, 用 struct page 的 free_tag 串起来
+   uint32_t zeroed_cnt;		 // zeroed_list 中的页框数
+   uint32_t zero_hits;		 // 需要清0的分配直接用上了 zeroed_list 中页框的次数
+   uint32_t zero_misses;	 // zeroed_list 为空只能当场清0的次数
+   uint32_t total_pages;	 // 池拥有的块中可用的页框数, 不含空洞
+   uint32_t alloc_cnt;		 // 伙伴系统累计分配出去的页框数
+   uint32_t free_cnt;		 // 伙伴系统累计回收的页框数
 };
 
+uint32_t pgtable_pages;
+
 struct pool kernel_pool, user_pool;      // 生成内核内存池和用户内存池
+struct page* mem_map;			 // 可管理物理内存中每个页框的描述符, 下标为页框号减去 phy_addr_start 的页框号
+uint32_t mem_map_cnt;
 struct virtual_addr kernel_vaddr;	 // 此结构是用来给内核分配虚拟地址
 
 /* 在pf表示的虚拟内存池中申请pg_cnt个虚拟页,
@@ -48,26 +100,20 @@ static void* vaddr_get(enum pool_flags pf, uint32_t pg_cnt) {
 	 bitmap_set(&kernel_vaddr.vaddr_bitmap, bit_idx_start + cnt++, 1);
       }
       vaddr_start = kernel_vaddr.vaddr_start + bit_idx_start * PG_SIZE;
-   } else {	     // 用户内存池	
+   } else {	     // 用户内存池, 在进程的虚拟内存区之间找空隙
       struct task_struct* cur = running_thread();
-      bit_idx_start  = bitmap_scan(&cur->userprog_vaddr.vaddr_bitmap, pg_cnt);
-      if (bit_idx_start == -1) {
+      vaddr_start = vma_get_unmapped(cur, pg_cnt);
+      if (vaddr_start == 0 || \
+	    !vma_add(cur, vaddr_start, vaddr_start + pg_cnt * PG_SIZE, VMA_READ | VMA_WRITE, VMA_ANON)) {
 	 return NULL;
       }
-
-      while(cnt < pg_cnt) {
-	 bitmap_set(&cur->userprog_vaddr.vaddr_bitmap, bit_idx_start + cnt++, 1);
-      }
-      vaddr_start = cur->userprog_vaddr.vaddr_start + bit_idx_start * PG_SIZE;
-
-   /* (0xc0000000 - PG_SIZE)做为用户3级栈已经在start_process被分配 */
-      ASSERT((uint32_t)vaddr_start < (0xc0000000 - PG_SIZE));
    }
    return (void*)vaddr_start;
 }
 
-/* 得到虚拟地址vaddr对应的pte指针*/
+/* 得到虚拟地址vaddr对应的pte指针, vaddr不能位于大页中, 大页没有页表 */
 uint32_t* pte_ptr(uint32_t vaddr) {
+   ASSERT(!(*pde_ptr(vaddr) & PG_PS));
    /* 先访问到页表自己 + \
     * 再用页目录项pde(页目录内页表的索引)做为pte的索引访问到页表 + \
     * 再用pte的索引做为页内偏移*/
@@ -84,17 +130,634 @@ uint32_t* pde_ptr(uint32_t vaddr) {
    return pde;
 }
 
+/***********************  内核临时映射  ***************************
+ * 物理内存没有整体映射到内核空间, 要访问一个不在当前页表中的页框
+ * (如清0空闲页框、fork 时填写子进程的页表、写时复制)时,
+ * 就把它临时映射到内核堆中预留的 KMAP_SLOTS 个虚拟页之一。
+ * 页目录项 768 以上是所有进程共用的, 所以映射在任何进程中都有效。
+ ******************************************************************/
+#define KMAP_SLOTS 8
+
+static uint32_t kmap_base;		// 预留虚拟页的起始地址
+static uint8_t kmap_used;		// 每一位表示一个虚拟页是否在用
+
+/* 把物理页框 pg_phy_addr 临时映射到内核空间, 返回其虚拟地址 */
+void* kmap(uint32_t pg_phy_addr) {
+   enum intr_status old_status = intr_disable();
+   uint32_t slot = 0;
+   while (slot < KMAP_SLOTS && (kmap_used & (1 << slot))) {
+      slot++;
+   }
+   if (slot == KMAP_SLOTS) {
+      PANIC("kmap: no free slot");
+   }
+   kmap_used |= 1 << slot;
+   intr_set_status(old_status);
+
+   uint32_t vaddr = kmap_base + slot * PG_SIZE;
+   *pte_ptr(vaddr) = (pg_phy_addr & 0xfffff000) | PG_US_S | PG_RW_W | PG_P_1;
+   asm volatile ("invlpg %0" : : "m" (*(char*)vaddr) : "memory");
+   return (void*)vaddr;
+}
+
+/* 解除 kmap 建立的临时映射 */
+void kunmap(void* _vaddr) {
+   uint32_t vaddr = (uint32_t)_vaddr;
+   uint32_t slot = (vaddr - kmap_base) / PG_SIZE;
+   ASSERT(slot < KMAP_SLOTS && (kmap_used & (1 << slot)));
+   *pte_ptr(vaddr) = 0;
+   asm volatile ("invlpg %0" : : "m" (*(char*)vaddr) : "memory");
+   enum intr_status old_status = intr_disable();
+   kmap_used &= ~(1 << slot);
+   intr_set_status(old_status);
+}
+
+/* 地址范围描述符, 由 BIOS 的 e820 功能填写 */
+struct ards {
+   uint32_t base_low;
+   uint32_t base_high;
+   uint32_t length_low;
+   uint32_t length_high;
+   uint32_t type;
+};
+
+/* 一段可用的物理内存 [start, end), 已按页对齐 */
+struct mem_range {
+   uint32_t start;
+   uint32_t end;
+};
+
+static struct mem_range mem_ranges[ARDS_MAX];   // 按起始地址升序排列, 互不重叠
+static uint32_t mem_range_cnt;
+
+/* 把可用内存[start, end)按页对齐后插入mem_ranges, 与已有的范围重叠时合并 */
+static void mem_range_add(uint32_t start, uint32_t end) {
+   start = (start + PG_SIZE - 1) & 0xfffff000;
+   end &= 0xfffff000;
+   if (start < MEM_RESERVED_END) {
+      start = MEM_RESERVED_END;
+   }
+   if (start >= end) {
+      return;
+   }
+   uint32_t idx = 0;
+   while (idx < mem_range_cnt && mem_ranges[idx].end < start) {
+      idx++;
+   }
+   if (idx < mem_range_cnt && mem_ranges[idx].start <= end) {
+      // 与第idx个范围相交或相邻, 合并后还可能与后面的范围相交
+      if (start < mem_ranges[idx].start) {
+	 mem_ranges[idx].start = start;
+      }
+      if (end > mem_ranges[idx].end) {
+	 mem_ranges[idx].end = end;
+      }
+      while (idx + 1 < mem_range_cnt && mem_ranges[idx + 1].start <= mem_ranges[idx].end) {
+	 if (mem_ranges[idx + 1].end > mem_ranges[idx].end) {
+	    mem_ranges[idx].end = mem_ranges[idx + 1].end;
+	 }
+	 memcpy(&mem_ranges[idx + 1], &mem_ranges[idx + 2], (mem_range_cnt - idx - 2) * sizeof(struct mem_range));
+	 mem_range_cnt--;
+      }
+      return;
+   }
+   if (mem_range_cnt == ARDS_MAX) {
+      return;
+   }
+   uint32_t move_idx = mem_range_cnt;
+   while (move_idx > idx) {
+      mem_ranges[move_idx] = mem_ranges[move_idx - 1];
+      move_idx--;
+   }
+   mem_ranges[idx].start = start;
+   mem_ranges[idx].end = end;
+   mem_range_cnt++;
+}
+
+/* 根据loader收集的ARDS建立可用物理内存表, 没有ARDS时退回到只用总容量 */
+static void mem_ranges_init(void) {
+   uint32_t ards_nr = *(uint16_t*)ARDS_NR;
+   struct ards* ards = (struct ards*)ARDS_BUF;
+   if (ards_nr > ARDS_MAX) {
+      ards_nr = ARDS_MAX;
+   }
+   mem_range_cnt = 0;
+   uint32_t ards_idx = 0;
+   while (ards_idx < ards_nr) {
+      struct ards* cur = &ards[ards_idx++];
+      // 4G以上的内存32位地址用不到
+      if (cur->type != ARDS_TYPE_RAM || cur->base_high != 0) {
+	 continue;
+      }
+      uint32_t end = cur->base_low + cur->length_low;
+      if (cur->length_high != 0 || end < cur->base_low || end > PHY_ADDR_MAX) {
+	 end = PHY_ADDR_MAX;
+      }
+      mem_range_add(cur->base_low, end);
+   }
+   if (mem_range_cnt == 0) {
+      mem_range_add(0, *(uint32_t*)TOTAL_MEM_BYTES);
+   }
+   if (mem_range_cnt == 0) {
+      PANIC("no usable memory above 2M");
+   }
+}
+
+/* 返回从物理地址addr开始(含)连续可用的页框数, addr不可用时返回0 */
+static uint32_t mem_usable_run(uint32_t addr) {
+   uint32_t idx = 0;
+   while (idx < mem_range_cnt) {
+      if (addr >= mem_ranges[idx].start && addr < mem_ranges[idx].end) {
+	 return (mem_ranges[idx].end - addr) / PG_SIZE;
+      }
+      idx++;
+   }
+   return 0;
+}
+
+/* 返回物理地址[start, end)中可用的页框数 */
+static uint32_t mem_usable_pages(uint32_t start, uint32_t end) {
+   uint32_t pages = 0, idx = 0;
+   while (idx < mem_range_cnt) {
+      uint32_t range_start = mem_ranges[idx].start > start ? mem_ranges[idx].start : start;
+      uint32_t range_end = mem_ranges[idx].end < end ? mem_ranges[idx].end : end;
+      if (range_start < range_end) {
+	 pages += (range_end - range_start) / PG_SIZE;
+      }
+      idx++;
+   }
+   return pages;
+}
+
+/*************************  内存池的动态平衡  *****************************
+ * 元信息之后的物理内存按 4M 对齐划分成块(chunk), 每块整个属于内核池、用户池或公共储备.
+ * 伙伴系统最大的块正好是 4M 并按 4M 对齐, 所以合并不会跨块, 块的归属也就决定了
+ * 其中每个页框属于哪个池, 释放页框时按块找到所属的池.
+ * 初始化时两个池各分到下限(floor)那么多的块, 其余放在储备中. 某个池的伙伴系统
+ * 分配失败时从储备借一整块, 释放后合并出一整块空闲的 4M 且池仍高于下限时就还回储备,
+ * 这样一个池闲着的内存可以给另一个池用, 不再是初始化时对半分死.
+ ***********************************************************************/
+#define CHUNK_PAGES (1 << BUDDY_MAX_ORDER)   // 每块的页框数
+#define CHUNK_SIZE (CHUNK_PAGES * PG_SIZE)
+#define KERNEL_POOL_FLOOR 0x800000	   // 内核池至少保有的内存, 8M
+#define USER_POOL_FLOOR 0x800000	   // 用户池至少保有的内存, 8M
+#define CHUNK_SLACK (CHUNK_PAGES / 4)	   // 还回一块后池中至少还要剩这么多空闲页框, 免得借了还、还了借
+
+/* 块的归属 */
+enum chunk_owner {
+   CHUNK_RESERVE,	 // 公共储备
+   CHUNK_KERNEL,	 // 内核内存池
+   CHUNK_USER		 // 用户内存池
+};
+
+static uint8_t* chunk_owners;	 // 每块的归属, 放在元信息页中
+static uint32_t chunk_base;	 // 第0块的起始物理地址, 4M对齐
+static uint32_t chunk_cnt;
+static uint32_t reserve_pages;	 // 储备的块中可用的页框数
+static uint32_t kernel_pages_max;   // 内核池最多能拥有的页框数, 受内核虚拟地址的限制
+static bool chunk_balance_on;	 // 伙伴系统自检完成后才开始借还
+
+/* 第chunk_idx块位于可管理物理内存中的部分[*start, *end) */
+static void chunk_range(uint32_t chunk_idx, uint32_t* start, uint32_t* end) {
+   uint32_t pool_start = kernel_pool.phy_addr_start;
+   uint32_t pool_end = pool_start + kernel_pool.pool_size;
+   *start = chunk_base + chunk_idx * CHUNK_SIZE;
+   *end = *start + CHUNK_SIZE;
+   if (*start < pool_start) {
+      *start = pool_start;
+   }
+   if (*end > pool_end || *end < *start) {	 // 最后一块的结尾可能回绕到0
+      *end = pool_end;
+   }
+}
+
+/* 第chunk_idx块中可用的页框数 */
+static uint32_t chunk_usable_pages(uint32_t chunk_idx) {
+   uint32_t start, end;
+   chunk_range(chunk_idx, &start, &end);
+   return mem_usable_pages(start, end);
+}
+
+/* 返回物理地址pg_phy_addr所在的块号 */
+static uint32_t phy_addr_chunk(uint32_t pg_phy_addr) {
+   return (pg_phy_addr - chunk_base) / CHUNK_SIZE;
+}
+
+/***************************  伙伴系统  *******************************
+ * 每个内存池的空闲页框按 2^order 个页框一块组织在 free_area[order] 中,
+ * 块的首页框号(物理地址/PG_SIZE)必须是 2^order 的整数倍,这样物理上的对齐
+ * 也就得到了保证,将来可以直接拿 4M 的块做大页。
+ * 分配时从 order 阶往上找第一个非空链表, 多出来的部分逐阶拆分放回;
+ * 释放时只要伙伴(页框号异或 2^order)也是同阶的空闲块就合并, 直到不能合并为止。
+ * pool_bitmap 仍然与伙伴系统同步, 一位表示一页, 供自检和调试使用。
+ * 页框号都相对于可管理物理内存的起点, 两个池的空闲链表只含各自所拥有块中的页框。
+ **********************************************************************/
+
+/* 把池内以 idx 起始的 2^order 个页框在位图中置为 value */
+static void pool_bitmap_mark(struct pool* m_pool, uint32_t idx, uint8_t order, int8_t value) {
+   uint32_t cnt = 1 << order;
+   while (cnt-- > 0) {
+      bitmap_set(&m_pool->pool_bitmap, idx++, value);
+   }
+}
+
+/* 设置以 idx 起始的 2^order 个页框的描述符, 分配和释放时调用 */
+static void page_block_set(uint32_t idx, uint8_t order, uint8_t flags, uint16_t ref_cnt) {
+   struct page* pg = &mem_map[idx];
+   uint32_t cnt = 1 << order;
+   while (cnt-- > 0) {
+      pg->flags = flags;
+      pg->ref_cnt = ref_cnt;
+      pg->owner = NULL;
+      pg->vaddr = 0;
+      pg++;
+   }
+}
+
+/* 把池内以 idx 起始的 2^order 个页框作为一个空闲块挂到 free_area[order] */
+static void buddy_add_block(struct pool* m_pool, uint32_t idx, uint8_t order) {
+   struct page* frame = &mem_map[idx];
+   frame->order = order;
+   frame->flags = PAGE_FREE;
+   list_push(&m_pool->free_area[order].free_list, &frame->free_tag);
+   m_pool->free_area[order].nr_free++;
+}
+
+/* 把空闲块首页框 frame 从 free_area[order] 中摘下 */
+static void buddy_del_block(struct pool* m_pool, struct page* frame, uint8_t order) {
+   ASSERT((frame->flags & PAGE_FREE) && frame->order == order);
+   list_remove(&frame->free_tag);
+   frame->flags &= ~PAGE_FREE;
+   m_pool->free_area[order].nr_free--;
+}
+
+/* 把物理地址[start, end)中的可用页框按最大的对齐块挂入m_pool的空闲链表,
+ * 空洞中的页框在位图中置1, 也不在任何空闲链表中, 永远不会被分配或合并.
+ * 返回挂入的页框数 */
+static uint32_t buddy_add_range(struct pool* m_pool, uint32_t start, uint32_t end) {
+   uint32_t base_pfn = m_pool->phy_addr_start / PG_SIZE;
+   uint32_t idx = (start - m_pool->phy_addr_start) / PG_SIZE;
+   uint32_t idx_end = (end - m_pool->phy_addr_start) / PG_SIZE;
+   uint32_t added = 0;
+   while (idx < idx_end) {
+      uint32_t run = mem_usable_run(m_pool->phy_addr_start + idx * PG_SIZE);
+      if (run == 0) {
+	 bitmap_set(&m_pool->pool_bitmap, idx++, 1);
+	 continue;
+      }
+      uint8_t order = BUDDY_MAX_ORDER;
+      while (((base_pfn + idx) & ((1 << order) - 1)) || idx + (1 << order) > idx_end || (uint32_t)(1 << order) > run) {
+	 order--;
+      }
+      pool_bitmap_mark(m_pool, idx, order, 0);
+      buddy_add_block(m_pool, idx, order);
+      added += 1 << order;
+      idx += 1 << order;
+   }
+   m_pool->free_pages += added;
+   m_pool->total_pages += added;
+   return added;
+}
+
+/* 从储备中借一块给m_pool, 内核池从低地址找, 用户池从高地址找, 优先借完整的块.
+ * 须在关中断下调用, 借到返回true */
+static bool chunk_borrow(struct pool* m_pool) {
+   if (!chunk_balance_on || reserve_pages == 0) {
+      return false;
+   }
+   uint32_t found = chunk_cnt, found_pages = 0, n = 0;
+   while (n < chunk_cnt) {
+      uint32_t chunk_idx = m_pool == &kernel_pool ? n : chunk_cnt - 1 - n;
+      n++;
+      if (chunk_owners[chunk_idx] != CHUNK_RESERVE) {
+	 continue;
+      }
+      uint32_t pages = chunk_usable_pages(chunk_idx);
+      if (pages <= found_pages || \
+	    (m_pool == &kernel_pool && kernel_pool.total_pages + pages > kernel_pages_max)) {
+	 continue;
+      }
+      found = chunk_idx;
+      found_pages = pages;
+      if (pages == CHUNK_PAGES) {
+	 break;
+      }
+   }
+   if (found == chunk_cnt) {
+      return false;
+   }
+   uint32_t start, end;
+   chunk_range(found, &start, &end);
+   chunk_owners[found] = m_pool->owner;
+   reserve_pages -= buddy_add_range(m_pool, start, end);
+   return true;
+}
+
+/* 在m_pool中分配2^order个物理上连续的页框,
+ * 成功则返回起始页框的物理地址,失败则返回NULL */
+static void* buddy_alloc(struct pool* m_pool, uint8_t order) {
+   ASSERT(order <= BUDDY_MAX_ORDER);
+   enum intr_status old_status = intr_disable();
+   uint8_t cur_order;
+   while (true) {
+      cur_order = order;
+      while (cur_order <= BUDDY_MAX_ORDER && m_pool->free_area[cur_order].nr_free == 0) {
+	 cur_order++;
+      }
+      if (cur_order <= BUDDY_MAX_ORDER) {
+	 break;
+      }
+      // 本池没有够大的空闲块了, 从储备借一块再找
+      if (!chunk_borrow(m_pool)) {
+	 intr_set_status(old_status);
+	 return NULL;
+      }
+   }
+
+   struct page* frame = elem2entry(struct page, free_tag, \
+	 m_pool->free_area[cur_order].free_list.head.next);
+   buddy_del_block(m_pool, frame, cur_order);
+   uint32_t idx = frame - mem_map;
+
+   /* 块比需要的大,把后半部分逐阶拆出来还回去 */
+   while (cur_order > order) {
+      cur_order--;
+      buddy_add_block(m_pool, idx + (1 << cur_order), cur_order);
+   }
+   m_pool->free_pages -= 1 << order;
+   m_pool->alloc_cnt += 1 << order;
+   pool_bitmap_mark(m_pool, idx, order, 1);
+   // 分配出去的页框由调用者持有一个引用
+   page_block_set(idx, order, m_pool == &kernel_pool ? PAGE_KERNEL : PAGE_USER, 1);
+   intr_set_status(old_status);
+   return (void*)(m_pool->phy_addr_start + idx * PG_SIZE);
+}
+
+/* 将m_pool中以物理地址pg_phy_addr起始的2^order个页框归还给伙伴系统,并与空闲的伙伴合并 */
+static void buddy_free(struct pool* m_pool, uint32_t pg_phy_addr, uint8_t order) {
+   uint32_t base_pfn = m_pool->phy_addr_start / PG_SIZE;
+   uint32_t pg_cnt = m_pool->pool_size / PG_SIZE;
+   uint32_t pfn = pg_phy_addr / PG_SIZE;
+   ASSERT(pfn >= base_pfn && pfn - base_pfn + (1 << order) <= pg_cnt);
+   ASSERT((pfn & ((1 << order) - 1)) == 0);
+
+   enum intr_status old_status = intr_disable();
+   // 只能释放分配出去且没有被其它人引用的页框
+   ASSERT((mem_map[pfn - base_pfn].flags & (PAGE_KERNEL | PAGE_USER)) && \
+	 mem_map[pfn - base_pfn].ref_cnt <= 1);
+   page_block_set(pfn - base_pfn, order, 0, 0);
+   pool_bitmap_mark(m_pool, pfn - base_pfn, order, 0);
+   m_pool->free_pages += 1 << order;
+   m_pool->free_cnt += 1 << order;
+
+   while (order < BUDDY_MAX_ORDER) {
+      uint32_t buddy_pfn = pfn ^ (1 << order);
+      /* 伙伴不在本池内则无法合并 */
+      if (buddy_pfn < base_pfn || buddy_pfn - base_pfn + (1 << order) > pg_cnt) {
+	 break;
+      }
+      struct page* buddy = &mem_map[buddy_pfn - base_pfn];
+      if (!(buddy->flags & PAGE_FREE) || buddy->order != order) {
+	 break;
+      }
+      buddy_del_block(m_pool, buddy, order);
+      pfn &= ~(1 << order);	   // 合并后的块以两者中较低的页框为首
+      order++;
+   }
+
+   /* 合并出了一整块空闲的 4M, 池高于下限且还有余量就还回储备 */
+   if (order == BUDDY_MAX_ORDER && chunk_balance_on && \
+	 m_pool->total_pages - CHUNK_PAGES >= m_pool->floor_pages && \
+	 m_pool->free_pages - CHUNK_PAGES >= CHUNK_SLACK) {
+      chunk_owners[phy_addr_chunk(pfn * PG_SIZE)] = CHUNK_RESERVE;
+      m_pool->free_pages -= CHUNK_PAGES;
+      m_pool->total_pages -= CHUNK_PAGES;
+      reserve_pages += CHUNK_PAGES;
+   } else {
+      buddy_add_block(m_pool, pfn - base_pfn, order);
+   }
+   intr_set_status(old_status);
+}
+
+/* 初始化m_pool的伙伴系统,将它所拥有的块中的可用页框挂入空闲链表 */
+static void buddy_init(struct pool* m_pool) {
+   uint8_t order = 0;
+   while (order <= BUDDY_MAX_ORDER) {
+      list_init(&m_pool->free_area[order].free_list);
+      m_pool->free_area[order].nr_free = 0;
+      order++;
+   }
+   m_pool->free_pages = m_pool->total_pages = 0;
+   uint32_t chunk_idx = 0;
+   while (chunk_idx < chunk_cnt) {
+      if (chunk_owners[chunk_idx] == m_pool->owner) {
+	 uint32_t start, end;
+	 chunk_range(chunk_idx, &start, &end);
+	 buddy_add_range(m_pool, start, end);
+      }
+      chunk_idx++;
+   }
+   m_pool->alloc_cnt = m_pool->free_cnt = 0;
+}
+
+/*************************  预先清0的页框  ****************************
+ * 每个内存池留一些已经清0的页框在 zeroed_list 中, 由 idle 线程在系统空闲时
+ * 开着中断逐页准备好, 需要清0内存的分配(get_kernel_pages等)优先从这里取,
+ * 这样清0的开销就不在持有内存池锁的关键路径上了。
+ * 物理内存没有整体映射到内核空间, 所以清0时通过 kmap 临时映射。
+ **********************************************************************/
+#define ZERO_PAGE_TARGET 64	   // 每个内存池最多预备的清0页框数
+#define SWAP_BATCH 8		   // 用户池空了时一次换出的页数
+
+/* 从m_pool的zeroed_list中取出一个已清0的页框,返回其物理地址,没有则返回NULL */
+static void* zeroed_pop(struct pool* m_pool) {
+   void* page_phyaddr = NULL;
+   enum intr_status old_status = intr_disable();
+   if (!list_empty(&m_pool->zeroed_list)) {
+      struct page* frame = elem2entry(struct page, free_tag, list_pop(&m_pool->zeroed_list));
+      m_pool->zeroed_cnt--;
+      page_phyaddr = (void*)page_to_phy(frame);
+   }
+   intr_set_status(old_status);
+   return page_phyaddr;
+}
+
+/* 把m_pool中预备的清0页框全部还给伙伴系统,以便拼出大块 */
+static void zeroed_drain(struct pool* m_pool) {
+   void* page_phyaddr;
+   while ((page_phyaddr = zeroed_pop(m_pool)) != NULL) {
+      buddy_free(m_pool, (uint32_t)page_phyaddr, 0);
+   }
+}
+
 /* 在m_pool指向的物理内存池中分配1个物理页,
  * 成功则返回页框的物理地址,失败则返回NULL */
 static void* palloc(struct pool* m_pool) {
-   /* 扫描或设置位图要保证原子操作 */
-   int bit_idx = bitmap_scan(&m_pool->pool_bitmap, 1);    // 找一个物理页面
-   if (bit_idx == -1 ) {
+   void* page_phyaddr = buddy_alloc(m_pool, 0);
+   if (page_phyaddr == NULL) {
+      // 伙伴系统已空,预备的清0页框也可以用
+      page_phyaddr = zeroed_pop(m_pool);
+   }
+   if (page_phyaddr == NULL && m_pool == &user_pool && swap_reclaim(SWAP_BATCH) > 0) {
+      // 用户池也空了, 换出一些用户页后再试一次
+      page_phyaddr = buddy_alloc(m_pool, 0);
+   }
+   return page_phyaddr;
+}
+
+/* 在m_pool中分配1个物理页,优先使用已清0的页框,
+ * *zeroed 返回该页框是否已清0,失败则返回NULL */
+static void* palloc_zeroed(struct pool* m_pool, bool* zeroed) {
+   void* page_phyaddr = zeroed_pop(m_pool);
+   *zeroed = page_phyaddr != NULL;
+   enum intr_status old_status = intr_disable();
+   if (*zeroed) {
+      m_pool->zero_hits++;
+   } else {
+      m_pool->zero_misses++;
+   }
+   intr_set_status(old_status);
+   if (page_phyaddr == NULL) {
+      page_phyaddr = buddy_alloc(m_pool, 0);
+   }
+   if (page_phyaddr == NULL && m_pool == &user_pool && swap_reclaim(SWAP_BATCH) > 0) {
+      page_phyaddr = buddy_alloc(m_pool, 0);
+   }
+   return page_phyaddr;
+}
+
+/* 在pf表示的物理内存池中分配2^order个物理上连续的页框,
+ * 成功则返回起始页框的物理地址,失败则返回NULL */
+void* palloc_pages(enum pool_flags pf, uint8_t order) {
+   struct pool* mem_pool = pf & PF_KERNEL ? &kernel_pool : &user_pool;
+   void* page_phyaddr = buddy_alloc(mem_pool, order);
+   if (page_phyaddr == NULL && mem_pool->zeroed_cnt > 0) {
+      // 预备的清0页框可能正好拆散了需要的大块, 还回去再试一次
+      zeroed_drain(mem_pool);
+      page_phyaddr = buddy_alloc(mem_pool, order);
+   }
+   return page_phyaddr;
+}
+
+/* 为某个内存池清0一个空闲页框放入zeroed_list,由idle线程在开中断的情况下调用,
+ * 不能获取任何锁,以免idle线程阻塞. 清0了一页返回true,各池都已备足返回false */
+bool zero_page_refill(void) {
+   struct pool* pools[2] = {&kernel_pool, &user_pool};
+   uint32_t pool_idx = 0;
+   while (pool_idx < 2) {
+      struct pool* m_pool = pools[pool_idx++];
+      // 不能为了预备清0页框占掉太多空闲内存
+      if (m_pool->zeroed_cnt >= ZERO_PAGE_TARGET || m_pool->zeroed_cnt >= m_pool->free_pages / 4) {
+	 continue;
+      }
+      uint32_t page_phyaddr = (uint32_t)buddy_alloc(m_pool, 0);
+      if (page_phyaddr == 0) {
+	 continue;
+      }
+
+      void* page_vaddr = kmap(page_phyaddr);
+      memset(page_vaddr, 0, PG_SIZE);
+      kunmap(page_vaddr);
+
+      enum intr_status old_status = intr_disable();
+      struct page* frame = phy_to_page(page_phyaddr);
+      list_append(&m_pool->zeroed_list, &frame->free_tag);
+      m_pool->zeroed_cnt++;
+      intr_set_status(old_status);
+      return true;
+   }
+   return false;
+}
+
+/************************  页框描述符  ****************************
+ * mem_map 为可管理物理内存中的每个页框准备一个 struct page, 由物理地址
+ * 直接算出下标, 所以从物理地址或(经 addr_v2p)虚拟地址找到描述符都是 O(1).
+ * 伙伴系统分配时置上所属池的标志并把 ref_cnt 置为1, 释放时清空.
+ * 写时复制让多个进程的页表项指向同一个页框, 每多一个映射 ref_cnt 加1,
+ * 释放页框时只有 ref_cnt 降到0才真正还给伙伴系统, 否则只减少计数。
+ * 用户页框只被一个进程映射时, owner 和 vaddr 记录是谁在哪里映射了它,
+ * 一旦被共享就清空, 因为那时已无法知道最后留下的是哪个映射者。
+ ******************************************************************/
+
+/* 返回物理地址pg_phy_addr所在的内存池, 由所在块的归属决定 */
+static struct pool* phy_addr_pool(uint32_t pg_phy_addr) {
+   uint8_t owner = chunk_owners[phy_addr_chunk(pg_phy_addr)];
+   ASSERT(owner != CHUNK_RESERVE);
+   return owner == CHUNK_KERNEL ? &kernel_pool : &user_pool;
+}
+
+/* 返回物理页框pg_phy_addr的描述符 */
+struct page* phy_to_page(uint32_t pg_phy_addr) {
+   ASSERT(pg_phy_addr >= kernel_pool.phy_addr_start && \
+	 pg_phy_addr < kernel_pool.phy_addr_start + kernel_pool.pool_size);
+   return &mem_map[(pg_phy_addr - kernel_pool.phy_addr_start) / PG_SIZE];
+}
+
+/* 返回描述符pg对应页框的物理地址 */
+uint32_t page_to_phy(struct page* pg) {
+   return kernel_pool.phy_addr_start + (pg - mem_map) * PG_SIZE;
+}
+
+/* 记录用户页框pg_phy_addr由进程pthread独占, 映射在虚拟地址vaddr处 */
+static void page_set_owner(uint32_t pg_phy_addr, struct task_struct* pthread, uint32_t vaddr) {
+   struct page* pg = phy_to_page(pg_phy_addr);
+   ASSERT(pg->ref_cnt == 1);
+   pg->owner = pthread;
+   pg->vaddr = vaddr;
+}
+
+/* 找到独占进程中映射 pg 的页表项, 返回它在 kmap 出来的页表中的地址,
+ * 用完须 kunmap 所在的页. 映射关系已经变了返回 NULL. 须在关中断下调用 */
+uint32_t* page_owner_pte(struct page* pg) {
+   uint32_t pde = pg->owner->pgdir[pg->vaddr >> 22];
+   if (!(pde & PG_P_1) || (pde & PG_PS)) {
       return NULL;
    }
-   bitmap_set(&m_pool->pool_bitmap, bit_idx, 1);	// 将此位bit_idx置1
-   uint32_t page_phyaddr = ((bit_idx * PG_SIZE) + m_pool->phy_addr_start);
-   return (void*)page_phyaddr;
+   uint32_t* table = kmap(pde & 0xfffff000);
+   uint32_t* pte = &table[(pg->vaddr >> 12) & 0x3ff];
+   if ((*pte & (0xfffff000 | PG_P_1)) != (page_to_phy(pg) | PG_P_1)) {
+      kunmap(table);
+      return NULL;
+   }
+   return pte;
+}
+
+/* 物理页框 pg_phy_addr 多了一个共享的映射 */
+void page_share(uint32_t pg_phy_addr) {
+   enum intr_status old_status = intr_disable();
+   struct page* pg = phy_to_page(pg_phy_addr);
+   ASSERT(pg->ref_cnt > 0);
+   pg->ref_cnt++;
+   pg->owner = NULL;
+   intr_set_status(old_status);
+}
+
+/* 返回物理页框 pg_phy_addr 的引用数, 包括映射它的页表项以及映像缓存和 ksmd 的引用 */
+uint32_t page_map_cnt(uint32_t pg_phy_addr) {
+   return phy_to_page(pg_phy_addr)->ref_cnt;
+}
+
+/* 放掉页框的一个引用, 还有其它引用时返回true,
+ * 否则返回false, 由调用者真正释放 */
+static bool page_unshare(uint32_t pg_phy_addr) {
+   bool shared = false;
+   enum intr_status old_status = intr_disable();
+   struct page* pg = phy_to_page(pg_phy_addr);
+   ASSERT(pg->ref_cnt > 0);
+   if (pg->ref_cnt > 1) {
+      pg->ref_cnt--;
+      shared = true;
+   }
+   intr_set_status(old_status);
+   return shared;
+}
+
+/* 获取pf对应内存池预备的清0页框数及命中、未命中次数 */
+void zero_page_stat(enum pool_flags pf, uint32_t* zeroed_cnt, uint32_t* hits, uint32_t* misses) {
+   struct pool* mem_pool = pf & PF_KERNEL ? &kernel_pool : &user_pool;
+   *zeroed_cnt = mem_pool->zeroed_cnt;
+   *hits = mem_pool->zero_hits;
+   *misses = mem_pool->zero_misses;
 }
 
 /* 页表中添加虚拟地址_vaddr与物理地址_page_phyaddr的映射 */
@@ -120,6 +783,7 @@ static void page_table_add(void* _vaddr, void* _page_phyaddr) {
    } else {	   // 页目录项不存在,所以要先创建页目录项再创建页表项.
       /* 页表中用到的页框一律从内核空间分配 */
       uint32_t pde_phyaddr = (uint32_t)palloc(&kernel_pool);
+      MEM_STAT_ADD(pgtable_pages, 1);
       *pde = (pde_phyaddr | PG_US_U | PG_RW_W | PG_P_1);
 
 /*******************   必须将页表所在的页清0   *********************
@@ -133,8 +797,9 @@ static void page_table_add(void* _vaddr, void* _page_phyaddr) {
    }
 }
 
-/* 分配pg_cnt个页空间,成功则返回起始虚拟地址,失败时返回NULL */
-void* malloc_page(enum pool_flags pf, uint32_t pg_cnt) {
+/* 分配pg_cnt个页空间,zero为true时保证内容全为0,
+ * 成功则返回起始虚拟地址,失败时返回NULL */
+static void* malloc_page_zero(enum pool_flags pf, uint32_t pg_cnt, bool zero) {
    ASSERT(pg_cnt > 0 && pg_cnt < 3840);
 /***********   malloc_page的原理是三个动作的合成:   ***********
       1通过vaddr_get在虚拟内存池中申请虚拟地址
@@ -145,12 +810,17 @@ void* malloc_page(enum pool_flags pf, uint32_t pg_cnt) {
    if (vaddr_start == NULL) {
       return NULL;
    }
+   if (pf == PF_USER) {
+      // 用户空间按需分配: 只占住虚拟地址, 首次访问时在缺页异常中分配清0的页框
+      return vaddr_start;
+   }
    uint32_t vaddr = (uint32_t)vaddr_start, cnt = pg_cnt;
    struct pool* mem_pool = pf & PF_KERNEL ? &kernel_pool : &user_pool;
 
 /* 因为虚拟地址是连续的,但物理地址可以是不连续的,所以逐个做映射*/
    while (cnt-- > 0) {
-      void* page_phyaddr = palloc(mem_pool);
+      bool zeroed = false;
+      void* page_phyaddr = zero ? palloc_zeroed(mem_pool, &zeroed) : palloc(mem_pool);
 
 /* 失败时要将曾经已申请的虚拟地址和物理页全部回滚，
  * 在将来完成内存回收时再补充 */
@@ -159,28 +829,45 @@ void* malloc_page(enum pool_flags pf, uint32_t pg_cnt) {
       }
 
       page_table_add((void*)vaddr, page_phyaddr); // 在页表中做映射 
+      if (zero && !zeroed) {
+	 memset((void*)vaddr, 0, PG_SIZE);	 // 没有预备好的清0页框,只能当场清0
+      }
       vaddr += PG_SIZE;		 // 下一个虚拟页
    }
    return vaddr_start;
 }
 
+/* 分配pg_cnt个页空间,成功则返回起始虚拟地址,失败时返回NULL */
+void* malloc_page(enum pool_flags pf, uint32_t pg_cnt) {
+   return malloc_page_zero(pf, pg_cnt, false);
+}
+
+/* 分配pg_cnt个内容全为0的页空间,成功则返回起始虚拟地址,失败时返回NULL */
+void* malloc_zeroed_page(enum pool_flags pf, uint32_t pg_cnt) {
+   return malloc_page_zero(pf, pg_cnt, true);
+}
+
 /* 从内核物理内存池中申请pg_cnt页内存,
  * 成功则返回其虚拟地址,失败则返回NULL */
 void* get_kernel_pages(uint32_t pg_cnt) {
    lock_acquire(&kernel_pool.lock);
-   void* vaddr =  malloc_page(PF_KERNEL, pg_cnt);
-   if (vaddr != NULL) {	   // 若分配的地址不为空,将页框清0后返回
-      memset(vaddr, 0, pg_cnt * PG_SIZE);
-   }
+   void* vaddr =  malloc_zeroed_page(PF_KERNEL, pg_cnt);	   // 分配到的页框已清0
    lock_release(&kernel_pool.lock);
    return vaddr;
 }
 
+/* 归还 get_kernel_pages 得到的 pg_cnt 页.
+ * 内核虚拟地址位图的更新可能被抢占, 要和 get_kernel_pages 一样持 kernel_pool 的锁 */
+void free_kernel_pages(void* vaddr, uint32_t pg_cnt) {
+   lock_acquire(&kernel_pool.lock);
+   mfree_page(PF_KERNEL, vaddr, pg_cnt);
+   lock_release(&kernel_pool.lock);
+}
+
 /* 在用户空间中申请4k内存,并返回其虚拟地址 */
 void* get_user_pages(uint32_t pg_cnt) {
    lock_acquire(&user_pool.lock);
-   void* vaddr = malloc_page(PF_USER, pg_cnt);
-   memset(vaddr, 0, pg_cnt * PG_SIZE);
+   void* vaddr = malloc_zeroed_page(PF_USER, pg_cnt);	   // 分配到的页框已清0
    lock_release(&user_pool.lock);
    return vaddr;
 }
@@ -194,11 +881,12 @@ void* get_a_page(enum pool_flags pf, uint32_t vaddr) {
    struct task_struct* cur = running_thread();
    int32_t bit_idx = -1;
 
-/* 若当前是用户进程申请用户内存,就修改用户进程自己的虚拟地址位图 */
+/* 若当前是用户进程申请用户内存,就加入用户进程自己的虚拟内存区 */
    if (cur->pgdir != NULL && pf == PF_USER) {
-      bit_idx = (vaddr - cur->userprog_vaddr.vaddr_start) / PG_SIZE;
-      ASSERT(bit_idx > 0);
-      bitmap_set(&cur->userprog_vaddr.vaddr_bitmap, bit_idx, 1);
+      if (!vma_add(cur, vaddr, vaddr + PG_SIZE, VMA_READ | VMA_WRITE, VMA_ANON)) {
+	 lock_release(&mem_pool->lock);
+	 return NULL;
+      }
 
    } else if (cur->pgdir == NULL && pf == PF_KERNEL){
 /* 如果是内核线程申请内核内存,就修改kernel_vaddr. */
@@ -214,12 +902,27 @@ void* get_a_page(enum pool_flags pf, uint32_t vaddr) {
       return NULL;
    }
    page_table_add((void*)vaddr, page_phyaddr); 
+   if (pf == PF_USER) {
+      page_set_owner((uint32_t)page_phyaddr, cur, vaddr);
+   }
    lock_release(&mem_pool->lock);
    return (void*)vaddr;
 }
 
+/* 判断虚拟地址vaddr是否已映射到物理页 */
+bool page_mapped(uint32_t vaddr) {
+   // 页目录项不存在时不能访问pte, 否则会引发缺页异常
+   uint32_t pde = *pde_ptr(vaddr);
+   return (pde & PG_P_1) && ((pde & PG_PS) || (*pte_ptr(vaddr) & PG_P_1));
+}
+
 /* 得到虚拟地址映射到的物理地址 */
 uint32_t addr_v2p(uint32_t vaddr) {
+   uint32_t pde = *pde_ptr(vaddr);
+   if (pde & PG_PS) {
+      // 大页: pde的高10位是4M页框的物理地址, vaddr的低22位是页内偏移
+      return (pde & 0xffc00000) + (vaddr & 0x003fffff);
+   }
    uint32_t* pte = pte_ptr(vaddr);
 /* (*pte)的值是页表所在的物理页框地址,
  * 去掉其低12位的页表项属性+虚拟地址vaddr的低12位 */
@@ -227,72 +930,219 @@ uint32_t addr_v2p(uint32_t vaddr) {
 }
 
 /* 初始化内存池 */
-static void mem_pool_init(uint32_t all_mem) {
+static void mem_pool_init(void) {
    put_str("   mem_pool_init start\n");
-   uint32_t page_table_size = PG_SIZE * 256;	  // 页表大小= 1页的页目录表+第0和第768个页目录项指向同一个页表+
-                                                  // 第769~1022个页目录项共指向254个页表,共256个页框
-   uint32_t used_mem = page_table_size + 0x100000;	  // 0x100000为低端1M内存
-   uint32_t free_mem = all_mem - used_mem;
-   uint16_t all_free_pages = free_mem / PG_SIZE;		  // 1页为4k,不管总内存是不是4k的倍数,
-							  // 对于以页为单位的内存分配策略，不足1页的内存不用考虑了。
-   uint16_t kernel_free_pages = all_free_pages / 2;
-   uint16_t user_free_pages = all_free_pages - kernel_free_pages;
-
-/* 为简化位图操作，余数不处理，坏处是这样做会丢内存。
-好处是不用做内存的越界检查,因为位图表示的内存少于实际物理内存*/
-   uint32_t kbm_length = kernel_free_pages / 8;			  // Kernel BitMap的长度,位图中的一位表示一页,以字节为单位
-   uint32_t ubm_length = user_free_pages / 8;			  // User BitMap的长度.
-
-   uint32_t kp_start = used_mem;				  // Kernel Pool start,内核内存池的起始地址
-   uint32_t up_start = kp_start + kernel_free_pages * PG_SIZE;	  // User Pool start,用户内存池的起始地址
-
-   kernel_pool.phy_addr_start = kp_start;
-   user_pool.phy_addr_start   = up_start;
-
-   kernel_pool.pool_size = kernel_free_pages * PG_SIZE;
-   user_pool.pool_size	 = user_free_pages * PG_SIZE;
-
-   kernel_pool.pool_bitmap.btmp_bytes_len = kbm_length;
-   user_pool.pool_bitmap.btmp_bytes_len	  = ubm_length;
-
-/*********    内核内存池和用户内存池位图   ***********
- *   位图是全局的数据，长度不固定。
- *   全局或静态的数组需要在编译时知道其长度，
- *   而我们需要根据总内存大小算出需要多少字节。
- *   所以改为指定一块内存来生成位图.
- *   ************************************************/
-// 内核使用的最高地址是0xc009f000,这是主线程的栈地址.(内核的大小预计为70K左右)
-// 32M内存占用的位图是2k.内核内存池的位图先定在MEM_BITMAP_BASE(0xc009a000)处.
-   kernel_pool.pool_bitmap.bits = (void*)MEM_BITMAP_BASE;
-							       
-/* 用户内存池的位图紧跟在内核内存池位图之后 */
-   user_pool.pool_bitmap.bits = (void*)(MEM_BITMAP_BASE + kbm_length);
-   /******************** 输出内存池信息 **********************/
-   put_str("      kernel_pool_bitmap_start:");put_int((int)kernel_pool.pool_bitmap.bits);
-   put_str(" kernel_pool_phy_addr_start:");put_int(kernel_pool.phy_addr_start);
-   put_str("\n");
-   put_str("      user_pool_bitmap_start:");put_int((int)user_pool.pool_bitmap.bits);
-   put_str(" user_pool_phy_addr_start:");put_int(user_pool.phy_addr_start);
-   put_str("\n");
-
-   /* 将位图置0*/
+   mem_ranges_init();
+   uint32_t phy_end = mem_ranges[mem_range_cnt - 1].end;	 // 最高的可用地址
+   uint32_t all_span_pages = (phy_end - MEM_RESERVED_END) / PG_SIZE;
+
+/* 每个页框要有一个 struct page 描述符, 物理内存和内核虚拟地址池各要一个位图,
+ * 还有每4M一字节的块归属表, 总大小与物理内存成正比, 低端1M放不下, 所以从第一段
+ * 足够大的可用内存的最前面划出 meta_pages 页专门存放, 这些页框不属于任何内存池,
+ * 映射在内核堆的起始处. 这里按2M以上的全部地址估算, 按三个位图算, 宁多勿少 */
+   uint32_t bitmap_bytes = DIV_ROUND_UP(all_span_pages, 32) * 4;
+   uint32_t meta_pages = DIV_ROUND_UP(all_span_pages * sizeof(struct page) + bitmap_bytes * 3, PG_SIZE);
+   uint32_t range_idx = 0;
+   while (range_idx < mem_range_cnt && \
+	 mem_ranges[range_idx].end - mem_ranges[range_idx].start < meta_pages * PG_SIZE) {
+      range_idx++;
+   }
+   if (range_idx == mem_range_cnt) {
+      PANIC("mem_pool_init: no room for memory metadata");
+   }
+   uint32_t meta_start = mem_ranges[range_idx].start;	 // 元信息所在页框的起始地址
+   uint32_t kp_start = meta_start + meta_pages * PG_SIZE;	 // 两个内存池可管理物理内存的起始地址
+
+/* 元信息之后的物理内存都由两个池共同管理, 按4M分块划给两个池和储备 */
+   uint32_t all_free_pages = mem_usable_pages(kp_start, phy_end);
+   uint32_t span_pages = (phy_end - kp_start) / PG_SIZE;
+   chunk_base = kp_start & ~(CHUNK_SIZE - 1);
+   chunk_cnt = DIV_ROUND_UP((phy_end - chunk_base) / PG_SIZE, CHUNK_PAGES);
+
+/* 内核池的页框都要在内核虚拟地址池中有对应的虚拟页, 内核池借块时不能超出这个容量 */
+   uint32_t kernel_vpages = meta_pages + span_pages;
+   if (kernel_vpages > KERNEL_VPAGES_MAX) {
+      kernel_vpages = KERNEL_VPAGES_MAX;
+   }
+   kernel_pages_max = kernel_vpages - meta_pages;
+
+/* 位图要能表示每一页,伙伴系统会用到全部页框,所以这里向上取整 */
+   uint32_t pbm_length = DIV_ROUND_UP(span_pages, 32) * 4;	  // 物理内存位图的长度,位图中的一位表示一页,以字节为单位
+   uint32_t kvbm_length = DIV_ROUND_UP(kernel_vpages, 32) * 4;   // 内核虚拟地址位图的长度
+
+   kernel_pool.phy_addr_start = user_pool.phy_addr_start = kp_start;
+   kernel_pool.pool_size = user_pool.pool_size = span_pages * PG_SIZE;
+   kernel_pool.pool_bitmap.btmp_bytes_len = user_pool.pool_bitmap.btmp_bytes_len = pbm_length;
+   kernel_pool.owner = CHUNK_KERNEL;
+   user_pool.owner = CHUNK_USER;
+
+   /* 把元信息页映射到内核堆最前面, 依次存放 mem_map 数组、两个位图和块的归属表 */
+   uint32_t meta_idx = 0;
+   while (meta_idx < meta_pages) {
+      page_table_add((void*)(K_HEAP_START + meta_idx * PG_SIZE), (void*)(meta_start + meta_idx * PG_SIZE));
+      meta_idx++;
+   }
+   mem_map = (struct page*)K_HEAP_START;
+   mem_map_cnt = span_pages;
+   uint8_t* bitmap_base = (uint8_t*)(mem_map + span_pages);
+   chunk_owners = bitmap_base + pbm_length + kvbm_length;
+   ASSERT((uint32_t)chunk_owners + chunk_cnt <= K_HEAP_START + meta_pages * PG_SIZE);
+   memset(mem_map, 0, span_pages * sizeof(struct page));
+
+   kernel_pool.pool_bitmap.bits = user_pool.pool_bitmap.bits = bitmap_base;
    bitmap_init(&kernel_pool.pool_bitmap);
-   bitmap_init(&user_pool.pool_bitmap);
 
    lock_init(&kernel_pool.lock);
    lock_init(&user_pool.lock);
 
-   /* 下面初始化内核虚拟地址的位图,按实际物理内存大小生成数组。*/
-   kernel_vaddr.vaddr_bitmap.btmp_bytes_len = kbm_length;      // 用于维护内核堆的虚拟地址,所以要和内核内存池大小一致
-
-  /* 位图的数组指向一块未使用的内存,目前定位在内核内存池和用户内存池之外*/
-   kernel_vaddr.vaddr_bitmap.bits = (void*)(MEM_BITMAP_BASE + kbm_length + ubm_length);
-
+   /* 下面初始化内核虚拟地址的位图,按内核池可能的最大容量生成 */
+   kernel_vaddr.vaddr_bitmap.btmp_bytes_len = kvbm_length;
+   kernel_vaddr.vaddr_bitmap.bits = bitmap_base + pbm_length;
    kernel_vaddr.vaddr_start = K_HEAP_START;
    bitmap_init(&kernel_vaddr.vaddr_bitmap);
+
+   /* 元信息页在内核虚拟地址位图中占住 */
+   meta_idx = 0;
+   while (meta_idx < meta_pages) {
+      bitmap_set(&kernel_vaddr.vaddr_bitmap, meta_idx++, 1);
+   }
+
+/* 内核池从低地址、用户池从高地址各取到下限那么多的块, 其余留作储备.
+ * 内存连两个下限都不够时, 内核池的下限按可用内存的一半算 */
+   uint32_t kernel_floor = KERNEL_POOL_FLOOR / PG_SIZE;
+   uint32_t user_floor = USER_POOL_FLOOR / PG_SIZE;
+   if (kernel_floor > all_free_pages / 2) {
+      kernel_floor = all_free_pages / 2;
+   }
+   if (user_floor > all_free_pages - kernel_floor) {
+      user_floor = all_free_pages - kernel_floor;
+   }
+   kernel_pool.floor_pages = kernel_floor;
+   user_pool.floor_pages = user_floor;
+
+   memset(chunk_owners, CHUNK_RESERVE, chunk_cnt);
+   uint32_t kernel_pages = 0, user_pages = 0;
+   uint32_t low = 0, high = chunk_cnt;
+   while (low < high && kernel_pages < kernel_floor) {
+      uint32_t pages = chunk_usable_pages(low);
+      if (kernel_pages + pages > kernel_pages_max) {
+	 break;
+      }
+      chunk_owners[low++] = CHUNK_KERNEL;
+      kernel_pages += pages;
+   }
+   while (high > low && user_pages < user_floor) {
+      chunk_owners[--high] = CHUNK_USER;
+      user_pages += chunk_usable_pages(high);
+   }
+   reserve_pages = all_free_pages - kernel_pages - user_pages;
+
+   /******************** 输出内存池信息 **********************/
+   put_str("      usable_mem_ranges:");put_int(mem_range_cnt);
+   put_str(" usable_pages:");put_int(all_free_pages);
+   put_str(" buddy_meta_pages:");put_int(meta_pages);
+   put_str("\n");
+   put_str("      pool_phy_addr_start:");put_int(kp_start);
+   put_str(" chunks:");put_int(chunk_cnt);
+   put_str("\n");
+   put_str("      kernel_pages:");put_int(kernel_pages);
+   put_str(" user_pages:");put_int(user_pages);
+   put_str(" reserve_pages:");put_int(reserve_pages);
+   put_str("\n");
+
+   buddy_init(&kernel_pool);
+   buddy_init(&user_pool);
+
+   list_init(&kernel_pool.zeroed_list);
+   list_init(&user_pool.zeroed_list);
+   kernel_pool.zeroed_cnt = user_pool.zeroed_cnt = 0;
+   kernel_pool.zero_hits = user_pool.zero_hits = 0;
+   kernel_pool.zero_misses = user_pool.zero_misses = 0;
    put_str("   mem_pool_init done\n");
 }
 
+/* 统计m_pool的位图中前pg_cnt位有多少位为0 */
+static uint32_t pool_bitmap_free_cnt(struct pool* m_pool) {
+   uint32_t free_cnt = 0, chunk_idx = 0;
+   while (chunk_idx < chunk_cnt) {
+      if (chunk_owners[chunk_idx] == m_pool->owner) {
+	 uint32_t start, end;
+	 chunk_range(chunk_idx, &start, &end);
+	 uint32_t idx = (start - m_pool->phy_addr_start) / PG_SIZE;
+	 uint32_t idx_end = (end - m_pool->phy_addr_start) / PG_SIZE;
+	 while (idx < idx_end) {
+	    if (!bitmap_scan_test(&m_pool->pool_bitmap, idx)) {
+	       free_cnt++;
+	    }
+	    idx++;
+	 }
+      }
+      chunk_idx++;
+   }
+   return free_cnt;
+}
+
+/* 伙伴系统启动自检: 分配和释放的结果要与位图记录的一致,
+ * 全部释放后各阶空闲块要合并回初始状态 */
+static void buddy_self_test(struct pool* m_pool) {
+   put_str("   buddy_self_test start\n");
+   uint32_t nr_free_bak[BUDDY_MAX_ORDER + 1];
+   uint8_t order = 0;
+   while (order <= BUDDY_MAX_ORDER) {
+      nr_free_bak[order] = m_pool->free_area[order].nr_free;
+      order++;
+   }
+   uint32_t free_pages_bak = m_pool->free_pages;
+   ASSERT(pool_bitmap_free_cnt(m_pool) == free_pages_bak);
+
+   #define BUDDY_TEST_CNT 32
+   uint32_t pg_phy_addr[BUDDY_TEST_CNT];
+   uint8_t pg_order[BUDDY_TEST_CNT];
+   uint32_t test_idx = 0, pg_idx, alloc_pages = 0;
+   while (test_idx < BUDDY_TEST_CNT) {
+      /* 单页和 2~8 页的块交替申请 */
+      pg_order[test_idx] = (test_idx % 4 == 3) ? test_idx % 3 + 1 : 0;
+      pg_phy_addr[test_idx] = (uint32_t)buddy_alloc(m_pool, pg_order[test_idx]);
+      if (pg_phy_addr[test_idx] == 0) {
+	 PANIC("buddy_self_test: alloc failed");
+      }
+      /* 块必须按自身大小对齐,并且在位图中整块置1 */
+      ASSERT(((pg_phy_addr[test_idx] / PG_SIZE) & ((1 << pg_order[test_idx]) - 1)) == 0);
+      pg_idx = (pg_phy_addr[test_idx] - m_pool->phy_addr_start) / PG_SIZE;
+      uint32_t cnt = 1 << pg_order[test_idx];
+      while (cnt-- > 0) {
+	 ASSERT(bitmap_scan_test(&m_pool->pool_bitmap, pg_idx++));
+      }
+      alloc_pages += 1 << pg_order[test_idx];
+      test_idx++;
+   }
+   ASSERT(m_pool->free_pages + alloc_pages == free_pages_bak);
+   ASSERT(pool_bitmap_free_cnt(m_pool) == m_pool->free_pages);
+
+   /* 先释放奇数项再释放偶数项,打乱释放顺序以检验合并 */
+   test_idx = 1;
+   while (test_idx < BUDDY_TEST_CNT) {
+      buddy_free(m_pool, pg_phy_addr[test_idx], pg_order[test_idx]);
+      test_idx += 2;
+   }
+   test_idx = 0;
+   while (test_idx < BUDDY_TEST_CNT) {
+      buddy_free(m_pool, pg_phy_addr[test_idx], pg_order[test_idx]);
+      test_idx += 2;
+   }
+
+   ASSERT(m_pool->free_pages == free_pages_bak);
+   ASSERT(pool_bitmap_free_cnt(m_pool) == free_pages_bak);
+   order = 0;
+   while (order <= BUDDY_MAX_ORDER) {
+      if (m_pool->free_area[order].nr_free != nr_free_bak[order]) {
+	 PANIC("buddy_self_test: free blocks not coalesced");
+      }
+      order++;
+   }
+   put_str("   buddy_self_test done\n");
+}
+
 /* 内存仓库 arena 元信息 */
 struct arena {
     struct mem_block_desc* desc;    // 此 arena 关联的 mem_block_desc
@@ -300,6 +1150,9 @@ struct arena {
     // 否则 cnt 表示空闲 mem_block 数量
     uint32_t cnt;
     bool large;
+    struct mem_block* free_list;    // 本 arena 中已释放过的空闲内存块
+    uint32_t carve_idx;             // 从未分出过的内存块从这个下标开始, 新 arena 按需切分
+    struct list_elem arena_tag;     // 用于加入 desc 的 partial_list
 };
 
 
@@ -318,6 +1171,187 @@ static struct arena* block2arena(struct mem_block* b) {
     return (struct arena*) ((uint32_t) b & 0xfffff000);
 }
 
+/* 从 desc 规格的 arena 中取出一个空闲内存块, 没有就新建 arena,
+ * 须持有 pf 对应内存池的锁, 失败返回 NULL */
+static struct mem_block* block_get(enum pool_flags PF, struct mem_block_desc* desc) {
+    struct arena* a;
+    struct mem_block* b;
+
+    // 若 mem_block_desc 的 partial_list 中已经没有还有空闲块的 arena
+    // 就创建新的 arena 提供 mem_block
+    if(list_empty(&desc->partial_list)) {
+        a = malloc_page(PF, 1);     // 分配 1 页框做为 arena
+        if(a == NULL) {
+            return NULL;
+        }
+
+        // 对于分配的小块内存, 将 desc 置为相应内存块描述符
+        // cnt 置为 arena 可用的内存块数, large 置为 false
+        // 内存块不在这里逐个拆分, 而是分配时通过 carve_idx 按需切出
+        a->desc = desc;
+        a->large = false;
+        a->cnt = desc->blocks_per_arena;
+        a->free_list = NULL;
+        a->carve_idx = 0;
+        list_push(&desc->partial_list, &a->arena_tag);
+        desc->empty_arenas++;
+        desc->arena_cnt++;
+        desc->free_blocks += desc->blocks_per_arena;
+    }
+
+    // 开始分配内存块, 队首的 arena 一定还有空闲块
+    a = elem2entry(struct arena, arena_tag, desc->partial_list.head.next);
+    if(a->free_list != NULL) {
+        b = a->free_list;
+        a->free_list = b->next;
+    } else {
+        b = arena2block(a, a->carve_idx++);
+    }
+    desc->free_blocks--;
+
+    if(a->cnt-- == desc->blocks_per_arena) {
+        // arena 原本全空闲
+        desc->empty_arenas--;
+    }
+    if(a->cnt == 0) {
+        // arena 中的内存块分完了, 不再留在 partial_list 中
+        list_remove(&a->arena_tag);
+    }
+    return b;
+}
+
+/* 把内存块 b 还给它所在的 arena, 须持有 pf 对应内存池的锁 */
+static void block_put(enum pool_flags PF, struct mem_block* b) {
+    // 把 mem_block 转换成 arena, 获取元信息
+    struct arena* a = block2arena(b);
+    struct mem_block_desc* desc = a->desc;
+    // 先将内存块回收到所在 arena 的 free_list
+    b->next = a->free_list;
+    a->free_list = b;
+    desc->free_blocks++;
+
+    if(a->cnt++ == 0) {
+        // arena 原本已分完, 重新加入 partial_list 队首, 优先从它分配
+        list_push(&desc->partial_list, &a->arena_tag);
+    }
+
+    // 再判断此 arena 中的内存块是否都是空闲
+    if(a->cnt == desc->blocks_per_arena) {
+        if(desc->empty_arenas < ARENA_EMPTY_MAX) {
+            // 保留下来以免反复申请释放页框, 移到队尾让其它 arena 先被用满
+            list_remove(&a->arena_tag);
+            list_append(&desc->partial_list, &a->arena_tag);
+            desc->empty_arenas++;
+        } else {
+            // 空闲 arena 够多了, 释放 arena(整个arena)
+            list_remove(&a->arena_tag);
+            desc->arena_cnt--;
+            desc->free_blocks -= desc->blocks_per_arena;
+            mfree_page(PF, a, 1);
+        }
+    }
+}
+
+/* fork 出的子进程释放 fork 之前分配的块时, arena 是父进程 arena 的写时复制副本,
+ * a->desc 还指向父进程 pcb 中的描述符, 父进程可能已经退出.
+ * 把它改指子进程 descs 中同一规格的描述符并计入其统计, 以后就是子进程自己的 arena.
+ * 描述符数组总在某个 pcb 的 u_block_desc 中, 下标只用地址算出, 不访问父进程的 pcb.
+ * 它原来的 arena_tag 挂在父进程的链表上, 不能摘下, 直接重新挂入. 须持有用户内存池的锁 */
+static void arena_adopt(struct arena* a, struct mem_block_desc* descs) {
+    struct task_struct* owner = (struct task_struct*)((uint32_t)a->desc & 0xfffff000);
+    uint32_t desc_idx = a->desc - owner->u_block_desc;
+    ASSERT(desc_idx < DESC_CNT);
+    struct mem_block_desc* desc = &descs[desc_idx];
+    // 块还没有还回来, arena 不会是全空闲的
+    ASSERT(a->cnt < desc->blocks_per_arena);
+    a->desc = desc;
+    desc->arena_cnt++;
+    desc->free_blocks += a->cnt;
+    if(a->cnt != 0) {
+        list_append(&desc->partial_list, &a->arena_tag);
+    }
+}
+
+/************************  每个任务的内存块弹匣  ***************************
+ * sys_malloc/sys_free 原先每次都要获取内存池的锁, 锁由信号量实现, 可能阻塞,
+ * 所有线程和进程的小块分配都在这把锁上排队. 现在每个任务为每种规格准备一个
+ * 弹匣(magazine), 缓存最多 MAG_SIZE 个空闲内存块: 分配时先从弹匣取,
+ * 释放时先放回弹匣, 都不需要锁. 弹匣空了才持锁从 arena 一次取 MAG_BATCH 个,
+ * 满了才持锁一次还回 MAG_BATCH 个. 弹匣只由任务自己访问, 只需关中断防止
+ * 中断处理程序在同一任务的上下文中重入.
+ * 弹匣中的块在 arena 看来是已分配的, 不计入 mem_block_desc 的 free_blocks.
+ ***************************************************************************/
+
+/* 从弹匣 mag 中取出一个内存块, 弹匣为空返回 NULL */
+static struct mem_block* mag_pop(struct mem_magazine* mag) {
+    struct mem_block* b = NULL;
+    enum intr_status old_status = intr_disable();
+    if(mag->cnt > 0) {
+        b = mag->blocks;
+        mag->blocks = b->next;
+        mag->cnt--;
+    }
+    intr_set_status(old_status);
+    return b;
+}
+
+/* 把内存块 b 放入弹匣 mag, 弹匣已满返回 false */
+static bool mag_push(struct mem_magazine* mag, struct mem_block* b) {
+    bool pushed = false;
+    enum intr_status old_status = intr_disable();
+    if(mag->cnt < MAG_SIZE) {
+        b->next = mag->blocks;
+        mag->blocks = b;
+        mag->cnt++;
+        pushed = true;
+    }
+    intr_set_status(old_status);
+    return pushed;
+}
+
+/* 持锁从 desc 规格的 arena 中取最多 MAG_BATCH 个内存块装入弹匣 mag */
+static void mag_refill(enum pool_flags PF, struct pool* mem_pool, \
+      struct mem_block_desc* desc, struct mem_magazine* mag) {
+    lock_acquire(&mem_pool->lock);
+    uint32_t cnt = 0;
+    while(cnt++ < MAG_BATCH) {
+        struct mem_block* b = block_get(PF, desc);
+        if(b == NULL) {
+            break;
+        }
+        if(!mag_push(mag, b)) {
+            block_put(PF, b);
+            break;
+        }
+    }
+    lock_release(&mem_pool->lock);
+}
+
+/* 持锁把弹匣 mag 中最多 cnt 个内存块还给它们所在的 arena */
+static void mag_drain(enum pool_flags PF, struct pool* mem_pool, struct mem_magazine* mag, uint32_t cnt) {
+    lock_acquire(&mem_pool->lock);
+    struct mem_block* b;
+    while(cnt-- > 0 && (b = mag_pop(mag)) != NULL) {
+        block_put(PF, b);
+    }
+    lock_release(&mem_pool->lock);
+}
+
+/* 清空任务 pthread 的弹匣. 内核线程的块还给共享的 arena;
+ * 用户进程的块在它自己的用户空间中, 随用户空间一起回收, 直接丢弃 */
+void mem_magazine_flush(struct task_struct* pthread) {
+    uint32_t desc_idx;
+    for(desc_idx = 0; desc_idx < DESC_CNT; desc_idx++) {
+        struct mem_magazine* mag = &pthread->mags[desc_idx];
+        if(pthread->pgdir == NULL) {
+            mag_drain(PF_KERNEL, &kernel_pool, mag, MAG_SIZE);
+        } else {
+            mag->blocks = NULL;
+            mag->cnt = 0;
+        }
+    }
+}
+
 /* 在堆中申请 size 字节内存 */
 void* sys_malloc(uint32_t size) {
     enum pool_flags PF;
@@ -347,19 +1381,15 @@ void* sys_malloc(uint32_t size) {
         return NULL;
     }
 
-    struct arena* a;
-    struct mem_block* b;
-    lock_acquire(&mem_pool->lock);
-
     // 超过最大内存块 1024, 就分配页框
     if(size > 1024) {
         // 向上取整, 得到分配的页框数量
         uint32_t page_cnt = DIV_ROUND_UP(size + sizeof(struct arena), PG_SIZE);
     
-        a = malloc_page(PF, page_cnt);
+        lock_acquire(&mem_pool->lock);
+        struct arena* a = malloc_zeroed_page(PF, page_cnt);   // 分配到的内存已清零
 
         if(a != NULL) {
-            memset(a, 0, page_cnt * PG_SIZE);   // 将分配的内存清零
             // 对于分配的大块页框, 将 desc 置为 NULL, cnt 置为页框数, large 置为 true
             a->desc = NULL;
             a->cnt = page_cnt;
@@ -384,42 +1414,19 @@ void* sys_malloc(uint32_t size) {
             }
         }
 
-        // 若 mem_block_desc 的 free_list 中已经没有可用的 mem_block
-        // 就创建新的 arena 提供 mem_block
-        if(list_empty(&descs[desc_idx].free_list)) {
-            a = malloc_page(PF, 1);     // 分配 1 页框做为 arena
-            if(a == NULL) {
-                lock_release(&mem_pool->lock);
+        struct mem_block_desc* desc = &descs[desc_idx];
+        struct mem_magazine* mag = &cur_thread->mags[desc_idx];
+
+        // 先从自己的弹匣取, 弹匣空了才持锁成批装填
+        struct mem_block* b = mag_pop(mag);
+        if(b == NULL) {
+            mag_refill(PF, mem_pool, desc, mag);
+            b = mag_pop(mag);
+            if(b == NULL) {
                 return NULL;
             }
-            memset(a, 0, PG_SIZE);      // 清空申请的页框
-
-            // 对于分配的小块内存, 将 desc 置为相应内存块描述符
-            // cnt 置为 arena 可用的内存块数, large 置为 false
-            a->desc = &descs[desc_idx];
-            a->large = false;
-            a->cnt = descs[desc_idx].blocks_per_arena;
-            uint32_t block_idx;
-
-            enum intr_status old_status = intr_disable();
-
-            // 开始将 arena 拆分成内存块, 并添加到内存块描述符的 free_list 中
-            for(block_idx = 0; block_idx < descs[desc_idx].blocks_per_arena; block_idx++) {
-                b = arena2block(a, block_idx);
-                ASSERT(!elem_find(&a->desc->free_list, &b->free_elem));
-                list_append(&a->desc->free_list, &b->free_elem);
-            }
-            intr_set_status(old_status);
         }
-
-        // 开始分配内存块
-        // 从 free_list 弹出一个内存块(mem_block)中的list_elem, 获取 mem_block 的地址
-        b = elem2entry(struct mem_block, free_elem, list_pop(&(descs[desc_idx].free_list)));
-        memset(b, 0, descs[desc_idx].block_size);
-
-        a = block2arena(b);     // 获取内存块 b 所在的 arena
-        a->cnt--;               // 将此 arena 中的空闲块数减 1
-        lock_release(&mem_pool->lock);
+        memset(b, 0, desc->block_size);
         return (void*) b;
     }
 }
@@ -438,35 +1445,115 @@ void block_desc_init(struct mem_block_desc* desc_array) {
          // blocks_per_arena(本 arena 中可容纳此 mem_block 的数量) = 
          // (每页大小 - arena 元信息) /  内存块规格
          desc_array[desc_idx].blocks_per_arena = (PG_SIZE - sizeof(struct arena)) / block_size;
-         list_init(&desc_array[desc_idx].free_list);
+         list_init(&desc_array[desc_idx].partial_list);
+         desc_array[desc_idx].empty_arenas = 0;
+         desc_array[desc_idx].arena_cnt = 0;
+         desc_array[desc_idx].free_blocks = 0;
          block_size *= 2;   // 更新为下一个规格内存块
     }
 }
 
 /* 将物理地址 pg_phy_addr 回收到物理内存池 */
 void pfree(uint32_t pg_phy_addr) {
-    struct pool* mem_pool;
-    uint32_t bit_idx = 0;
-    if(pg_phy_addr >= user_pool.phy_addr_start) {
-        // 用户物理内存池
-        mem_pool = &user_pool;
-        bit_idx = (pg_phy_addr - user_pool.phy_addr_start) / PG_SIZE;
-    } else {
-        // 内核物理内存池
-        mem_pool = &kernel_pool;
-        bit_idx = (pg_phy_addr - kernel_pool.phy_addr_start) / PG_SIZE;
+    if(page_unshare(pg_phy_addr)) {
+        // 还有别的页表项共享此页框
+        return;
     }
-    bitmap_set(&mem_pool->pool_bitmap, bit_idx, 0);     // 将位图中该位清 0
+    // 页框所在块属于哪个池就还给哪个池的伙伴系统, 位图中该位同时清 0
+    buddy_free(phy_addr_pool(pg_phy_addr), pg_phy_addr, 0);
+}
+
+/* 将以物理地址 pg_phy_addr 起始的 2^order 个连续页框回收到物理内存池 */
+void pfree_pages(uint32_t pg_phy_addr, uint8_t order) {
+    buddy_free(phy_addr_pool(pg_phy_addr), pg_phy_addr, order);
 }
 
 
-/* 去掉页表中虚拟地址 vaddr 的映射, 只去掉 vaddr 对应的 pte */
-static void page_table_pte_remove(uint32_t vaddr) {
-    uint32_t* pte = pte_ptr(vaddr);
-    *pte &= ~PG_P_1;                                        // 将页表项 pte 的 P 位置 0
-    asm volatile("invlpg %0" : : "m"(vaddr) : "memory");    // 更新 tlb
+/* 重新加载 cr3, 一次性刷新 tlb */
+static void tlb_flush_all(void) {
+   uint32_t cr3;
+   asm volatile ("movl %%cr3, %0" : "=r" (cr3));
+   asm volatile ("movl %0, %%cr3" : : "r" (cr3) : "memory");
+}
+
+/* 页表 pte_table 中的页表项是否都不存在, 换出的页也算存在 */
+static bool page_table_empty(uint32_t* pte_table) {
+   uint32_t pte_idx = 0;
+   while (pte_idx < 1024) {
+      if (pte_table[pte_idx++] & (PG_P_1 | PG_SWAP)) {
+	 return false;
+      }
+   }
+   return true;
 }
 
+/* 解除[vaddr, vaddr + pg_cnt * PG_SIZE)的映射并归还映射着的页框, 不修改虚拟地址位图.
+ * 按页表逐个处理, 页表不存在的 4M 整个跳过. 用户空间中页表项都已清空的页表一并释放,
+ * 内核的页表是各进程共享的, 不释放.
+ * 页数不超过 TLB_FLUSH_THRESHOLD 时逐页 invlpg, 否则最后只重新加载一次 cr3 */
+void page_range_unmap(enum pool_flags pf, uint32_t vaddr, uint32_t pg_cnt) {
+   ASSERT(vaddr % PG_SIZE == 0);
+   uint32_t end = vaddr + pg_cnt * PG_SIZE;
+   ASSERT(pf == PF_KERNEL || end <= 0xc0000000);
+   bool flush_all = pg_cnt > TLB_FLUSH_THRESHOLD;
+
+   while (vaddr < end) {
+      uint32_t table_start = vaddr & 0xffc00000;
+      uint32_t table_end = table_start + 0x400000;
+      if (table_end > end) {
+	 table_end = end;
+      }
+      uint32_t* pde = pde_ptr(vaddr);
+      if (!(*pde & PG_P_1)) {
+	 // 用户空间是按需分配的, 整个 4M 都没访问过时连页表都没有
+	 ASSERT(pf == PF_USER);
+	 vaddr = table_end;
+	 continue;
+      }
+      ASSERT(!(*pde & PG_PS));
+      bool whole_table = vaddr == table_start && table_end - table_start == 0x400000;
+
+      uint32_t* pte = pte_ptr(vaddr);
+      while (vaddr < table_end) {
+	 // ksmd 和换出会改别的进程的页表项, 读出页表项到处理完之间不能被打断
+	 enum intr_status old_status = intr_disable();
+	 if (*pte & PG_P_1) {
+	    uint32_t pg_phy_addr = *pte & 0xfffff000;
+	    // 确保物理地址属于 pf 对应的物理地址池
+	    ASSERT(phy_addr_pool(pg_phy_addr) == (pf == PF_USER ? &user_pool : &kernel_pool));
+	    pfree(pg_phy_addr);
+	    *pte &= ~PG_P_1;
+	    if (!flush_all) {
+	       asm volatile ("invlpg %0" : : "m" (*(char*)vaddr) : "memory");
+	    }
+	 } else if (*pte & PG_SWAP) {
+	    // 已换出的页没有物理页框, 放掉它占的交换槽
+	    ASSERT(pf == PF_USER);
+	    swap_entry_free(*pte);
+	    *pte = 0;
+	 } else {
+	    // 用户空间中从未访问过的页没有物理页框, 只需释放虚拟地址
+	    ASSERT(pf == PF_USER);
+	 }
+	 intr_set_status(old_status);
+	 pte++;
+	 vaddr += PG_SIZE;
+      }
+
+      if (pf == PF_USER && (whole_table || page_table_empty(pte_ptr(table_start)))) {
+	 pfree(*pde & 0xfffff000);
+	 MEM_STAT_ADD(pgtable_pages, -1);
+	 *pde = 0;
+	 if (!flush_all) {
+	    // invlpg 同时会清掉处理器缓存的页目录项
+	    asm volatile ("invlpg %0" : : "m" (*(char*)table_start) : "memory");
+	 }
+      }
+   }
+   if (flush_all) {
+      tlb_flush_all();
+   }
+}
 
 /* 在虚拟地址池中释放以 _vaddr 起始的连续 pg_cnt 个虚拟页地址 */
 static void vaddr_remove(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt) {
@@ -480,71 +1567,46 @@ static void vaddr_remove(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt) {
         }
 
     } else {
-        // 用户虚拟内存池
-        struct task_struct* cur_thread = running_thread();
-        bit_idx_start = (vaddr - cur_thread->userprog_vaddr.vaddr_start) / PG_SIZE;
-        while(cnt < pg_cnt) {
-            bitmap_set(&cur_thread->userprog_vaddr.vaddr_bitmap, bit_idx_start + (cnt++), 0);
-        }
+        // 用户虚拟内存区. 从中间挖掉时分配不到节点就只好留着这段地址, 页框已经释放了
+        vma_remove(running_thread(), vaddr, vaddr + pg_cnt * PG_SIZE);
     }
 }
 
-/* 释放以虚拟地址 vaddr 为起始的 cnt 个物理页框 */
+/* 释放以虚拟地址 vaddr 起始的 pg_cnt 个页, 连同它们的物理页框 */
 void mfree_page(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt) {
-    uint32_t pg_phy_addr;
-    uint32_t vaddr = (uint32_t) _vaddr, page_cnt = 0;
+    uint32_t vaddr = (uint32_t) _vaddr;
     ASSERT(pg_cnt >= 1 && vaddr % PG_SIZE == 0);
-    // 获取虚拟地址 vaddr 对应的物理地址
-    pg_phy_addr = addr_v2p(vaddr);
-
-    // 确保待释放的物理内存在低端 1MB+1KB 大小的页目录 + 1KB 大小的页表地址外
-    ASSERT((pg_phy_addr % PG_SIZE) == 0 && pg_phy_addr >= 0x102000);
-
-    // 判断 pg_phy_addr 属于用户物理内存池还是内核物理内存池
-    if(pg_phy_addr >= user_pool.phy_addr_start) {
-        // 位于用户物理内存池
-        vaddr -= PG_SIZE;
-        while(page_cnt < pg_cnt) {
-            vaddr += PG_SIZE;
-            pg_phy_addr = addr_v2p(vaddr);
-
-            // 确保物理地址属于用户物理地址池
-            ASSERT((pg_phy_addr % PG_SIZE) == 0 && pg_phy_addr >= user_pool.phy_addr_start);
-            
-            // 先将对应的物理页框归还到内存池
-            pfree(pg_phy_addr);
-
-            // 再从页表中清除此虚拟地址所在的页表项 pte
-            page_table_pte_remove(vaddr);
-
-            page_cnt++;
-        }
-        // 清空虚拟地址的位图中的相应位
-        vaddr_remove(pf, _vaddr, pg_cnt);
 
-    } else {
-        // 位于内核物理内存池
-        vaddr -= PG_SIZE;
-        while (page_cnt < pg_cnt) {
-            vaddr += PG_SIZE;
-            pg_phy_addr = addr_v2p(vaddr);
-            
-            // 确保待释放的物理内存只属于内核物理地址池
-            ASSERT((pg_phy_addr % PG_SIZE) == 0 && 
-                    pg_phy_addr >= kernel_pool.phy_addr_start && 
-                    pg_phy_addr < user_pool.phy_addr_start);
-
-            // 先将对应的物理页框归还到内存池
-            pfree(pg_phy_addr);
-
-            // 再从页表中清除此虚拟地址所在的页表框 pte
-            page_table_pte_remove(vaddr);
-
-            page_cnt++;
-        }
-        // 清空虚拟地址的位图中的相应位
-        vaddr_remove(pf, _vaddr, pg_cnt);
-    }
+    // 先解除映射并将物理页框归还到内存池
+    page_range_unmap(pf, vaddr, pg_cnt);
+    // 再清空虚拟地址的位图中的相应位
+    vaddr_remove(pf, _vaddr, pg_cnt);
+}
+
+/****************************  4M大页  *******************************
+ * 开启 PSE 后页目录项可以置 PS 位直接映射 4M 物理内存, 不需要页表,
+ * 一个 TLB 项就能覆盖整个 4M. 低端 4M 的内核映射(页目录项768)用大页,
+ * 它在各进程创建页目录表之前就改好了, 会随内核页目录项一起复制过去.
+ **********************************************************************/
+
+/* 若处理器支持PSE就打开它, 并把低端4M的内核映射换成一个大页 */
+static void pse_init(void) {
+   uint32_t eax, ebx, ecx, edx;
+   asm volatile ("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (1));
+   if (!(edx & CPUID_PSE)) {
+      put_str("   PSE not supported, kernel uses 4K pages only\n");
+      return;
+   }
+   uint32_t cr4;
+   asm volatile ("movl %%cr4, %0" : "=r" (cr4));
+   asm volatile ("movl %0, %%cr4" : : "r" (cr4 | CR4_PSE) : "memory");
+
+   /* 原来页目录项768指向的页表只映射了低端1M, 换成大页后低端4M都能直接访问,
+    * 包括页目录表和loader建立的各个页表, 它们仍被页目录项0等使用, 不能回收 */
+   *pde_ptr(0xc0000000) = PG_PS | PG_US_U | PG_RW_W | PG_P_1;
+   uint32_t cr3;
+   asm volatile ("movl %%cr3, %0; movl %0, %%cr3" : "=r" (cr3) : : "memory");
+   put_str("   PSE enabled, low 4M mapped by a large page\n");
 }
 
 /* 回收内存 ptr */
@@ -554,19 +1616,22 @@ void sys_free(void* ptr) {
     if(ptr != NULL) {
         enum pool_flags PF;
         struct pool* mem_pool;
+        struct mem_block_desc* descs;
+        struct task_struct* cur_thread = running_thread();
 
         // 判断是线程, 还是进程
-        if(running_thread()->pgdir == NULL) {
+        if(cur_thread->pgdir == NULL) {
             ASSERT((uint32_t) ptr >= K_HEAP_START);
             PF = PF_KERNEL;
             mem_pool = &kernel_pool;
+            descs = k_block_descs;
 
         } else {
             PF = PF_USER;
             mem_pool = &user_pool;
+            descs = cur_thread->u_block_desc;
         }
 
-        lock_acquire(&mem_pool->lock);
         struct mem_block* b = ptr;
         // 把 mem_block 转换成 arena, 获取元信息
         struct arena* a = block2arena(b);
@@ -574,36 +1639,289 @@ void sys_free(void* ptr) {
         ASSERT(a->large == 0 || a->large == 1);
         if(a->desc == NULL && a->large == true) {
             // 大于 1024 的内存
+            lock_acquire(&mem_pool->lock);
             mfree_page(PF, a, a->cnt);
+            lock_release(&mem_pool->lock);
+            return;
+        }
 
-        } else {
-            // 小于等于 1024 的内存块
-            // 先将内存块回收到 free_list
-            list_append(&a->desc->free_list, &b->free_elem);
-
-            // 再判断此 arena 中的内存块是否都是空闲, 如果是就释放 arena(整个arena)
-            if(++a->cnt == a->desc->blocks_per_arena) {
-                uint32_t block_idx;
-                for(block_idx = 0; block_idx < a->desc->blocks_per_arena; block_idx++) {
-                    struct mem_block* b = arena2block(a, block_idx);
-                    ASSERT(elem_find(&a->desc->free_list, &b->free_elem));
-                    list_remove(&b->free_elem);
-                }
-                mfree_page(PF, a, 1);
+        // 小于等于 1024 的内存块, 先放回自己的弹匣
+        uint32_t desc_idx = a->desc - descs;
+        if(desc_idx >= DESC_CNT) {
+            // arena 是 fork 之前父进程分配的, 先收归自己的描述符再还块
+            ASSERT(PF == PF_USER);
+            lock_acquire(&mem_pool->lock);
+            arena_adopt(a, descs);
+            block_put(PF, b);
+            lock_release(&mem_pool->lock);
+            return;
+        }
+        struct mem_magazine* mag = &cur_thread->mags[desc_idx];
+        if(!mag_push(mag, b)) {
+            // 弹匣满了, 持锁成批还回一部分再放入
+            mag_drain(PF, mem_pool, mag, MAG_BATCH);
+            if(!mag_push(mag, b)) {
+                lock_acquire(&mem_pool->lock);
+                block_put(PF, b);
+                lock_release(&mem_pool->lock);
             }
         }
-        lock_release(&mem_pool->lock);
     }
 }
 
+/* 调整当前进程brk堆的大小, 堆增长increment字节(可为负),
+ * 成功返回原来的堆结束地址, 失败返回(void*)-1.
+ * 新增的页只在虚拟地址位图中占住, 首次访问时才由缺页异常分配 */
+void* sys_sbrk(int32_t increment) {
+   struct task_struct* cur = running_thread();
+   ASSERT(cur->pgdir != NULL);
+   uint32_t old_brk = cur->brk;
+   uint32_t new_brk = old_brk + increment;
+   if ((increment > 0 && (new_brk < old_brk || new_brk > 0xc0000000 - USER_STACK_SIZE_MAX)) || \
+	 (increment < 0 && (new_brk > old_brk || new_brk < USER_BRK_START))) {
+      return (void*)-1;
+   }
+
+   /* 堆覆盖的页是[USER_BRK_START, brk向上取整到页) */
+   uint32_t old_end = DIV_ROUND_UP(old_brk, PG_SIZE) * PG_SIZE;
+   uint32_t new_end = DIV_ROUND_UP(new_brk, PG_SIZE) * PG_SIZE;
+   lock_acquire(&user_pool.lock);
+   if (new_end > old_end) {
+      /* 新的页可能已被 sys_malloc 等占用, 要先检查 */
+      if (!vma_range_free(cur, old_end, new_end) || \
+	    !vma_add(cur, old_end, new_end, VMA_READ | VMA_WRITE, VMA_HEAP)) {
+	 lock_release(&user_pool.lock);
+	 return (void*)-1;
+      }
+   } else if (new_end < old_end) {
+      mfree_page(PF_USER, (void*)new_end, (old_end - new_end) / PG_SIZE);
+   }
+   cur->brk = new_brk;
+   lock_release(&user_pool.lock);
+   return (void*)old_brk;
+}
+
+
+/* 填一个内存池的统计 */
+static void pool_stat_fill(struct pool* m_pool, struct mem_pool_stat* pstat) {
+   enum intr_status old_status = intr_disable();
+   pstat->total_pages = m_pool->total_pages;
+   pstat->free_pages = m_pool->free_pages;
+   pstat->zeroed_pages = m_pool->zeroed_cnt;
+   pstat->alloc_pages = m_pool->alloc_cnt;
+   pstat->freed_pages = m_pool->free_cnt;
+   pstat->zero_hits = m_pool->zero_hits;
+   pstat->zero_misses = m_pool->zero_misses;
+   intr_set_status(old_status);
+}
+
+/* 把内存使用情况填入 stat, stat 可以是用户空间的地址 */
+void sys_meminfo(struct mem_stat* stat) {
+   pool_stat_fill(&kernel_pool, &stat->kernel);
+   pool_stat_fill(&user_pool, &stat->user);
+   stat->reserve_pages = reserve_pages;
+
+   lock_acquire(&kernel_pool.lock);
+   uint32_t desc_idx;
+   for (desc_idx = 0; desc_idx < DESC_CNT; desc_idx++) {
+      stat->classes[desc_idx].block_size = k_block_descs[desc_idx].block_size;
+      stat->classes[desc_idx].arenas = k_block_descs[desc_idx].arena_cnt;
+      stat->classes[desc_idx].free_blocks = k_block_descs[desc_idx].free_blocks;
+   }
+   lock_release(&kernel_pool.lock);
+
+   stat->pgtable_pages = pgtable_pages;
+   stat->vma_cnt = vma_cnt;
+   stat->image_cache_pages = image_cache_pages();
+   swap_stat_fill(stat);
+
+   /* 各 slab cache 的计数由各自的锁保护, 这里只读个大概, 关中断保证链表不变 */
+   stat->slab_cnt = 0;
+   enum intr_status old_status = intr_disable();
+   struct list_elem* elem = kmem_cache_list.head.next;
+   while (elem != &kmem_cache_list.tail && stat->slab_cnt < MEM_STAT_SLABS) {
+      struct kmem_cache* cache = elem2entry(struct kmem_cache, cache_tag, elem);
+      struct mem_slab_stat* sstat = &stat->slabs[stat->slab_cnt++];
+      strcpy(sstat->name, cache->name);
+      sstat->obj_size = cache->obj_size;
+      sstat->slabs = cache->slab_cnt;
+      sstat->free_objs = cache->free_objs;
+      elem = elem->next;
+   }
+   intr_set_status(old_status);
+}
+
+
+/* 当前进程中写时复制的页 vaddr 若已没有其它共享者, 就恢复可写并归当前进程独占,
+ * 返回是否恢复了. 不刷新 tlb, 由调用者负责 */
+bool cow_page_reuse(uint32_t vaddr) {
+   uint32_t* pte = pte_ptr(vaddr);
+   uint32_t pg_phy_addr = *pte & 0xfffff000;
+   if ((*pte & (PG_P_1 | PG_COW)) != (PG_P_1 | PG_COW) || page_map_cnt(pg_phy_addr) != 1) {
+      return false;
+   }
+   *pte = (*pte & ~PG_COW) | PG_RW_W;
+   page_set_owner(pg_phy_addr, running_thread(), vaddr & 0xfffff000);
+   return true;
+}
+
+/* 写时复制: 进程写共享页 vaddr 时为其复制出独占的页框,
+ * 成功返回true, 若vaddr不是写时复制页则返回false */
+static bool cow_page_break(uint32_t vaddr) {
+   if (vaddr >= 0xc0000000 || !(*pde_ptr(vaddr) & PG_P_1)) {
+      return false;
+   }
+   uint32_t* pte = pte_ptr(vaddr);
+   if ((*pte & (PG_P_1 | PG_COW)) != (PG_P_1 | PG_COW)) {
+      return false;
+   }
+   uint32_t page_vaddr = vaddr & 0xfffff000;
+   uint32_t old_phyaddr = *pte & 0xfffff000;
+
+   // 其它共享者都已经不在了时, 页框归自己独占, 恢复可写即可
+   if (!cow_page_reuse(page_vaddr)) {
+      if (phy_to_page(old_phyaddr)->flags & PAGE_KSM) {
+	 MEM_STAT_ADD(ksm_pages_unshared, 1);
+      }
+      void* new_phyaddr = palloc(phy_addr_pool(old_phyaddr));
+      if (new_phyaddr == NULL) {
+	 return false;
+      }
+      // 旧页框在当前页表中仍可读, 直接复制到临时映射的新页框中
+      void* new_vaddr = kmap((uint32_t)new_phyaddr);
+      memcpy(new_vaddr, (void*)page_vaddr, PG_SIZE);
+      kunmap(new_vaddr);
+      *pte = (uint32_t)new_phyaddr | (*pte & 0x00000fff & ~PG_COW) | PG_RW_W;
+      page_set_owner((uint32_t)new_phyaddr, running_thread(), page_vaddr);
+      pfree(old_phyaddr);     // 只是减少旧页框的引用数
+   }
+   asm volatile ("invlpg %0" : : "m" (*(char*)page_vaddr) : "memory");
+   return true;
+}
+
+/* 按需分配: 用户进程访问了虚拟内存区中(包括用户栈可增长的范围)还没有映射的页,
+ * 就分配一个清0的页框映射上. 成功返回true, 否则返回false */
+static bool demand_page_fault(uint32_t vaddr) {
+   struct task_struct* cur = running_thread();
+   if (cur->pgdir == NULL || vaddr >= 0xc0000000 || vma_find(cur, vaddr) == NULL) {
+      return false;
+   }
+   uint32_t page_vaddr = vaddr & 0xfffff000;
+   if ((*pde_ptr(vaddr) & PG_P_1) && (*pte_ptr(vaddr) & PG_SWAP)) {
+      // 换出的页没能读回来, 不能当作没访问过的页重新分配
+      return false;
+   }
+
+   /* 只读段的页先看映像缓存里有没有, 有就以只读+写时复制的方式共享 */
+   uint32_t i_no;
+   bool shared = file_region_shared(page_vaddr, &i_no);
+   if (shared) {
+      uint32_t cached_phyaddr = image_cache_get(i_no, page_vaddr);
+      if (cached_phyaddr != 0) {
+	 page_table_add((void*)page_vaddr, (void*)cached_phyaddr);
+	 *pte_ptr(page_vaddr) = (*pte_ptr(page_vaddr) & ~PG_RW_W) | PG_COW;
+	 return true;
+      }
+   }
+
+   bool zeroed = false;
+   void* page_phyaddr = palloc_zeroed(&user_pool, &zeroed);
+   if (page_phyaddr == NULL && image_cache_shrink(1) != 0) {
+      // 内存紧张, 释放了没人用的映像缓存页后再试一次
+      page_phyaddr = palloc_zeroed(&user_pool, &zeroed);
+   }
+   if (page_phyaddr == NULL) {
+      return false;
+   }
+   page_table_add((void*)page_vaddr, page_phyaddr);
+   if (!zeroed) {
+      memset((void*)page_vaddr, 0, PG_SIZE);
+   }
+   // 进程体中的页还要从可执行文件读入内容, bss部分保持为0
+   if (!file_region_fill(page_vaddr)) {
+      return false;
+   }
+   if (shared) {
+      // 读入后改为只读, 并放入映像缓存供以后的进程共享
+      *pte_ptr(page_vaddr) = (*pte_ptr(page_vaddr) & ~PG_RW_W) | PG_COW;
+      asm volatile ("invlpg %0" : : "m" (*(char*)page_vaddr) : "memory");
+      image_cache_put(i_no, page_vaddr, (uint32_t)page_phyaddr);
+   } else {
+      // 内容准备好之后才登记独占者, 以免 ksmd 合并还在读入的页框
+      page_set_owner((uint32_t)page_phyaddr, cur, page_vaddr);
+   }
+   return true;
+}
+
+/* 换入: 用户进程访问了已换出的页, 分配页框从交换区读回来.
+ * 成功返回true, vaddr不是换出的页则返回false */
+static bool swap_page_fault(uint32_t vaddr) {
+   struct task_struct* cur = running_thread();
+   if (cur->pgdir == NULL || vaddr >= 0xc0000000 || !(*pde_ptr(vaddr) & PG_P_1)) {
+      return false;
+   }
+   uint32_t* pte = pte_ptr(vaddr);
+   uint32_t entry = *pte;
+   if ((entry & (PG_P_1 | PG_SWAP)) != PG_SWAP) {
+      return false;
+   }
+   uint32_t page_vaddr = vaddr & 0xfffff000;
+   void* page_phyaddr = palloc(&user_pool);
+   if (page_phyaddr == NULL) {
+      return false;
+   }
+   if (!swap_in(pte, entry, (uint32_t)page_phyaddr)) {
+      // 读盘期间页表项已经变了, 退还页框, 返回后重新执行引起异常的指令
+      pfree((uint32_t)page_phyaddr);
+      return true;
+   }
+   page_set_owner((uint32_t)page_phyaddr, cur, page_vaddr);
+   asm volatile ("invlpg %0" : : "m" (*(char*)page_vaddr) : "memory");
+   return true;
+}
+
+/* 缺页异常(0x0e)处理程序, 参数是kernel.S压入的中断号, 其地址就是中断栈 */
+static void page_fault_handler(uint32_t vec_nr) {
+   struct intr_stack* intr_stack = (struct intr_stack*)&vec_nr;
+   uint32_t fault_vaddr;
+   asm ("movl %%cr2, %0" : "=r" (fault_vaddr));	  // cr2是存放造成page_fault的地址
+
+   if (!(intr_stack->err_code & PF_ERR_P)) {
+      // 页不存在, 可能是换出的页或按需分配的页第一次被访问
+      if (swap_page_fault(fault_vaddr) || demand_page_fault(fault_vaddr)) {
+	 return;
+      }
+   } else if ((intr_stack->err_code & PF_ERR_W) && cow_page_break(fault_vaddr)) {
+      // 写已存在的页引起的异常才可能是写时复制
+      return;
+   }
+
+   put_str("\n!!!!!!!      page fault      !!!!!!!!\n");
+   put_str("page fault addr is ");put_int(fault_vaddr);
+   put_str(" err_code is ");put_int(intr_stack->err_code);
+   put_str(" eip is ");put_int((uint32_t)intr_stack->eip);
+   put_str("\n");
+   PANIC("unhandled page fault");
+}
 
 // 内存管理部分初始化入口
 void mem_init() {
     put_str("mem_init start\n");
-    uint32_t mem_bytes_total = (*(uint32_t*) (0xb00));  // 获取物理内存大小
-    mem_pool_init(mem_bytes_total);                     // 初始化内存池
+    mem_pool_init();                                    // 根据物理内存布局初始化内存池
+    buddy_self_test(&kernel_pool);                      // 伙伴系统自检
+    buddy_self_test(&user_pool);
+    chunk_balance_on = true;                            // 自检通过后两个池才开始向储备借还块
     // 初始化 mem_block_desc 数组 descs, 为 malloc 做准备
     block_desc_init(k_block_descs);
+    // 预留内核虚拟地址, 供 kmap 临时映射页框
+    kmap_base = (uint32_t)vaddr_get(PF_KERNEL, KMAP_SLOTS);
+    // 支持的话用4M大页映射低端内存
+    pse_init();
+    // 开启 CR0 的 WP 位, 使内核写只读的用户页时也触发缺页异常, 写时复制才完整
+    uint32_t cr0;
+    asm volatile ("movl %%cr0, %0" : "=r" (cr0));
+    asm volatile ("movl %0, %%cr0" : : "r" (cr0 | CR0_WP) : "memory");
+    register_handler(0x0e, page_fault_handler);
     put_str("mem_init done\n");
 }
 
@@ -625,17 +1943,8 @@ void* get_a_page_without_opvaddrbitmap(enum pool_flags pf, uint32_t vaddr) {
 
 /* 根据物理页框地址 pg_phy_addr 在相应的内存池的位图清 0, 不改动页表 */
 void free_a_phy_page(uint32_t pg_phy_addr) {
-    struct pool* mem_pool;
-    uint32_t bit_idx = 0;
-
-    if(pg_phy_addr >= user_pool.phy_addr_start) {
-        mem_pool = &user_pool;
-        bit_idx = (pg_phy_addr - user_pool.phy_addr_start) / PG_SIZE;
-
-    } else {
-        mem_pool = &kernel_pool;
-        bit_idx = (pg_phy_addr - kernel_pool.phy_addr_start) / PG_SIZE;
+    if(page_unshare(pg_phy_addr)) {
+        return;
     }
-
-    bitmap_set(&mem_pool->pool_bitmap, bit_idx, 0);
+    buddy_free(phy_addr_pool(pg_phy_addr), pg_phy_addr, 0);
 }
@@ -17,6 +17,13 @@ enum pool_flags {
 #define	 PG_RW_W  2	// R/W 属性位值, 读/写/执行
 #define	 PG_US_S  0	// U/S 属性位值, 系统级
 #define	 PG_US_U  4	// U/S 属性位值, 用户级
+#define	 PG_A	  0x20	// 访问位, 处理器访问该页时置 1, 由软件清 0
+#define	 PG_D	  0x40	// 脏位, 处理器写该页时置 1
+#define	 PG_COW	  0x200	// 页表项中供软件使用的 AVL 位, 表示该页为写时复制的共享页
+#define	 PG_SWAP  0x400	// AVL 位, P 为 0 时表示页已换出, 高 20 位是交换槽号
+#define	 PG_PS	  0x80	// 页目录项的 PS 位, 置 1 表示直接映射 4M 大页, 没有页表
+
+#define	 TLB_FLUSH_THRESHOLD 32	  // 一次解除映射的页数超过此值时, 不再逐页 invlpg, 改为重新加载 cr3
 
 /* 用于虚拟地址管理 */
 struct virtual_addr {
@@ -26,9 +33,9 @@ struct virtual_addr {
    uint32_t vaddr_start;
 };
 
-/* 内存块 */
+/* 内存块, 空闲时串在所属 arena 的空闲链表中 */
 struct mem_block {
-    struct list_elem free_elem;
+    struct mem_block* next;
 };
 
 
@@ -36,39 +43,179 @@ struct mem_block {
 struct mem_block_desc {
     uint32_t block_size;        // 内存块大小
     uint32_t blocks_per_arena;  // 本 arena(一页) 中可容纳此 mem_block 的数量
-    struct list free_list;      // 目前可用的 mem_block 链表
+    struct list partial_list;   // 还有空闲内存块的 arena 链表, 全空闲的 arena 排在后面
+    uint32_t empty_arenas;      // partial_list 中全空闲的 arena 数
+    uint32_t arena_cnt;         // 本规格的 arena 总数
+    uint32_t free_blocks;       // 所有 arena 中空闲内存块的总数
 };
 
 
 #define DESC_CNT 7             // 内存块描述符个数
+#define ARENA_EMPTY_MAX 2      // 每种规格最多保留的全空闲 arena 数, 超过才把页框还回去
+
+#define MAG_SIZE 8             // 每个任务每种规格的弹匣最多缓存的空闲内存块数
+#define MAG_BATCH 4            // 弹匣空了或满了时, 一次与 arena 交换的内存块数
+
+/* 任务私有的空闲内存块缓存(弹匣), 每种规格一个, 只由任务自己访问 */
+struct mem_magazine {
+    struct mem_block* blocks;   // 缓存的空闲内存块
+    uint32_t cnt;
+};
+
+#define BUDDY_MAX_ORDER 10     // 伙伴系统最大阶, 2^10 个页框即 4M
+
+struct task_struct;
+
+/* 页框的状态标志 */
+#define PAGE_FREE   0x01        // 空闲块的首页框, 挂在伙伴系统的空闲链表上
+#define PAGE_KERNEL 0x02        // 已从内核内存池分配出去
+#define PAGE_USER   0x04        // 已从用户内存池分配出去
+#define PAGE_KSM    0x20        // ksmd 合并出的只读共享页框
+
+/* 物理页框的描述符, 可管理物理内存中每个页框一个, 按页框号排成 mem_map 数组 */
+struct page {
+    struct list_elem free_tag;  // 空闲块首页框挂在对应阶的空闲链表上, 预先清0的页框挂在 zeroed_list 上
+    uint8_t order;              // 作为空闲块首页框时, 该块的阶
+    uint8_t flags;              // PAGE_* 标志
+    uint16_t ref_cnt;           // 引用数, 空闲时为0, 每个映射它的页表项、映像缓存和 ksmd 的持有各算一个
+    struct task_struct* owner;  // 用户页框独占时映射它的进程, 被共享或不是用户页时为 NULL
+    uint32_t vaddr;             // owner 不为 NULL 时, 页框在 owner 中映射的虚拟地址
+};
+
+extern struct page* mem_map;    // 可管理物理内存中每个页框的描述符
+extern uint32_t mem_map_cnt;    // mem_map 的元素个数
 
 /* 为 malloc 做准备 */
 void block_desc_init(struct mem_block_desc* desc_array);
 
+/*************************  内存统计  ***************************
+ * 计数器都在已有的临界区内或用一条 addl 指令更新,
+ * 单处理器上一条指令不会被中断打断, 所以分配的快速路径上不需要额外加锁 */
+#define MEM_STAT_ADD(counter, n) \
+   asm volatile ("addl %1, %0" : "+m" (counter) : "ir" ((uint32_t)(n)))
+
+extern uint32_t pgtable_pages;	     // 进程的页目录表和页表占用的页框数
+
+#define MEM_STAT_SLABS 8	     // 最多报告的 slab 缓存数
+
+/* 一个物理内存池的统计 */
+struct mem_pool_stat {
+    uint32_t total_pages;       // 池当前拥有的可用页框数, 随借还储备的块变化
+    uint32_t free_pages;        // 伙伴系统中的空闲页框数
+    uint32_t zeroed_pages;      // 预先清 0 的空闲页框数
+    uint32_t alloc_pages;       // 累计分配出去的页框数
+    uint32_t freed_pages;       // 累计回收的页框数
+    uint32_t zero_hits;         // 需要清 0 的分配用上了预先清 0 页框的次数
+    uint32_t zero_misses;
+};
+
+/* 一种内存块规格的统计 */
+struct mem_class_stat {
+    uint32_t block_size;
+    uint32_t arenas;
+    uint32_t free_blocks;
+};
+
+/* 一个 slab 缓存的统计 */
+struct mem_slab_stat {
+    char name[16];
+    uint32_t obj_size;
+    uint32_t slabs;
+    uint32_t free_objs;
+};
+
+/* sys_meminfo 返回的内存使用情况 */
+struct mem_stat {
+    struct mem_pool_stat kernel, user;
+    uint32_t reserve_pages;                    // 两个池之间的公共储备中可用的页框数
+    struct mem_class_stat classes[DESC_CNT];   // 内核 sys_malloc 的各规格
+    uint32_t pgtable_pages;
+    uint32_t vma_cnt;                          // 所有进程的虚拟内存区数
+    uint32_t image_cache_pages;                // 可执行映像缓存占用的页框数
+    uint32_t swap_total, swap_used;            // 交换区的页数及已用的页数, 没有交换区时都为0
+    uint32_t swap_ins, swap_outs;              // 累计换入、换出的页数
+    uint32_t slab_cnt;
+    struct mem_slab_stat slabs[MEM_STAT_SLABS];
+};
+
+/* 把内存使用情况填入 stat */
+void sys_meminfo(struct mem_stat* stat);
+
 extern struct pool kernel_pool, user_pool;
 void mem_init(void);
 void* get_kernel_pages(uint32_t pg_cnt);
+void free_kernel_pages(void* vaddr, uint32_t pg_cnt);
 void* malloc_page(enum pool_flags pf, uint32_t pg_cnt);
 void malloc_init(void);
 uint32_t* pte_ptr(uint32_t vaddr);
 uint32_t* pde_ptr(uint32_t vaddr);
 uint32_t addr_v2p(uint32_t vaddr);
+bool page_mapped(uint32_t vaddr);
 void* get_a_page(enum pool_flags pf, uint32_t vaddr);
 void* get_user_pages(uint32_t pg_cnt);
 //为malloc做准备
 void block_desc_init(struct mem_block_desc* desc_array);
 //在堆中申请size字节内存
 void* sys_malloc(uint32_t size);
+//调整brk堆的大小, 返回原来的堆结束地址
+void* sys_sbrk(int32_t increment);
 
 /* 释放以虚拟地址 vaddr 为起始的 cnt 个物理页框 */
 void mfree_page(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt);
 
+/* 解除一段虚拟地址的映射并归还物理页框, 不修改虚拟地址位图 */
+void page_range_unmap(enum pool_flags pf, uint32_t vaddr, uint32_t pg_cnt);
+
 /* 将物理地址 pg_phy_addr 回收到物理内存池 */
 void pfree(uint32_t pg_phy_addr);
 
+/* 把物理页框 pg_phy_addr 临时映射到内核空间, 返回其虚拟地址 */
+void* kmap(uint32_t pg_phy_addr);
+
+/* 解除 kmap 建立的临时映射 */
+void kunmap(void* vaddr);
+
+/* 物理页框 pg_phy_addr 多了一个共享的映射 */
+void page_share(uint32_t pg_phy_addr);
+
+/* 当前进程中写时复制的页 vaddr 已没有其它共享者时恢复可写, 返回是否恢复了 */
+bool cow_page_reuse(uint32_t vaddr);
+
+/* 返回物理页框 pg_phy_addr 的描述符 */
+struct page* phy_to_page(uint32_t pg_phy_addr);
+
+/* 返回描述符 pg 对应页框的物理地址 */
+uint32_t page_to_phy(struct page* pg);
+
+/* 返回物理页框 pg_phy_addr 的引用数 ref_cnt, 不只是映射它的页表项数,
+ * 还包括映像缓存和 ksmd 持有的引用. 调用者用它判断除了自己持有的引用外是否还有人在用 */
+uint32_t page_map_cnt(uint32_t pg_phy_addr);
+
+/* 找到独占进程中映射 pg 的页表项, 返回它在 kmap 出来的页表中的地址, 用完须 kunmap 所在的页.
+ * 映射关系已经变了返回 NULL. 须在关中断下调用 */
+uint32_t* page_owner_pte(struct page* pg);
+
+/* 分配 pg_cnt 个内容全为 0 的页空间, 优先使用预先清 0 的页框 */
+void* malloc_zeroed_page(enum pool_flags pf, uint32_t pg_cnt);
+
+/* 为内存池预先清 0 一个空闲页框, 由 idle 线程调用, 清 0 了一页返回 true */
+bool zero_page_refill(void);
+
+/* 获取 pf 对应内存池预备的清 0 页框数及命中、未命中次数 */
+void zero_page_stat(enum pool_flags pf, uint32_t* zeroed_cnt, uint32_t* hits, uint32_t* misses);
+
+/* 在 pf 对应的物理内存池中分配 2^order 个物理上连续的页框, 返回起始物理地址, 失败返回 NULL */
+void* palloc_pages(enum pool_flags pf, uint8_t order);
+
+/* 将以物理地址 pg_phy_addr 起始的 2^order 个连续页框回收到物理内存池 */
+void pfree_pages(uint32_t pg_phy_addr, uint8_t order);
+
 /* 回收内存 ptr */
 void sys_free(void* ptr);
 
+/* 清空任务 pthread 的内存块弹匣 */
+void mem_magazine_flush(struct task_struct* pthread);
+
 /* 安装 1 页大小的 vaddr, 专门针对 fork 时虚拟地址位图无须操作的情况 */
 void* get_a_page_without_opvaddrbitmap(enum pool_flags pf, uint32_t vaddr);
 
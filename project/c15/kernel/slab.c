@@ -0,0 +1,127 @@
+#include "slab.h"
+#include "memory.h"
+#include "global.h"
+#include "debug.h"
+#include "string.h"
+
+/**************************  slab 分配器  ****************************
+ * 每个 slab 占一页内核内存, 页首是 struct slab, 其后紧接着 objs_per_slab 个对象。
+ * slab 中的空闲对象用对象本身的前 4 字节串成单链表, 对象地址按页对齐后就是 slab。
+ * 分配和释放只摘挂链表, 不清零也不调用 sys_malloc,
+ * 所以不需要像以前那样临时把 pgdir 置为 NULL 来保证内存来自内核空间。
+ **********************************************************************/
+
+/* slab 元信息, 位于 slab 所在页的开头 */
+struct slab {
+    struct list_elem slab_tag;      // 用于加入 cache 的 partial_slabs 或 full_slabs
+    struct kmem_cache* cache;       // 所属的 cache
+    void* free_obj;                 // 空闲对象单链表
+    uint32_t inuse;                 // 已分配出去的对象数
+};
+
+struct list kmem_cache_list;        // 所有 cache 组成的链表
+
+/* 初始化 slab 分配器 */
+void slab_init(void) {
+    list_init(&kmem_cache_list);
+}
+
+/* 初始化对象大小为 size 的缓存 cache, ctor 可为 NULL */
+void kmem_cache_create(struct kmem_cache* cache, const char* name, uint32_t size, void (*ctor)(void*)) {
+    ASSERT(strlen(name) < KMEM_CACHE_NAME_LEN);
+    strcpy(cache->name, name);
+    // 对象至少要能放下空闲链表的指针
+    cache->obj_size = size < sizeof(void*) ? sizeof(void*) : (size + 3) & ~3;
+    cache->objs_per_slab = (PG_SIZE - sizeof(struct slab)) / cache->obj_size;
+    ASSERT(cache->objs_per_slab > 0);
+    cache->ctor = ctor;
+    list_init(&cache->partial_slabs);
+    list_init(&cache->full_slabs);
+    cache->slab_cnt = 0;
+    cache->free_objs = 0;
+    lock_init(&cache->lock);
+    list_append(&kmem_cache_list, &cache->cache_tag);
+}
+
+/* 为 cache 新建一个 slab, 将其中的对象串成空闲链表 */
+static struct slab* slab_create(struct kmem_cache* cache) {
+    struct slab* slab = get_kernel_pages(1);
+    if (slab == NULL) {
+        return NULL;
+    }
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->free_obj = NULL;
+
+    // 倒着串链表, 这样分配时从低地址开始
+    uint8_t* obj = (uint8_t*)(slab + 1) + cache->objs_per_slab * cache->obj_size;
+    uint32_t obj_idx = cache->objs_per_slab;
+    while (obj_idx-- > 0) {
+        obj -= cache->obj_size;
+        *(void**)obj = slab->free_obj;
+        slab->free_obj = obj;
+    }
+    cache->slab_cnt++;
+    cache->free_objs += cache->objs_per_slab;
+    return slab;
+}
+
+/* 从 cache 中分配一个对象, 对象的内容不会清零, 失败返回 NULL */
+void* kmem_cache_alloc(struct kmem_cache* cache) {
+    lock_acquire(&cache->lock);
+    struct slab* slab;
+    if (list_empty(&cache->partial_slabs)) {
+        slab = slab_create(cache);
+        if (slab == NULL) {
+            lock_release(&cache->lock);
+            return NULL;
+        }
+        list_push(&cache->partial_slabs, &slab->slab_tag);
+    } else {
+        slab = elem2entry(struct slab, slab_tag, cache->partial_slabs.head.next);
+    }
+
+    void* obj = slab->free_obj;
+    slab->free_obj = *(void**)obj;
+    slab->inuse++;
+    cache->free_objs--;
+    // slab 中的对象分完了就移到 full_slabs
+    if (slab->inuse == cache->objs_per_slab) {
+        list_remove(&slab->slab_tag);
+        list_append(&cache->full_slabs, &slab->slab_tag);
+    }
+    lock_release(&cache->lock);
+
+    // 对象的前 4 字节被空闲链表用过, 构造函数放在分配时调用
+    if (cache->ctor != NULL) {
+        cache->ctor(obj);
+    }
+    return obj;
+}
+
+/* 将对象 obj 归还给 cache */
+void kmem_cache_free(struct kmem_cache* cache, void* obj) {
+    ASSERT(obj != NULL);
+    struct slab* slab = (struct slab*)((uint32_t)obj & 0xfffff000);
+    ASSERT(slab->cache == cache && slab->inuse > 0);
+
+    lock_acquire(&cache->lock);
+    if (slab->inuse == cache->objs_per_slab) {
+        list_remove(&slab->slab_tag);
+        list_push(&cache->partial_slabs, &slab->slab_tag);
+    }
+    *(void**)obj = slab->free_obj;
+    slab->free_obj = obj;
+    slab->inuse--;
+    cache->free_objs++;
+
+    // 整个 slab 都空闲了, 如果其它 slab 中还有空闲对象, 就把这一页还给内核内存池,
+    // 否则留着它, 免得在一个对象上反复申请释放页框
+    if (slab->inuse == 0 && cache->free_objs > cache->objs_per_slab) {
+        list_remove(&slab->slab_tag);
+        cache->slab_cnt--;
+        cache->free_objs -= cache->objs_per_slab;
+        free_kernel_pages(slab, 1);     // 加锁顺序是 cache->lock 再 kernel_pool.lock
+    }
+    lock_release(&cache->lock);
+}
@@ -0,0 +1,38 @@
+#ifndef __KERNEL_SLAB_H
+#define __KERNEL_SLAB_H
+#include "stdint.h"
+#include "list.h"
+#include "../thread/sync.h"
+
+#define KMEM_CACHE_NAME_LEN 16
+
+/* 对象缓存, 每种频繁分配和释放的内核对象一个
+ * 对象从 slab(一页内核内存) 中切出, 大小按对象本身对齐, 没有 2 的幂次取整的浪费 */
+struct kmem_cache {
+    char name[KMEM_CACHE_NAME_LEN];
+    uint32_t obj_size;              // 对象大小, 已按 4 字节对齐
+    uint32_t objs_per_slab;         // 每个 slab 可容纳的对象数
+    void (*ctor)(void*);            // 对象构造函数, 每次分配对象时调用, 可为 NULL
+    struct list partial_slabs;      // 还有空闲对象的 slab
+    struct list full_slabs;         // 对象已全部分出去的 slab
+    uint32_t slab_cnt;              // slab 总数
+    uint32_t free_objs;             // 所有 slab 中空闲对象的总数
+    struct lock lock;
+    struct list_elem cache_tag;     // 用于加入全局 cache 链表
+};
+
+extern struct list kmem_cache_list;  // 所有 cache 组成的链表
+
+/* 初始化 slab 分配器 */
+void slab_init(void);
+
+/* 初始化对象大小为 size 的缓存 cache, ctor 可为 NULL */
+void kmem_cache_create(struct kmem_cache* cache, const char* name, uint32_t size, void (*ctor)(void*));
+
+/* 从 cache 中分配一个对象, 对象的内容不会清零, 失败返回 NULL */
+void* kmem_cache_alloc(struct kmem_cache* cache);
+
+/* 将对象 obj 归还给 cache */
+void kmem_cache_free(struct kmem_cache* cache, void* obj);
+
+#endif
@@ -0,0 +1,207 @@
+#include "swap.h"
+#include "memory.h"
+#include "global.h"
+#include "debug.h"
+#include "string.h"
+#include "interrupt.h"
+#include "print.h"
+#include "stdio-kernel.h"
+#include "../thread/sync.h"
+#include "../thread/thread.h"
+#include "../device/ide.h"
+
+/*************************  页的换出与换入  ****************************
+ * 用户池用完时, 原先分配直接失败, fork/exec 也跟着失败.
+ * 这里把一个磁盘分区当作交换区, 按页分成交换槽, 用户池空了就用 CLOCK 算法挑出
+ * 一段时间没被访问的用户页写到交换槽里, 腾出页框.
+ * 只换出被一个进程独占的匿名页框(映像缓存和共享页框都没有独占者), 换出后
+ * 页表项的 P 位为0, 置上 PG_SWAP, 高 20 位记交换槽号, 低位保留原来的属性,
+ * 进程再访问时在缺页异常中读回新分配的页框.
+ * CLOCK 指针按页框号扫描 mem_map, 页表项的访问位为1就清掉留到下一圈,
+ * 为0说明从上一圈到现在都没访问过, 就换出它.
+ * 改页表项和释放页框在关中断下一次做完, 读写盘和 swap_buf 由 swap_lock 串行.
+ ************************************************************************/
+
+#define SWAP_FS_TYPE 0x82		 // 分区表中 Linux 交换分区的类型
+#define SWAP_SLOT_SECTS (PG_SIZE / 512)	 // 每个交换槽的扇区数, 正好放一页
+#define SWAP_MAP_MAX 0xff		 // 交换槽引用数的上限
+
+struct partition* swap_part;
+static uint8_t* swap_map;	 // 每个交换槽的引用数, 即指向它的页表项数, 0表示空闲
+static uint32_t swap_slots;	 // 交换槽总数
+static uint32_t swap_used;	 // 已用的交换槽数
+static uint32_t swap_next;	 // 下次从这个槽开始找空闲槽
+static uint32_t swap_hand;	 // CLOCK 指针, 下一个要检查的页框在 mem_map 中的下标
+static uint32_t swap_ins, swap_outs;
+static struct lock swap_lock;	 // 一次只有一个线程读写交换区
+static void* swap_buf;		 // 读写交换区用的一页内核缓冲
+
+/* 在 partition_list 中选定交换区, 须在 ide_init 之后、filesys_init 之前调用.
+ * 只用分区表中明确标为交换分区(0x82)的分区, 没有就不启用交换,
+ * 以免把用户打算格式化成文件系统的分区挪作他用 */
+void swap_init(void) {
+   put_str("swap_init start\n");
+   lock_init(&swap_lock);
+   swap_buf = get_kernel_pages(1);
+   ASSERT(swap_buf != NULL);
+
+   struct partition* part = NULL;
+   struct list_elem* elem = partition_list.head.next;
+   while (elem != &partition_list.tail) {
+      struct partition* cur = elem2entry(struct partition, part_tag, elem);
+      if (cur->fs_type == SWAP_FS_TYPE) {
+	 part = cur;
+	 break;
+      }
+      elem = elem->next;
+   }
+   if (part == NULL || part->sec_cnt < SWAP_SLOT_SECTS) {
+      put_str("swap_init done, no swap partition\n");
+      return;
+   }
+
+   swap_slots = part->sec_cnt / SWAP_SLOT_SECTS;
+   swap_map = sys_malloc(swap_slots);
+   if (swap_map == NULL) {
+      put_str("swap_init done, no memory for swap map\n");
+      return;
+   }
+   memset(swap_map, 0, swap_slots);
+   swap_part = part;
+   printk("swap on %s, %d pages\n", part->name, swap_slots);
+   put_str("swap_init done\n");
+}
+
+/* 分配一个空闲的交换槽, 返回槽号, 交换区已满返回-1. 须在关中断下调用 */
+static int32_t swap_slot_alloc(void) {
+   if (swap_used == swap_slots) {
+      return -1;
+   }
+   while (swap_map[swap_next] != 0) {
+      swap_next = (swap_next + 1) % swap_slots;
+   }
+   swap_map[swap_next] = 1;
+   swap_used++;
+   return swap_next;
+}
+
+/* 交换槽 slot 少一个引用, 减到0就空闲了. 须在关中断下调用 */
+static void swap_slot_put(uint32_t slot) {
+   ASSERT(slot < swap_slots && swap_map[slot] > 0);
+   if (--swap_map[slot] == 0) {
+      swap_used--;
+   }
+}
+
+/* fork 时子进程复制了换出页的页表项 entry, 交换槽多一个引用 */
+void swap_entry_dup(uint32_t entry) {
+   uint32_t slot = entry >> 12;
+   enum intr_status old_status = intr_disable();
+   ASSERT(slot < swap_slots && swap_map[slot] > 0 && swap_map[slot] < SWAP_MAP_MAX);
+   swap_map[slot]++;
+   intr_set_status(old_status);
+}
+
+/* 不再有页表项指向换出页 entry, 放掉它占的交换槽 */
+void swap_entry_free(uint32_t entry) {
+   enum intr_status old_status = intr_disable();
+   swap_slot_put(entry >> 12);
+   intr_set_status(old_status);
+}
+
+/* pg 是否可以换出: 已分配给用户并且只被一个进程映射 */
+static bool swap_candidate(struct page* pg) {
+   return (pg->flags & (PAGE_USER | PAGE_KSM)) == PAGE_USER && \
+      pg->ref_cnt == 1 && pg->owner != NULL && pg->owner->pgdir != NULL;
+}
+
+/* CLOCK 指针经过页框 pg: 最近访问过的清掉访问位, 否则把内容复制到 swap_buf,
+ * 页表项改为指向交换槽并释放页框. 换出了返回交换槽号, 否则返回-1. 须在关中断下调用 */
+static int32_t swap_out_page(struct page* pg) {
+   if (!swap_candidate(pg)) {
+      return -1;
+   }
+   uint32_t* pte = page_owner_pte(pg);
+   if (pte == NULL) {
+      return -1;
+   }
+   bool running = pg->owner == running_thread();
+   uint32_t vaddr = pg->vaddr;
+   int32_t slot = -1;
+   if (*pte & PG_A) {
+      *pte &= ~PG_A;
+   } else if ((slot = swap_slot_alloc()) >= 0) {
+      uint32_t pg_phy_addr = page_to_phy(pg);
+      void* frame = kmap(pg_phy_addr);
+      memcpy(swap_buf, frame, PG_SIZE);
+      kunmap(frame);
+      *pte = ((uint32_t)slot << 12) | (*pte & 0x00000fff & ~(PG_P_1 | PG_A | PG_D)) | PG_SWAP;
+      pfree(pg_phy_addr);
+   }
+   kunmap((void*)((uint32_t)pte & 0xfffff000));
+   // 别的进程切换回来时会重新加载 cr3, 只有当前进程的 tlb 需要刷新
+   if (running) {
+      asm volatile ("invlpg %0" : : "m" (*(char*)vaddr) : "memory");
+   }
+   return slot;
+}
+
+/* 换出至多 pg_cnt 个用户页, 返回实际释放的页框数.
+ * 每个页框最多经过两次: 第一次清掉访问位, 第二次仍没被访问才换出 */
+uint32_t swap_reclaim(uint32_t pg_cnt) {
+   if (swap_part == NULL) {
+      return 0;
+   }
+   lock_acquire(&swap_lock);
+   uint32_t freed = 0, scanned = 0;
+   while (freed < pg_cnt && scanned < mem_map_cnt * 2 && swap_used < swap_slots) {
+      struct page* pg = &mem_map[swap_hand];
+      swap_hand = (swap_hand + 1) % mem_map_cnt;
+      scanned++;
+
+      enum intr_status old_status = intr_disable();
+      int32_t slot = swap_out_page(pg);
+      intr_set_status(old_status);
+      if (slot >= 0) {
+	 // 页框已经释放了, 内容在 swap_buf 中. 写盘期间要换入的线程都在等 swap_lock
+	 ide_write(swap_part->my_disk, swap_part->start_lba + slot * SWAP_SLOT_SECTS, swap_buf, SWAP_SLOT_SECTS);
+	 swap_outs++;
+	 freed++;
+      }
+   }
+   lock_release(&swap_lock);
+   return freed;
+}
+
+/* 把换出后页表项为 entry 的页读入页框 pg_phy_addr 并让 pte 映射它.
+ * 等待读盘期间 pte 已被别人改动则返回 false, 页框仍归调用者 */
+bool swap_in(uint32_t* pte, uint32_t entry, uint32_t pg_phy_addr) {
+   ASSERT(swap_part != NULL && (entry & PG_SWAP) && !(entry & PG_P_1));
+   lock_acquire(&swap_lock);
+   uint32_t slot = entry >> 12;
+   ide_read(swap_part->my_disk, swap_part->start_lba + slot * SWAP_SLOT_SECTS, swap_buf, SWAP_SLOT_SECTS);
+
+   enum intr_status old_status = intr_disable();
+   bool same = *pte == entry;
+   if (same) {
+      void* frame = kmap(pg_phy_addr);
+      memcpy(frame, swap_buf, PG_SIZE);
+      kunmap(frame);
+      *pte = pg_phy_addr | (entry & 0x00000fff & ~PG_SWAP) | PG_P_1;
+      swap_slot_put(slot);
+      swap_ins++;
+   }
+   intr_set_status(old_status);
+   lock_release(&swap_lock);
+   return same;
+}
+
+/* 填入交换区的统计 */
+void swap_stat_fill(struct mem_stat* stat) {
+   enum intr_status old_status = intr_disable();
+   stat->swap_total = swap_slots;
+   stat->swap_used = swap_used;
+   stat->swap_ins = swap_ins;
+   stat->swap_outs = swap_outs;
+   intr_set_status(old_status);
+}
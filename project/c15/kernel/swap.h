@@ -0,0 +1,30 @@
+#ifndef __KERNEL_SWAP_H
+#define __KERNEL_SWAP_H
+#include "stdint.h"
+#include "global.h"
+
+struct partition;
+struct mem_stat;
+
+extern struct partition* swap_part;	 // 用作交换区的分区, 没有时为 NULL
+
+/* 在 partition_list 中选定交换区, 须在 ide_init 之后、filesys_init 之前调用 */
+void swap_init(void);
+
+/* 换出至多 pg_cnt 个用户页, 返回实际释放的页框数 */
+uint32_t swap_reclaim(uint32_t pg_cnt);
+
+/* 把换出后页表项为 entry 的页读入页框 pg_phy_addr 并让 pte 映射它.
+ * 等待读盘期间 pte 已被别人改动则返回 false, 页框仍归调用者 */
+bool swap_in(uint32_t* pte, uint32_t entry, uint32_t pg_phy_addr);
+
+/* fork 时子进程复制了换出页的页表项 entry, 交换槽多一个引用 */
+void swap_entry_dup(uint32_t entry);
+
+/* 不再有页表项指向换出页 entry, 放掉它占的交换槽 */
+void swap_entry_free(uint32_t entry);
+
+/* 填入交换区的统计 */
+void swap_stat_fill(struct mem_stat* stat);
+
+#endif
@@ -0,0 +1,232 @@
+#include "vma.h"
+#include "memory.h"
+#include "global.h"
+#include "debug.h"
+#include "list.h"
+#include "slab.h"
+#include "../thread/thread.h"
+#include "../userprog/process.h"
+
+/***********************  用户进程的虚拟内存区  ***************************
+ * 用户空间原先用一张覆盖 3G 的位图管理, 每个进程要二十几页内核内存,
+ * fork 时整张复制, 回收时整张扫描. 实际占用的只有进程体、arena、堆和栈几段,
+ * 所以改为按地址排序的虚拟内存区链表, 每段记录起止地址、权限和后备,
+ * 相邻且属性相同的段合并成一段, 一个进程通常只有几个节点.
+ * 链表只由进程自己(以及创建它的 fork/exec)修改, 不需要加锁.
+ ************************************************************************/
+
+uint32_t vma_cnt;
+static struct kmem_cache vm_area_cache;
+
+#define VMA_OF(elem) (elem2entry(struct vm_area, vma_tag, elem))
+
+/* 初始化虚拟内存区的对象缓存 */
+void vma_init(void) {
+   kmem_cache_create(&vm_area_cache, "vm_area", sizeof(struct vm_area), NULL);
+}
+
+/* 分配一个虚拟内存区, 失败返回 NULL */
+static struct vm_area* vma_alloc(uint32_t start, uint32_t end, uint32_t prot, enum vma_backing backing) {
+   struct vm_area* area = kmem_cache_alloc(&vm_area_cache);
+   if (area == NULL) {
+      return NULL;
+   }
+   area->start = start;
+   area->end = end;
+   area->prot = prot;
+   area->backing = backing;
+   MEM_STAT_ADD(vma_cnt, 1);
+   return area;
+}
+
+/* 从链表中摘下并释放 area */
+static void vma_free(struct vm_area* area) {
+   list_remove(&area->vma_tag);
+   kmem_cache_free(&vm_area_cache, area);
+   MEM_STAT_ADD(vma_cnt, -1);
+}
+
+/* 初始化进程 pthread 的用户空间, 只有用户栈可增长的范围 */
+bool vma_space_init(struct task_struct* pthread) {
+   list_init(&pthread->vmas);
+   return vma_add(pthread, 0xc0000000 - USER_STACK_SIZE_MAX, 0xc0000000, \
+	 VMA_READ | VMA_WRITE, VMA_STACK);
+}
+
+/* 找到 pthread 中包含 vaddr 的虚拟内存区, 没有则返回 NULL */
+struct vm_area* vma_find(struct task_struct* pthread, uint32_t vaddr) {
+   struct list_elem* elem = pthread->vmas.head.next;
+   while (elem != &pthread->vmas.tail) {
+      struct vm_area* area = VMA_OF(elem);
+      if (vaddr < area->start) {
+	 break;
+      }
+      if (vaddr < area->end) {
+	 return area;
+      }
+      elem = elem->next;
+   }
+   return NULL;
+}
+
+/* 判断[start, end)是否与 pthread 的任何虚拟内存区都不相交 */
+bool vma_range_free(struct task_struct* pthread, uint32_t start, uint32_t end) {
+   struct list_elem* elem = pthread->vmas.head.next;
+   while (elem != &pthread->vmas.tail) {
+      struct vm_area* area = VMA_OF(elem);
+      if (area->start >= end) {
+	 break;
+      }
+      if (area->end > start) {
+	 return false;
+      }
+      elem = elem->next;
+   }
+   return true;
+}
+
+/* 在 pthread 的用户空间中从低到高找第一段能容纳 pg_cnt 页的空闲虚拟地址,
+ * 只是查找, 由调用者用 vma_add 占住, 失败返回0 */
+uint32_t vma_get_unmapped(struct task_struct* pthread, uint32_t pg_cnt) {
+   uint32_t size = pg_cnt * PG_SIZE;
+   uint32_t vaddr = USER_VADDR_START;
+   struct list_elem* elem = pthread->vmas.head.next;
+   while (elem != &pthread->vmas.tail) {
+      struct vm_area* area = VMA_OF(elem);
+      if (area->end > vaddr) {
+	 if (area->start >= vaddr && area->start - vaddr >= size) {
+	    return vaddr;
+	 }
+	 vaddr = area->end;
+      }
+      elem = elem->next;
+   }
+   if (vaddr >= 0xc0000000 || 0xc0000000 - vaddr < size) {
+      return 0;
+   }
+   return vaddr;
+}
+
+/* 两个虚拟内存区的属性是否相同, 相同且相邻的可以合并 */
+static bool vma_same(struct vm_area* area, uint32_t prot, enum vma_backing backing) {
+   return area->prot == prot && area->backing == backing;
+}
+
+/* 在 next 之前插入[start, end), 能与前后相邻的段合并就不分配新节点.
+ * 返回结束地址不小于 end 的那个段在链表中的节点, 失败返回 NULL */
+static struct list_elem* vma_insert(struct task_struct* pthread, struct list_elem* next, \
+      uint32_t start, uint32_t end, uint32_t prot, enum vma_backing backing) {
+   struct list* vmas = &pthread->vmas;
+   struct vm_area* next_area = next != &vmas->tail ? VMA_OF(next) : NULL;
+   bool merge_next = next_area != NULL && next_area->start == end && vma_same(next_area, prot, backing);
+   if (next->prev != &vmas->head) {
+      struct vm_area* prev_area = VMA_OF(next->prev);
+      if (prev_area->end == start && vma_same(prev_area, prot, backing)) {
+	 if (merge_next) {	 // 新段正好填上了前后两段之间的空隙
+	    prev_area->end = next_area->end;
+	    vma_free(next_area);
+	 } else {
+	    prev_area->end = end;
+	 }
+	 return &prev_area->vma_tag;
+      }
+   }
+   if (merge_next) {
+      next_area->start = start;
+      return next;
+   }
+   struct vm_area* area = vma_alloc(start, end, prot, backing);
+   if (area == NULL) {
+      return NULL;
+   }
+   list_insert_before(next, &area->vma_tag);
+   return &area->vma_tag;
+}
+
+/* 把[start, end)中还没有被占用的部分加入 pthread 的虚拟内存区,
+ * 已被占用的部分保持原样(如两个段共用的那一页), 失败返回 false */
+bool vma_add(struct task_struct* pthread, uint32_t start, uint32_t end, uint32_t prot, enum vma_backing backing) {
+   ASSERT(start % PG_SIZE == 0 && end % PG_SIZE == 0 && start < end && end <= 0xc0000000);
+   struct list* vmas = &pthread->vmas;
+   struct list_elem* elem = vmas->head.next;
+   uint32_t vaddr = start;
+   while (vaddr < end) {
+      // 跳过在vaddr之前结束的段
+      while (elem != &vmas->tail && VMA_OF(elem)->end <= vaddr) {
+	 elem = elem->next;
+      }
+      uint32_t gap_end = end;
+      if (elem != &vmas->tail) {
+	 struct vm_area* area = VMA_OF(elem);
+	 if (area->start <= vaddr) {	 // vaddr已被占用, 跳过这一段
+	    vaddr = area->end;
+	    continue;
+	 }
+	 if (area->start < gap_end) {
+	    gap_end = area->start;
+	 }
+      }
+      elem = vma_insert(pthread, elem, vaddr, gap_end, prot, backing);
+      if (elem == NULL) {
+	 return false;
+      }
+      vaddr = gap_end;
+   }
+   return true;
+}
+
+/* 从 pthread 的虚拟内存区中去掉[start, end), 必要时把一段切成两段.
+ * 切分时分配不到节点就返回 false, 此时这段虚拟地址仍然占着 */
+bool vma_remove(struct task_struct* pthread, uint32_t start, uint32_t end) {
+   struct list_elem* elem = pthread->vmas.head.next;
+   while (elem != &pthread->vmas.tail) {
+      struct vm_area* area = VMA_OF(elem);
+      struct list_elem* next = elem->next;
+      if (area->start >= end) {
+	 break;
+      }
+      if (area->end > start) {
+	 if (area->start < start && area->end > end) {	 // 从中间挖掉, 切成两段
+	    struct vm_area* tail = vma_alloc(end, area->end, area->prot, area->backing);
+	    if (tail == NULL) {
+	       return false;
+	    }
+	    area->end = start;
+	    list_insert_before(next, &tail->vma_tag);
+	    break;
+	 } else if (area->start < start) {
+	    area->end = start;
+	 } else if (area->end > end) {
+	    area->start = end;
+	 } else {
+	    vma_free(area);
+	 }
+      }
+      elem = next;
+   }
+   return true;
+}
+
+/* 子进程 child 复制父进程 parent 的虚拟内存区, 失败时已复制的部分会释放 */
+bool vma_copy(struct task_struct* child, struct task_struct* parent) {
+   list_init(&child->vmas);
+   struct list_elem* elem = parent->vmas.head.next;
+   while (elem != &parent->vmas.tail) {
+      struct vm_area* area = VMA_OF(elem);
+      struct vm_area* copy = vma_alloc(area->start, area->end, area->prot, area->backing);
+      if (copy == NULL) {
+	 vma_release(child);
+	 return false;
+      }
+      list_append(&child->vmas, &copy->vma_tag);
+      elem = elem->next;
+   }
+   return true;
+}
+
+/* 释放 pthread 的所有虚拟内存区 */
+void vma_release(struct task_struct* pthread) {
+   while (!list_empty(&pthread->vmas)) {
+      vma_free(VMA_OF(pthread->vmas.head.next));
+   }
+}
@@ -0,0 +1,59 @@
+#ifndef __KERNEL_VMA_H
+#define __KERNEL_VMA_H
+#include "stdint.h"
+#include "global.h"
+#include "list.h"
+
+struct task_struct;
+
+/* 虚拟内存区的访问权限 */
+#define VMA_READ  1
+#define VMA_WRITE 2
+
+/* 虚拟内存区的后备, 即首次访问时页框的内容从哪里来 */
+enum vma_backing {
+   VMA_ANON,	 // 匿名内存, 如用户进程 sys_malloc 的 arena, 清0的页框
+   VMA_IMAGE,	 // 进程体, 文件映射区中的部分从映像文件读入, 其余清0
+   VMA_HEAP,	 // brk 堆, 清0的页框
+   VMA_STACK	 // 用户栈, 清0的页框
+};
+
+/* 进程用户空间中一段连续的虚拟地址[start, end), 起止都按页对齐 */
+struct vm_area {
+   uint32_t start;
+   uint32_t end;
+   uint32_t prot;		 // VMA_READ | VMA_WRITE
+   enum vma_backing backing;
+   struct list_elem vma_tag;	 // 用于加入进程的 vmas 链表, 链表按地址升序排列
+};
+
+extern uint32_t vma_cnt;	 // 所有进程的虚拟内存区总数
+
+/* 初始化虚拟内存区的对象缓存 */
+void vma_init(void);
+
+/* 初始化进程 pthread 的用户空间, 只有用户栈可增长的范围 */
+bool vma_space_init(struct task_struct* pthread);
+
+/* 找到 pthread 中包含 vaddr 的虚拟内存区, 没有则返回 NULL */
+struct vm_area* vma_find(struct task_struct* pthread, uint32_t vaddr);
+
+/* 判断[start, end)是否与 pthread 的任何虚拟内存区都不相交 */
+bool vma_range_free(struct task_struct* pthread, uint32_t start, uint32_t end);
+
+/* 在 pthread 的用户空间中找 pg_cnt 页的空闲虚拟地址, 失败返回0 */
+uint32_t vma_get_unmapped(struct task_struct* pthread, uint32_t pg_cnt);
+
+/* 把[start, end)中还没有被占用的部分加入 pthread 的虚拟内存区 */
+bool vma_add(struct task_struct* pthread, uint32_t start, uint32_t end, uint32_t prot, enum vma_backing backing);
+
+/* 从 pthread 的虚拟内存区中去掉[start, end) */
+bool vma_remove(struct task_struct* pthread, uint32_t start, uint32_t end);
+
+/* 子进程 child 复制父进程 parent 的虚拟内存区 */
+bool vma_copy(struct task_struct* child, struct task_struct* parent);
+
+/* 释放 pthread 的所有虚拟内存区 */
+void vma_release(struct task_struct* pthread);
+
+#endif
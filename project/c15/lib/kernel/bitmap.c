@@ -5,9 +5,189 @@
 #include "interrupt.h"
 #include "debug.h"
 
+/************************  二级位图  ******************************
+ * 位图按32位字为单位扫描, 另外用 summary 作为摘要位图:
+ * 一个摘要位管理 2^group_shift 个连续的字, 该组中只要还有一个0位, 摘要位就为1。
+ * 找空闲位时先用 bsf 在摘要中跳过已满的组, 再用 bsf 在字内定位;
+ * 找连续 cnt 个空闲位时, 若候选区间中有1位, 用 bsr 找到其中最后一个1位,
+ * 直接从它后面继续找, 所以整体上也是一次一个字。
+ * 每个位图还记录上次分配结束的位置(next_fit), 下次从这里开始找, 找到末尾再回绕。
+ ******************************************************************/
+
+/* 返回 word 中最低的1位的下标, word 不能为0 */
+static inline uint32_t bit_first(uint32_t word) {
+    uint32_t idx;
+    asm ("bsf %1, %0" : "=r"(idx) : "rm"(word));
+    return idx;
+}
+
+/* 返回 word 中最高的1位的下标, word 不能为0 */
+static inline uint32_t bit_last(uint32_t word) {
+    uint32_t idx;
+    asm ("bsr %1, %0" : "=r"(idx) : "rm"(word));
+    return idx;
+}
+
+/* 位图占用的32位字数, 最后一个字可能不完整 */
+static uint32_t bitmap_word_cnt(struct bitmap* btmp) {
+    return DIV_ROUND_UP(btmp->btmp_bytes_len, 4);
+}
+
+/* 读出位图的第 word_idx 个字, 最后一个字中超出位图的字节按全1处理, 免得被当成空闲位 */
+static uint32_t bitmap_load_word(struct bitmap* btmp, uint32_t word_idx) {
+    uint32_t byte_off = word_idx * 4;
+    if (byte_off + 4 <= btmp->btmp_bytes_len) {
+        return *(uint32_t*)(btmp->bits + byte_off);
+    }
+    uint32_t word = 0xffffffff;
+    uint32_t byte_idx = 0;
+    while (byte_off + byte_idx < btmp->btmp_bytes_len) {
+        word &= ~((uint32_t)0xff << (byte_idx * 8));
+        word |= (uint32_t)btmp->bits[byte_off + byte_idx] << (byte_idx * 8);
+        byte_idx++;
+    }
+    return word;
+}
+
+/* 判断第 group 组的字中是否还有0位 */
+static bool bitmap_group_has_free(struct bitmap* btmp, uint32_t group) {
+    uint32_t word_idx = group << btmp->group_shift;
+    uint32_t word_end = word_idx + (1 << btmp->group_shift);
+    uint32_t word_cnt = bitmap_word_cnt(btmp);
+    if (word_end > word_cnt) {
+        word_end = word_cnt;
+    }
+    while (word_idx < word_end) {
+        if (bitmap_load_word(btmp, word_idx) != 0xffffffff) {
+            return true;
+        }
+        word_idx++;
+    }
+    return false;
+}
+
+/* 位图内容被直接改写(如从硬盘读入或整体复制)后, 重建二级摘要 */
+void bitmap_summary_rebuild(struct bitmap* btmp) {
+    uint32_t word_cnt = bitmap_word_cnt(btmp);
+    /* 让所有的组都能落在摘要位图中 */
+    btmp->group_shift = 0;
+    while (((word_cnt + (1 << btmp->group_shift) - 1) >> btmp->group_shift) > BITMAP_SUMMARY_WORDS * 32) {
+        btmp->group_shift++;
+    }
+    memset(btmp->summary, 0, sizeof(btmp->summary));
+    uint32_t group_cnt = (word_cnt + (1 << btmp->group_shift) - 1) >> btmp->group_shift;
+    uint32_t group = 0;
+    while (group < group_cnt) {
+        if (bitmap_group_has_free(btmp, group)) {
+            btmp->summary[group / 32] |= BITMAP_MASK << (group % 32);
+        }
+        group++;
+    }
+    if (btmp->next_fit >= btmp->btmp_bytes_len * 8) {
+        btmp->next_fit = 0;
+    }
+    btmp->summary_bits = btmp->bits;
+    btmp->summary_len = btmp->btmp_bytes_len;
+}
+
+/* 使用者只设置了 bits 和 btmp_bytes_len 而没有调用 bitmap_init 时, 摘要是无效的, 这里补建 */
+static void bitmap_summary_check(struct bitmap* btmp) {
+    if (btmp->summary_bits != btmp->bits || btmp->summary_len != btmp->btmp_bytes_len) {
+        btmp->next_fit = 0;
+        bitmap_summary_rebuild(btmp);
+    }
+}
+
+/* 从第 group 组起在摘要中找第一个还有空闲位的组, 找不到返回 -1 */
+static int bitmap_next_group(struct bitmap* btmp, uint32_t group) {
+    if (group >= BITMAP_SUMMARY_WORDS * 32) {
+        return -1;
+    }
+    uint32_t sum_idx = group / 32;
+    uint32_t word = btmp->summary[sum_idx] & (0xffffffff << (group % 32));
+    while (word == 0) {
+        if (++sum_idx == BITMAP_SUMMARY_WORDS) {
+            return -1;
+        }
+        word = btmp->summary[sum_idx];
+    }
+    return sum_idx * 32 + bit_first(word);
+}
+
+/* 在 [bit_idx, bit_end) 中找第一个0位, 找不到返回 -1 */
+static int bitmap_next_zero(struct bitmap* btmp, uint32_t bit_idx, uint32_t bit_end) {
+    uint32_t word_idx = bit_idx / 32;
+    uint32_t low_mask = (BITMAP_MASK << (bit_idx % 32)) - 1;     // 起始字中 bit_idx 之前的位不算
+    while (word_idx * 32 < bit_end) {
+        uint32_t group = word_idx >> btmp->group_shift;
+        if (!(btmp->summary[group / 32] & (BITMAP_MASK << (group % 32)))) {
+            /* 整组已满, 直接跳到下一个有空闲位的组 */
+            int next_group = bitmap_next_group(btmp, group + 1);
+            if (next_group == -1) {
+                return -1;
+            }
+            word_idx = next_group << btmp->group_shift;
+            low_mask = 0;
+            continue;
+        }
+        uint32_t word = bitmap_load_word(btmp, word_idx) | low_mask;
+        if (word != 0xffffffff) {
+            uint32_t zero_idx = word_idx * 32 + bit_first(~word);
+            if (zero_idx >= bit_end) {
+                return -1;
+            }
+            return zero_idx;
+        }
+        low_mask = 0;
+        word_idx++;
+    }
+    return -1;
+}
+
+/* 在 [bit_start, bit_end) 中找最后一个1位, 找不到返回 -1 */
+static int bitmap_last_one(struct bitmap* btmp, uint32_t bit_start, uint32_t bit_end) {
+    uint32_t word_first = bit_start / 32;
+    uint32_t word_idx = (bit_end - 1) / 32;
+    uint32_t high_mask = bit_end % 32 ? ((uint32_t)BITMAP_MASK << (bit_end % 32)) - 1 : 0xffffffff;
+    while (true) {
+        uint32_t word = bitmap_load_word(btmp, word_idx) & high_mask;
+        if (word_idx == word_first) {
+            word &= ~((BITMAP_MASK << (bit_start % 32)) - 1);
+        }
+        if (word != 0) {
+            return word_idx * 32 + bit_last(word);
+        }
+        if (word_idx == word_first) {
+            return -1;
+        }
+        high_mask = 0xffffffff;
+        word_idx--;
+    }
+}
+
+/* 在 [bit_start, bit_end) 中找连续 cnt 个0位, 成功返回起始位下标, 失败返回 -1 */
+static int bitmap_find_run(struct bitmap* btmp, uint32_t bit_start, uint32_t bit_end, uint32_t cnt) {
+    uint32_t bit_idx = bit_start;
+    while (bit_idx + cnt <= bit_end) {
+        int zero_idx = bitmap_next_zero(btmp, bit_idx, bit_end);
+        if (zero_idx == -1 || zero_idx + cnt > bit_end) {
+            return -1;
+        }
+        /* 候选区间中最后一个1位之前都不可能再放下 cnt 个连续0位 */
+        int one_idx = bitmap_last_one(btmp, zero_idx, zero_idx + cnt);
+        if (one_idx == -1) {
+            return zero_idx;
+        }
+        bit_idx = one_idx + 1;
+    }
+    return -1;
+}
+
 /* 将位图btmp初始化 */
 void bitmap_init(struct bitmap* btmp) {
     memset(btmp->bits, 0, btmp->btmp_bytes_len);
+    btmp->next_fit = 0;
+    bitmap_summary_rebuild(btmp);
 }
 
 
@@ -21,50 +201,22 @@ bool bitmap_scan_test(struct bitmap* btmp, uint32_t bit_idx) {
 
 /* 在位图中申清连续 cnt 个位, 成功, 则返回其起始位下标, 失败, 返回 -1 */
 int bitmap_scan(struct bitmap* btmp, uint32_t cnt) {
-    uint32_t idx_byte = 0;  // 用于记录空闲位所在的字节
-    /* 先逐字节比较，蛮力法 */
-    // 一位16进制代表4位二进制, 所以 0xff 代表一字节且该字节全为 1
-    while ((0xff == btmp->bits[idx_byte]) && (idx_byte < btmp->btmp_bytes_len)) {
-        idx_byte++;
-    }
-
-    /* 如果找不到可用空间就返回 -1 */
-    ASSERT(idx_byte < btmp->btmp_bytes_len);
-    if (idx_byte == btmp->btmp_bytes_len) {
+    bitmap_summary_check(btmp);
+    uint32_t bit_cnt = btmp->btmp_bytes_len * 8;
+    if (cnt == 0 || cnt > bit_cnt) {
         return -1;
     }
 
-    /* 若在位图数组范围内的某字节内找到了空闲位, 在该字节内逐位比对, 返回空闲位的索引。*/
-    int idx_bit = 0;
-    while ((uint8_t) (BITMAP_MASK << idx_bit) & btmp->bits[idx_byte]) {
-        idx_bit++;
+    /* 先从上次分配结束的位置找到末尾, 找不到再从头找, 回绕部分只需覆盖到能跨过 next_fit 的位置 */
+    uint32_t start = btmp->next_fit < bit_cnt ? btmp->next_fit : 0;
+    int bit_idx_start = bitmap_find_run(btmp, start, bit_cnt, cnt);
+    if (bit_idx_start == -1 && start > 0) {
+        uint32_t end = start + cnt - 1 < bit_cnt ? start + cnt - 1 : bit_cnt;
+        bit_idx_start = bitmap_find_run(btmp, 0, end, cnt);
     }
 
-    int bit_idx_start = idx_byte * 8 + idx_bit; // 空闲位在位图中的下标
-    if (cnt == 1) {
-        return bit_idx_start;
-    }
-
-    uint32_t bit_left = (btmp->btmp_bytes_len * 8 - bit_idx_start); // 记录还有多少位可以判断
-    uint32_t next_bit = bit_idx_start + 1;
-    uint32_t count = 1;                                             // 记录找到空闲位的个数
-
-    bit_idx_start = -1;                                             // 先将其置为-1, 若找不到连续的位就返回-1
-    while ((bit_left--) > 0) {
-        if (!bitmap_scan_test(btmp, next_bit)) {
-            // 若 next_bit为 0
-            count++;
-        } else {
-            // 空间不连续, 重置连续空间数为0, 继续寻找连续空间
-            count = 0;
-        }
-
-        // 若找到连续的 cnt 个空位
-        if (count == cnt) {
-            bit_idx_start = next_bit - cnt + 1;
-            break;
-        }
-        next_bit++;
+    if (bit_idx_start != -1) {
+        btmp->next_fit = bit_idx_start + cnt;
     }
     return bit_idx_start;
 }
@@ -73,16 +225,23 @@ int bitmap_scan(struct bitmap* btmp, uint32_t cnt) {
 /* 将位图 btmp 的 bit_idx 位设置为 value */
 void bitmap_set(struct bitmap* btmp, uint32_t bit_idx, int8_t value) {
     ASSERT((value == 0) || (value == 1));
+    bitmap_summary_check(btmp);
     uint32_t byte_idx = bit_idx / 8;    // 向下取整用于索引数组下标
     uint32_t bit_odd = bit_idx % 8;     // 取余用于索引数组内的位
+    uint32_t group = (bit_idx / 32) >> btmp->group_shift;
 
     if (value) {
         // 如果 vaule 为 1, 按位或
         btmp->bits[byte_idx] |= (BITMAP_MASK << bit_odd);
+        // 所在的字满了才可能使整组变满
+        if (bitmap_load_word(btmp, bit_idx / 32) == 0xffffffff && !bitmap_group_has_free(btmp, group)) {
+            btmp->summary[group / 32] &= ~(BITMAP_MASK << (group % 32));
+        }
     } else {
         // 如果 vaule 为 0, 取反再按位与
         // 取反: 将除所要操作的位置 0, 其余位全部置 1
         // 按位与: 1 & 1 = 1, 0 & 1 = 0, 即其余位不受影响, 目标位置 0
         btmp->bits[byte_idx] &= ~(BITMAP_MASK << bit_odd);
+        btmp->summary[group / 32] |= BITMAP_MASK << (group % 32);
     }
 }
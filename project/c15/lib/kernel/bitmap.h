@@ -4,16 +4,29 @@
 #include "global.h"
 #define BITMAP_MASK 1
 
+/* 二级位图中摘要位图的长度(以32位字为单位),共 16 * 32 = 512 个摘要位 */
+#define BITMAP_SUMMARY_WORDS 16
+
 struct bitmap {
     uint32_t btmp_bytes_len;
     /* 在遍历位图时, 整体上以字节为单位, 细节上是以位为单位, 所以此处位图的指针必须是单字节 */
     // 使用位图数组需要知道其长度, 但是长度得以后才能知道, 所以这里可以用指定地址来代替使用数组
     uint8_t* bits;
+
+    /* 以下为二级位图的信息, 由 bitmap.c 自己维护, 使用者只需设置上面两项 */
+    uint32_t next_fit;                          // 下次扫描的起始位下标
+    uint8_t* summary_bits;                      // 建立摘要时的 bits, 与 bits 不同说明摘要需要重建
+    uint32_t summary_len;                       // 建立摘要时的 btmp_bytes_len
+    uint32_t group_shift;                       // 一个摘要位管理 2^group_shift 个32位字
+    uint32_t summary[BITMAP_SUMMARY_WORDS];     // 摘要位为 1 表示该组字中还有空闲位
 };
 
 /* 将位图btmp初始化 */
 void bitmap_init(struct bitmap* btmp);
 
+/* 位图内容被直接改写(如从硬盘读入或整体复制)后, 重建二级摘要 */
+void bitmap_summary_rebuild(struct bitmap* btmp);
+
 /* 判断 bit_idx 位是否为 1 ,若为 1, 则返回true, 否则返回false */ 
 bool bitmap_scan_test(struct bitmap* btmp, uint32_t bit_idx);
 
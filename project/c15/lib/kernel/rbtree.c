@@ -0,0 +1,235 @@
+#include "rbtree.h"
+#include "global.h"
+
+/* 初始化为空树 */
+void rb_root_init(struct rb_root* root) {
+    root->node = NULL;
+}
+
+/* 把 parent 指向 old 的孩子指针改为指向 new, parent 为 NULL 时 old 是树根 */
+static void rb_replace_child(struct rb_root* root, struct rb_node* parent, struct rb_node* old, struct rb_node* new) {
+    if (parent == NULL) {
+        root->node = new;
+    } else if (parent->left == old) {
+        parent->left = new;
+    } else {
+        parent->right = new;
+    }
+}
+
+/* 以 node 为支点左旋, node 的右孩子顶替 node 的位置 */
+static void rb_rotate_left(struct rb_node* node, struct rb_root* root) {
+    struct rb_node* right = node->right;
+    node->right = right->left;
+    if (right->left != NULL) {
+        right->left->parent = node;
+    }
+    right->parent = node->parent;
+    rb_replace_child(root, node->parent, node, right);
+    right->left = node;
+    node->parent = right;
+}
+
+/* 以 node 为支点右旋, node 的左孩子顶替 node 的位置 */
+static void rb_rotate_right(struct rb_node* node, struct rb_root* root) {
+    struct rb_node* left = node->left;
+    node->left = left->right;
+    if (left->right != NULL) {
+        left->right->parent = node;
+    }
+    left->parent = node->parent;
+    rb_replace_child(root, node->parent, node, left);
+    left->right = node;
+    node->parent = left;
+}
+
+/* 结点为 NULL 的叶子算黑色 */
+static bool rb_is_black(struct rb_node* node) {
+    return node == NULL || node->color == RB_BLACK;
+}
+
+/* 把 node 挂到 parent 的 *link 位置上, 新结点是红色的叶子 */
+void rb_link_node(struct rb_node* node, struct rb_node* parent, struct rb_node** link) {
+    node->parent = parent;
+    node->left = node->right = NULL;
+    node->color = RB_RED;
+    *link = node;
+}
+
+/* 新插入红色结点 node 后, 消除红色结点相邻的情况 */
+void rb_insert_color(struct rb_node* node, struct rb_root* root) {
+    struct rb_node* parent;
+    // 父结点是红色的就一定不是根, 祖父结点一定存在
+    while ((parent = node->parent) != NULL && parent->color == RB_RED) {
+        struct rb_node* gparent = parent->parent;
+        if (parent == gparent->left) {
+            struct rb_node* uncle = gparent->right;
+            if (!rb_is_black(uncle)) {
+                // 叔结点也是红色: 父、叔变黑, 祖父变红, 问题上移到祖父
+                parent->color = uncle->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->right) {
+                rb_rotate_left(parent, root);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rb_rotate_right(gparent, root);
+        } else {
+            struct rb_node* uncle = gparent->left;
+            if (!rb_is_black(uncle)) {
+                parent->color = uncle->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->left) {
+                rb_rotate_right(parent, root);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rb_rotate_left(gparent, root);
+        }
+    }
+    root->node->color = RB_BLACK;
+}
+
+/* 删掉一个黑色结点后, node(可能为 NULL, 其父结点为 parent)所在的一侧少了一个黑色结点, 补回来 */
+static void rb_erase_fixup(struct rb_node* node, struct rb_node* parent, struct rb_root* root) {
+    while (node != root->node && rb_is_black(node)) {
+        if (node == parent->left) {
+            struct rb_node* sibling = parent->right;
+            if (sibling->color == RB_RED) {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rb_rotate_left(parent, root);
+                sibling = parent->right;
+            }
+            if (rb_is_black(sibling->left) && rb_is_black(sibling->right)) {
+                // 兄弟一侧也减掉一个黑色结点, 问题上移到父结点
+                sibling->color = RB_RED;
+                node = parent;
+                parent = node->parent;
+            } else {
+                if (rb_is_black(sibling->right)) {
+                    sibling->left->color = RB_BLACK;
+                    sibling->color = RB_RED;
+                    rb_rotate_right(sibling, root);
+                    sibling = parent->right;
+                }
+                sibling->color = parent->color;
+                parent->color = RB_BLACK;
+                sibling->right->color = RB_BLACK;
+                rb_rotate_left(parent, root);
+                node = root->node;
+            }
+        } else {
+            struct rb_node* sibling = parent->left;
+            if (sibling->color == RB_RED) {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rb_rotate_right(parent, root);
+                sibling = parent->left;
+            }
+            if (rb_is_black(sibling->left) && rb_is_black(sibling->right)) {
+                sibling->color = RB_RED;
+                node = parent;
+                parent = node->parent;
+            } else {
+                if (rb_is_black(sibling->left)) {
+                    sibling->right->color = RB_BLACK;
+                    sibling->color = RB_RED;
+                    rb_rotate_left(sibling, root);
+                    sibling = parent->left;
+                }
+                sibling->color = parent->color;
+                parent->color = RB_BLACK;
+                sibling->left->color = RB_BLACK;
+                rb_rotate_right(parent, root);
+                node = root->node;
+            }
+        }
+    }
+    if (node != NULL) {
+        node->color = RB_BLACK;
+    }
+}
+
+/* 从树中删除 node */
+void rb_erase(struct rb_node* node, struct rb_root* root) {
+    struct rb_node* child;
+    struct rb_node* parent;
+    uint32_t color;
+
+    if (node->left != NULL && node->right != NULL) {
+        // 有两个孩子: 用右子树中最小的后继结点 succ 顶替 node, 实际摘掉的是 succ 原来的位置
+        struct rb_node* succ = node->right;
+        while (succ->left != NULL) {
+            succ = succ->left;
+        }
+        child = succ->right;
+        parent = succ->parent;
+        color = succ->color;
+        if (parent == node) {
+            parent = succ;
+        } else {
+            if (child != NULL) {
+                child->parent = parent;
+            }
+            parent->left = child;
+            succ->right = node->right;
+            node->right->parent = succ;
+        }
+        succ->parent = node->parent;
+        succ->color = node->color;
+        succ->left = node->left;
+        node->left->parent = succ;
+        rb_replace_child(root, node->parent, node, succ);
+    } else {
+        child = node->left != NULL ? node->left : node->right;
+        parent = node->parent;
+        color = node->color;
+        if (child != NULL) {
+            child->parent = parent;
+        }
+        rb_replace_child(root, parent, node, child);
+    }
+
+    if (color == RB_BLACK) {
+        rb_erase_fixup(child, parent, root);
+    }
+}
+
+/* 树中最左(最小)的结点, 空树返回 NULL */
+struct rb_node* rb_first(struct rb_root* root) {
+    struct rb_node* node = root->node;
+    if (node == NULL) {
+        return NULL;
+    }
+    while (node->left != NULL) {
+        node = node->left;
+    }
+    return node;
+}
+
+/* 中序遍历中 node 的下一个结点, 没有返回 NULL */
+struct rb_node* rb_next(struct rb_node* node) {
+    if (node->right != NULL) {
+        node = node->right;
+        while (node->left != NULL) {
+            node = node->left;
+        }
+        return node;
+    }
+    // 沿父结点向上, 直到从左子树上来
+    while (node->parent != NULL && node == node->parent->right) {
+        node = node->parent;
+    }
+    return node->parent;
+}
@@ -0,0 +1,44 @@
+#ifndef __LIB_KERNEL_RBTREE_H
+#define __LIB_KERNEL_RBTREE_H
+
+#include "global.h"
+#include "list.h"
+
+/**********   红黑树结点   ***********
+* 和链表一样嵌在宿主结构体中, 由 rb_entry 取得宿主结构体.
+* 树只负责平衡, 比较键值由使用者在插入时自己沿树查找 */
+struct rb_node {
+    struct rb_node* parent;
+    struct rb_node* left;
+    struct rb_node* right;
+    uint32_t color;             // RB_RED 或 RB_BLACK
+};
+
+/* 红黑树, 空树时 node 为 NULL */
+struct rb_root {
+    struct rb_node* node;
+};
+
+#define RB_RED   0
+#define RB_BLACK 1
+
+#define rb_entry(node_ptr, struct_type, struct_mem_name) \
+                  (elem2entry(struct_type, struct_mem_name, node_ptr))
+
+
+void rb_root_init(struct rb_root* root);
+
+/* 把 node 挂到 parent 的 *link 位置上, 再调用 rb_insert_color 恢复平衡 */
+void rb_link_node(struct rb_node* node, struct rb_node* parent, struct rb_node** link);
+
+void rb_insert_color(struct rb_node* node, struct rb_root* root);
+
+void rb_erase(struct rb_node* node, struct rb_root* root);
+
+/* 树中最左(最小)的结点, 空树返回 NULL */
+struct rb_node* rb_first(struct rb_root* root);
+
+/* 中序遍历中 node 的下一个结点, 没有返回 NULL */
+struct rb_node* rb_next(struct rb_node* node);
+
+#endif
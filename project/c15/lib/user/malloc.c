@@ -0,0 +1,190 @@
+#include "syscall.h"
+#include "assert.h"
+#include "stdint.h"
+
+/*************************  用户态内存分配器  ****************************
+ * malloc/free 原先每次都要 int 0x80 进入内核的 sys_malloc/sys_free,
+ * 还要抢整个用户内存池的锁. 这里在用户态自己管理 brk 堆:
+ * 小于等于 1024 字节的请求按 16~1024 共 7 种规格分配, 每种规格有自己的空闲链表,
+ * 链表空了才向 brk 堆要一页(arena)切成同规格的块, 所以绝大多数分配和释放不陷入内核.
+ * 更大的请求直接分配整页, 释放的页串在按地址排序的空闲页链表中,
+ * 相邻的合并, 位于堆顶的则用 sbrk 还给内核.
+ * 用户进程只有一个线程, 这里不需要加锁.
+ **************************************************************************/
+
+#define U_PG_SIZE 4096
+#define U_CLASS_CNT 7		 // 16, 32, 64, 128, 256, 512, 1024 共7种规格
+#define U_CLASS_MAX 1024
+
+/* 空闲的内存块, 串在所属规格的空闲链表中 */
+struct u_block {
+   struct u_block* next;
+};
+
+/* 内存块规格 */
+struct u_class {
+   uint32_t block_size;		 // 内存块大小
+   uint32_t blocks_per_arena;	 // 一页 arena 可容纳的内存块数
+   struct u_block* free_list;	 // 本规格的空闲内存块
+};
+
+/* 每页(或每次大块分配的首页)开头的元信息, 大小为16字节, 使块按16字节对齐 */
+struct u_arena {
+   struct u_class* cls;		 // large 为 false 时, 所属的内存块规格
+   uint32_t pg_cnt;		 // large 为 true 时, 占用的页数
+   uint32_t large;		 // 是否为大块分配
+   uint32_t reserved;
+};
+
+/* 一段空闲的连续页 */
+struct u_page_run {
+   struct u_page_run* next;
+   uint32_t pg_cnt;
+};
+
+static struct u_class u_classes[U_CLASS_CNT];
+static struct u_page_run* free_runs;	 // 按地址升序排列的空闲页
+static bool malloc_ready;
+
+/* 初始化各内存块规格 */
+static void u_malloc_init(void) {
+   uint32_t class_idx = 0, block_size = 16;
+   while (class_idx < U_CLASS_CNT) {
+      u_classes[class_idx].block_size = block_size;
+      u_classes[class_idx].blocks_per_arena = (U_PG_SIZE - sizeof(struct u_arena)) / block_size;
+      u_classes[class_idx].free_list = NULL;
+      block_size *= 2;
+      class_idx++;
+   }
+   free_runs = NULL;
+   malloc_ready = true;
+}
+
+/* 分配pg_cnt个连续的页, 先在空闲页中找, 找不到再扩大brk堆, 失败返回NULL */
+static void* page_alloc(uint32_t pg_cnt) {
+   struct u_page_run** link = &free_runs;
+   while (*link != NULL) {
+      struct u_page_run* run = *link;
+      if (run->pg_cnt >= pg_cnt) {
+	 if (run->pg_cnt == pg_cnt) {
+	    *link = run->next;
+	    return run;
+	 }
+	 // 从尾部切下来, 剩下的部分仍留在原位
+	 run->pg_cnt -= pg_cnt;
+	 return (void*)((uint32_t)run + run->pg_cnt * U_PG_SIZE);
+      }
+      link = &run->next;
+   }
+   void* pages = sbrk(pg_cnt * U_PG_SIZE);
+   if (pages == (void*)-1) {
+      return NULL;
+   }
+   // brk堆从页边界开始并且每次都按整页增长, 所以新的页一定是页对齐的
+   assert(((uint32_t)pages & (U_PG_SIZE - 1)) == 0);
+   return pages;
+}
+
+/* 归还从pages开始的pg_cnt个页 */
+static void page_free(void* pages, uint32_t pg_cnt) {
+   uint32_t start = (uint32_t)pages;
+   struct u_page_run* prev = NULL;
+   struct u_page_run* next = free_runs;
+   while (next != NULL && (uint32_t)next < start) {
+      prev = next;
+      next = next->next;
+   }
+
+   /* 与后一段相邻则吞并它 */
+   struct u_page_run* run = (struct u_page_run*)pages;
+   run->pg_cnt = pg_cnt;
+   run->next = next;
+   if (next != NULL && start + pg_cnt * U_PG_SIZE == (uint32_t)next) {
+      run->pg_cnt += next->pg_cnt;
+      run->next = next->next;
+   }
+   /* 与前一段相邻则并入前一段 */
+   if (prev != NULL && (uint32_t)prev + prev->pg_cnt * U_PG_SIZE == start) {
+      prev->pg_cnt += run->pg_cnt;
+      prev->next = run->next;
+      run = prev;
+   } else if (prev != NULL) {
+      prev->next = run;
+   } else {
+      free_runs = run;
+   }
+
+   /* 堆顶的空闲页还给内核 */
+   if (run->next == NULL && (uint32_t)run + run->pg_cnt * U_PG_SIZE == (uint32_t)sbrk(0)) {
+      struct u_page_run** link = &free_runs;
+      while (*link != run) {
+	 link = &(*link)->next;
+      }
+      *link = NULL;
+      sbrk(-(int32_t)(run->pg_cnt * U_PG_SIZE));
+   }
+}
+
+/* 在用户态的brk堆中申请size字节内存, 失败返回NULL */
+void* malloc(uint32_t size) {
+   if (!malloc_ready) {
+      u_malloc_init();
+   }
+   if (size == 0) {
+      return NULL;
+   }
+
+   /* 超过1024字节就分配整页 */
+   if (size > U_CLASS_MAX) {
+      uint32_t pg_cnt = DIV_ROUND_UP(size + sizeof(struct u_arena), U_PG_SIZE);
+      struct u_arena* a = page_alloc(pg_cnt);
+      if (a == NULL) {
+	 return NULL;
+      }
+      a->cls = NULL;
+      a->pg_cnt = pg_cnt;
+      a->large = true;
+      return a + 1;
+   }
+
+   uint32_t class_idx = 0;
+   while (u_classes[class_idx].block_size < size) {
+      class_idx++;
+   }
+   struct u_class* cls = &u_classes[class_idx];
+   if (cls->free_list == NULL) {
+      /* 本规格没有空闲块了, 要一页切成块 */
+      struct u_arena* a = page_alloc(1);
+      if (a == NULL) {
+	 return NULL;
+      }
+      a->cls = cls;
+      a->pg_cnt = 1;
+      a->large = false;
+      uint32_t block_idx = cls->blocks_per_arena;
+      while (block_idx-- > 0) {	 // 倒着入链, 使块按地址从低到高分出去
+	 struct u_block* b = (struct u_block*)((uint32_t)(a + 1) + block_idx * cls->block_size);
+	 b->next = cls->free_list;
+	 cls->free_list = b;
+      }
+   }
+   struct u_block* b = cls->free_list;
+   cls->free_list = b->next;
+   return b;
+}
+
+/* 释放malloc得到的ptr */
+void free(void* ptr) {
+   if (ptr == NULL) {
+      return;
+   }
+   struct u_arena* a = (struct u_arena*)((uint32_t)ptr & ~(U_PG_SIZE - 1));
+   if (a->large) {
+      assert(ptr == a + 1);
+      page_free(a, a->pg_cnt);
+      return;
+   }
+   struct u_block* b = ptr;
+   b->next = a->cls->free_list;
+   a->cls->free_list = b;
+}
@@ -65,18 +65,24 @@ uint32_t write(int32_t fd, const void* buf, uint32_t count) {
 }
 
 
-/* 申请 size 字节大小的内存, 并返回结果 */
-void* malloc(uint32_t size) {
+/* 由内核申请 size 字节大小的内存, 并返回结果 */
+void* malloc_syscall(uint32_t size) {
     return (void*) _syscall1(SYS_MALLOC, size);
 }
 
 
-/* 释放 ptr 指向的内存 */
-void free(void* ptr) {
+/* 由内核释放 ptr 指向的内存 */
+void free_syscall(void* ptr) {
     _syscall1(SYS_FREE, ptr);
 }
 
 
+/* brk 堆增长 increment 字节(可为负), 返回原来的堆结束地址, 失败返回 (void*)-1 */
+void* sbrk(int32_t increment) {
+    return (void*) _syscall1(SYS_SBRK, increment);
+}
+
+
 /* 派生子进程, 返回子进程 pid */
 pid_t fork(void) {
     return _syscall0(SYS_FORK);
@@ -197,4 +203,24 @@ void exit(int32_t status) {
 /* 等待子进程,子进程状态存储到status */
 pid_t wait(int32_t* status) {
    return _syscall1(SYS_WAIT, status);
-}
\ No newline at end of file
+}
+
+/* 获取内存使用情况 */
+void meminfo(struct mem_stat* stat) {
+   _syscall1(SYS_MEMINFO, stat);
+}
+
+/* 设置ksmd的扫描速率(参数为负表示不修改)并获取合并情况 */
+int32_t ksm_ctl(int32_t pages_per_scan, int32_t sleep_ms, struct ksm_stat* stat) {
+   return _syscall3(SYS_KSM_CTL, pages_per_scan, sleep_ms, stat);
+}
+
+/* 把任务pid改为class_id调度类(pid为0改默认类, class_id为负不修改)并获取各类情况 */
+int32_t sched_ctl(int32_t pid, int32_t class_id, struct sched_stat* stat) {
+   return _syscall3(SYS_SCHED_CTL, pid, class_id, stat);
+}
+
+/* 读取clock_id时钟(CLOCK_MONOTONIC或CLOCK_THREAD_CPUTIME_ID), 精度到纳秒 */
+int32_t clock_gettime(int32_t clock_id, struct timespec* tp) {
+   return _syscall2(SYS_CLOCK_GETTIME, clock_id, tp);
+}
@@ -4,6 +4,9 @@
 #include "stdint.h"
 #include "../../thread/thread.h"
 #include "../../fs/fs.h"
+#include "../../kernel/ksm.h"
+#include "../../thread/sched.h"
+#include "../../device/timer.h"
 /* 用来存放子功能号 */
 enum SYSCALL_NR {
     SYS_GETPID,
@@ -30,17 +33,30 @@ enum SYSCALL_NR {
     SYS_PS,
     SYS_EXECV,
     SYS_EXIT,
-    SYS_WAIT
+    SYS_WAIT,
+    SYS_SBRK,
+    SYS_MEMINFO,
+    SYS_KSM_CTL,
+    SYS_SCHED_CTL,
+    SYS_CLOCK_GETTIME
 };
 
 uint32_t getpid(void);
 
 uint32_t write(int32_t fd, const void* buf, uint32_t count);
 
+/* 用户态分配器, 见 malloc.c, 小块内存不陷入内核 */
 void* malloc(uint32_t size);
 
 void free(void* ptr);
 
+/* 直接由内核的 sys_malloc/sys_free 分配和释放 */
+void* malloc_syscall(uint32_t size);
+
+void free_syscall(void* ptr);
+
+void* sbrk(int32_t increment);
+
 int16_t fork(void);
 
 int32_t read(int32_t fd, void* buf, uint32_t count);
@@ -83,4 +99,15 @@ void exit(int32_t status);
 
 pid_t wait(int32_t* status);
 
+void meminfo(struct mem_stat* stat);
+
+/* 设置 ksmd 的扫描速率(参数为负表示不修改)并获取合并情况 */
+int32_t ksm_ctl(int32_t pages_per_scan, int32_t sleep_ms, struct ksm_stat* stat);
+
+/* 把任务 pid 改为 class_id 调度类(pid 为0改默认类, class_id 为负不修改)并获取各类情况 */
+int32_t sched_ctl(int32_t pid, int32_t class_id, struct sched_stat* stat);
+
+/* 读取 clock_id 时钟(CLOCK_MONOTONIC 或 CLOCK_THREAD_CPUTIME_ID), 精度到纳秒 */
+int32_t clock_gettime(int32_t clock_id, struct timespec* tp);
+
 #endif
@@ -268,4 +268,135 @@ int32_t buildin_rm(uint32_t argc, char** argv) {
       }
    }
    return ret;
-}
\ No newline at end of file
+}
+
+/* 打印一个内存池的概况, 单位为KB. 预先清0的页框不在伙伴系统中, 但仍是空闲的 */
+static void pool_summary_print(const char* name, struct mem_pool_stat* pstat) {
+   uint32_t total_kb = pstat->total_pages * 4;
+   uint32_t free_kb = (pstat->free_pages + pstat->zeroed_pages) * 4;
+   printf("%s total %dK used %dK free %dK (zeroed %dK)\n", name, total_kb, total_kb - free_kb, \
+	 free_kb, pstat->zeroed_pages * 4);
+}
+
+/* free命令内建函数 */
+void buildin_free(uint32_t argc, char** argv UNUSED) {
+   if (argc != 1) {
+      printf("free: no argument support!\n");
+      return;
+   }
+   struct mem_stat stat;
+   meminfo(&stat);
+   pool_summary_print("kernel:", &stat.kernel);
+   pool_summary_print("user:  ", &stat.user);
+   printf("reserve: %dK\n", stat.reserve_pages * 4);
+   printf("swap: %dK total, %dK used\n", stat.swap_total * 4, stat.swap_used * 4);
+}
+
+/* meminfo命令内建函数 */
+void buildin_meminfo(uint32_t argc, char** argv UNUSED) {
+   if (argc != 1) {
+      printf("meminfo: no argument support!\n");
+      return;
+   }
+   struct mem_stat stat;
+   meminfo(&stat);
+
+   struct mem_pool_stat* pools[2] = {&stat.kernel, &stat.user};
+   const char* pool_names[2] = {"kernel", "user"};
+   uint32_t pool_idx;
+   for (pool_idx = 0; pool_idx < 2; pool_idx++) {
+      struct mem_pool_stat* pstat = pools[pool_idx];
+      printf("%s pool: total %d pages, free %d, zeroed %d\n", pool_names[pool_idx], \
+	    pstat->total_pages, pstat->free_pages, pstat->zeroed_pages);
+      printf("   allocated %d, freed %d, zero hits %d, zero misses %d\n", \
+	    pstat->alloc_pages, pstat->freed_pages, pstat->zero_hits, pstat->zero_misses);
+   }
+
+   printf("reserve: %d pages\n", stat.reserve_pages);
+   printf("page tables: %d pages, vm areas: %d, image cache: %d pages\n", \
+	 stat.pgtable_pages, stat.vma_cnt, stat.image_cache_pages);
+   printf("swap: %d/%d pages used, swap-ins %d, swap-outs %d\n", \
+	 stat.swap_used, stat.swap_total, stat.swap_ins, stat.swap_outs);
+
+   printf("kernel malloc:\n");
+   uint32_t desc_idx;
+   for (desc_idx = 0; desc_idx < DESC_CNT; desc_idx++) {
+      struct mem_class_stat* cstat = &stat.classes[desc_idx];
+      printf("   %d bytes: arenas %d, free blocks %d\n", cstat->block_size, cstat->arenas, cstat->free_blocks);
+   }
+
+   printf("slab caches:\n");
+   uint32_t slab_idx;
+   for (slab_idx = 0; slab_idx < stat.slab_cnt; slab_idx++) {
+      struct mem_slab_stat* sstat = &stat.slabs[slab_idx];
+      printf("   %s: object %d bytes, slabs %d, free objects %d\n", sstat->name, \
+	    sstat->obj_size, sstat->slabs, sstat->free_objs);
+   }
+}
+
+/* 把十进制字符串str转换为整数存入*val, 不是合法的非负整数返回false */
+static bool str2uint(const char* str, int32_t* val) {
+   if (*str == 0) {
+      return false;
+   }
+   int32_t num = 0;
+   while (*str != 0) {
+      if (*str < '0' || *str > '9') {
+	 return false;
+      }
+      num = num * 10 + (*str++ - '0');
+   }
+   *val = num;
+   return true;
+}
+
+/* ksm命令内建函数, 可选参数为每轮扫描的页数和两轮之间休眠的毫秒数 */
+void buildin_ksm(uint32_t argc, char** argv) {
+   int32_t pages_per_scan = -1, sleep_ms = -1;
+   if (argc > 3 || (argc > 1 && !str2uint(argv[1], &pages_per_scan)) || \
+	 (argc > 2 && (!str2uint(argv[2], &sleep_ms) || sleep_ms == 0))) {
+      printf("usage: ksm [pages_per_scan [sleep_ms]]\n");
+      return;
+   }
+   struct ksm_stat stat;
+   ksm_ctl(pages_per_scan, sleep_ms, &stat);
+   printf("scan: %d pages every %d ms, full scans %d\n", stat.pages_per_scan, stat.sleep_ms, stat.full_scans);
+   printf("pages shared %d, sharing %d, merged %d, unshared %d\n", \
+	 stat.pages_shared, stat.pages_sharing, stat.pages_merged, stat.pages_unshared);
+}
+
+/* sched命令内建函数, 不带参数时显示各调度类的情况,
+ * "sched pid class" 把任务pid换到class类, "sched default class" 修改新任务的默认类,
+ * class 可以是类名或编号 */
+void buildin_sched(uint32_t argc, char** argv) {
+   struct sched_stat stat;
+   sched_ctl(0, -1, &stat);
+   if (argc != 1 && argc != 3) {
+      printf("usage: sched [pid|default class]\n");
+      return;
+   }
+   if (argc == 3) {
+      int32_t pid = 0, class_id = 0;
+      if (strcmp("default", argv[1]) && (!str2uint(argv[1], &pid) || pid == 0)) {
+	 printf("sched: invalid pid %s\n", argv[1]);
+	 return;
+      }
+      while (class_id < SCHED_CLASS_CNT && strcmp(stat.names[class_id], argv[2])) {
+	 class_id++;
+      }
+      if (class_id == SCHED_CLASS_CNT && (!str2uint(argv[2], &class_id) || class_id >= SCHED_CLASS_CNT)) {
+	 printf("sched: unknown class %s\n", argv[2]);
+	 return;
+      }
+      if (sched_ctl(pid, class_id, &stat) == -1) {
+	 printf("sched: no such task %d\n", pid);
+	 return;
+      }
+   }
+   int32_t class_id;
+   for (class_id = 0; class_id < SCHED_CLASS_CNT; class_id++) {
+      printf("%d %s%s: weight %d, ready %d, switches %d, ticks %d\n", class_id, stat.names[class_id], \
+	    class_id == stat.default_class ? " (default)" : "", stat.weight[class_id], \
+	    stat.nr_ready[class_id], stat.nr_switches[class_id], stat.nr_ticks[class_id]);
+   }
+}
@@ -28,4 +28,16 @@ int32_t buildin_rmdir(uint32_t argc, char** argv);
 /* rm 命令内建函数 */
 int32_t buildin_rm(uint32_t argc, char** argv);
 
+/* free 命令内建函数 */
+void buildin_free(uint32_t argc, char** argv);
+
+/* meminfo 命令内建函数 */
+void buildin_meminfo(uint32_t argc, char** argv);
+
+/* ksm 命令内建函数 */
+void buildin_ksm(uint32_t argc, char** argv);
+
+/* sched 命令内建函数 */
+void buildin_sched(uint32_t argc, char** argv);
+
 #endif
\ No newline at end of file
@@ -155,6 +155,18 @@ void my_shell(void) {
         } else if(!strcmp("ps", argv[0])) {
             buildin_ps(argc, argv);
 
+        } else if(!strcmp("free", argv[0])) {
+            buildin_free(argc, argv);
+
+        } else if(!strcmp("meminfo", argv[0])) {
+            buildin_meminfo(argc, argv);
+
+        } else if(!strcmp("ksm", argv[0])) {
+            buildin_ksm(argc, argv);
+
+        } else if(!strcmp("sched", argv[0])) {
+            buildin_sched(argc, argv);
+
         } else if(!strcmp("clear", argv[0])) {
             buildin_clear(argc, argv);
 
@@ -0,0 +1,172 @@
+#include "sched.h"
+#include "thread.h"
+#include "global.h"
+#include "debug.h"
+#include "string.h"
+#include "interrupt.h"
+
+/***********************   调度类   *****************************
+ * schedule 只负责切换, 就绪任务怎样排队、下一个选谁、时间片何时用完
+ * 由任务所属的调度类决定, 这样不同的调度策略可以在同一个内核里比较.
+ * 几个类都有就绪任务时按各类的 weight 分处理器时间: 每个嘀嗒给当前任务所属的类
+ * 加上 SCHED_CLASS_VTIME / weight 的 vtime, 选 vtime 最小的有就绪任务的类;
+ * 别的类的 vtime 落后超过 SCHED_CLASS_GRAN 时, 当前任务即使时间片没用完也被换下.
+ * 这样换到 fair 类的任务在 mlq 类忙时也能分到时间, 两种策略可以放在一起比较.
+ * 类从没有就绪任务变为有时, vtime 至少追到 class_min_vtime, 不能靠闲着攒下时间.
+ * 各类都没有就绪任务时运行 idle, idle 不属于任何调度类的就绪队列.
+ * 新任务加入默认类(启动时由 SCHED_CLASS_DEFAULT 决定, 运行时可以修改),
+ * fork 出的子进程与父进程同类, 单个任务也可以用 sched_ctl 换类.
+ ****************************************************************/
+
+extern struct task_struct* idle_thread;
+
+static struct sched_class* sched_classes[SCHED_CLASS_CNT] = {
+   [SCHED_CLASS_MLQ] = &mlq_sched_class,
+   [SCHED_CLASS_FAIR] = &fair_sched_class
+};
+#define SCHED_CLASS_VTIME 1024				 // weight 为1的类每个嘀嗒增加的 vtime
+#define SCHED_CLASS_GRAN (SCHED_CLASS_VTIME * 2)	 // 别的类落后这么多 vtime 才抢占
+
+static int32_t sched_default = SCHED_CLASS_DEFAULT;
+static uint32_t class_min_vtime;	 // 被选中的类的 vtime 的最大值, 只增不减
+uint32_t sched_nr_ready;
+
+/* vtime a 是否在 b 之前, 按差值比较以容忍回绕 */
+static bool vtime_before(uint32_t a, uint32_t b) {
+   return (int32_t)(a - b) < 0;
+}
+
+/* 初始化各调度类 */
+void sched_init(void) {
+   ASSERT(sched_default >= 0 && sched_default < SCHED_CLASS_CNT);
+   sched_nr_ready = 0;
+   uint32_t class_idx;
+   for (class_idx = 0; class_idx < SCHED_CLASS_CNT; class_idx++) {
+      sched_classes[class_idx]->init();
+   }
+}
+
+/* 新任务 pthread 加入默认的调度类 */
+void sched_task_init(struct task_struct* pthread) {
+   pthread->sched_class = sched_classes[sched_default];
+   pthread->level = SCHED_LEVEL_INIT;
+   pthread->vruntime = 0;
+}
+
+/* 把就绪任务 pthread 加入其调度类, 须在关中断下调用 */
+void sched_enqueue(struct task_struct* pthread, enum sched_enqueue_reason reason) {
+   ASSERT(intr_get_status() == INTR_OFF);
+   struct sched_class* class = pthread->sched_class;
+   if (class->nr_ready == 0 && running_thread()->sched_class != class && \
+	 vtime_before(class->vtime, class_min_vtime)) {
+      class->vtime = class_min_vtime;
+   }
+   class->enqueue(pthread, reason);
+   class->nr_ready++;
+   sched_nr_ready++;
+}
+
+/* 把就绪任务 pthread 从其调度类中摘下, 须在关中断下调用 */
+void sched_dequeue(struct task_struct* pthread) {
+   ASSERT(intr_get_status() == INTR_OFF && pthread->status == TASK_READY);
+   pthread->sched_class->dequeue(pthread);
+   pthread->sched_class->nr_ready--;
+   sched_nr_ready--;
+}
+
+/* 从加权已用时间最少的有就绪任务的类中取出下一个要运行的任务, 都没有就绪任务时返回 NULL. 须在关中断下调用 */
+struct task_struct* sched_pick_next(void) {
+   struct sched_class* class = NULL;
+   uint32_t class_idx;
+   for (class_idx = 0; class_idx < SCHED_CLASS_CNT; class_idx++) {
+      struct sched_class* cur_class = sched_classes[class_idx];
+      if (cur_class->nr_ready != 0 && (class == NULL || vtime_before(cur_class->vtime, class->vtime))) {
+	 class = cur_class;
+      }
+   }
+   if (class == NULL) {
+      return NULL;
+   }
+   if (vtime_before(class_min_vtime, class->vtime)) {
+      class_min_vtime = class->vtime;
+   }
+   struct task_struct* next = class->pick_next();
+   ASSERT(next != NULL && next->sched_class == class);
+   class->nr_ready--;
+   sched_nr_ready--;
+   return next;
+}
+
+/* 有就绪任务的别的类是否已经比 cur_class 少用了 SCHED_CLASS_GRAN 以上的加权时间 */
+static bool class_should_preempt(struct sched_class* cur_class) {
+   uint32_t class_idx;
+   for (class_idx = 0; class_idx < SCHED_CLASS_CNT; class_idx++) {
+      struct sched_class* class = sched_classes[class_idx];
+      if (class != cur_class && class->nr_ready != 0 && \
+	    vtime_before(class->vtime + SCHED_CLASS_GRAN, cur_class->vtime)) {
+	 return true;
+      }
+   }
+   return false;
+}
+
+/* 时钟中断中调用, 当前任务该换下时调度. idle 只在有任务就绪后自己阻塞时让出处理器 */
+void sched_tick(void) {
+   struct task_struct* cur = running_thread();
+   if (cur == idle_thread) {
+      return;
+   }
+   struct sched_class* class = cur->sched_class;
+   class->nr_ticks++;
+   class->vtime += SCHED_CLASS_VTIME / class->weight;
+   // 先让本类记账, 再看别的类是否该分到处理器
+   bool resched = class->tick(cur);
+   if (resched || class_should_preempt(class)) {
+      schedule();
+   }
+}
+
+/* pid 不为0时把该任务改为 class_id 类, 为0时改新任务的默认类; class_id 为负表示不修改.
+ * stat 不为 NULL 时填入各类的情况. 成功返回0, 失败返回-1 */
+int32_t sys_sched_ctl(int32_t pid, int32_t class_id, struct sched_stat* stat) {
+   if (class_id >= SCHED_CLASS_CNT) {
+      return -1;
+   }
+   enum intr_status old_status = intr_disable();
+   int32_t ret = 0;
+   if (class_id >= 0 && pid == 0) {
+      sched_default = class_id;
+   } else if (class_id >= 0) {
+      struct task_struct* pthread = pid2thread(pid);
+      if (pthread == NULL || pthread == idle_thread) {
+	 ret = -1;
+      } else if (pthread->sched_class != sched_classes[class_id]) {
+	 // 就绪的任务要从原来的类搬到新类, 运行或阻塞的任务下次入队时自然进入新类.
+	 // 在原来的类中攒下的时间片和 vruntime 都不作数, 由新类重新给
+	 bool ready = pthread->status == TASK_READY;
+	 if (ready) {
+	    sched_dequeue(pthread);
+	 }
+	 pthread->sched_class = sched_classes[class_id];
+	 pthread->sched_class->switched_to(pthread);
+	 if (ready) {
+	    sched_enqueue(pthread, ENQUEUE_NEW);
+	 }
+      }
+   }
+   intr_set_status(old_status);
+   if (stat == NULL) {
+      return ret;
+   }
+
+   uint32_t class_idx;
+   for (class_idx = 0; class_idx < SCHED_CLASS_CNT; class_idx++) {
+      strcpy(stat->names[class_idx], sched_classes[class_idx]->name);
+      stat->nr_switches[class_idx] = sched_classes[class_idx]->nr_switches;
+      stat->nr_ready[class_idx] = sched_classes[class_idx]->nr_ready;
+      stat->nr_ticks[class_idx] = sched_classes[class_idx]->nr_ticks;
+      stat->weight[class_idx] = sched_classes[class_idx]->weight;
+   }
+   stat->default_class = sched_default;
+   return ret;
+}
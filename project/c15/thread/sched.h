@@ -0,0 +1,85 @@
+#ifndef __THREAD_SCHED_H
+#define __THREAD_SCHED_H
+#include "stdint.h"
+#include "global.h"
+
+struct task_struct;
+
+/* 任务进入就绪队列的原因, 调度类据此调整任务的级别或虚拟运行时间 */
+enum sched_enqueue_reason {
+   ENQUEUE_NEW,		 // 新创建的任务, 或刚换到这个调度类
+   ENQUEUE_WAKEUP,	 // 阻塞后被唤醒
+   ENQUEUE_EXPIRED,	 // 用完了时间片
+   ENQUEUE_PREEMPTED,	 // 时间片没用完就被换下
+   ENQUEUE_YIELD	 // 主动让出处理器
+};
+
+/* 调度类: 一种调度策略管理自己的就绪任务. 都在关中断下调用 */
+struct sched_class {
+   char* name;
+   /* 初始化本类的就绪队列 */
+   void (*init)(void);
+   /* 把就绪的任务 pthread 加入本类的就绪队列 */
+   void (*enqueue)(struct task_struct* pthread, enum sched_enqueue_reason reason);
+   /* 把还没有运行的就绪任务 pthread 从本类的就绪队列中摘下 */
+   void (*dequeue)(struct task_struct* pthread);
+   /* 取出下一个要运行的任务, 没有就绪任务时返回 NULL */
+   struct task_struct* (*pick_next)(void);
+   /* 时钟中断时当前任务 cur 属于本类, 返回 true 表示应当换下它 */
+   bool (*tick)(struct task_struct* cur);
+   /* 任务 pthread 刚从别的类换到本类, 不论它处于什么状态, 重置它在本类中的记账 */
+   void (*switched_to)(struct task_struct* pthread);
+   uint32_t weight;		 // 各类都有就绪任务时按 weight 的比例分处理器时间
+   uint32_t vtime;		 // 按 weight 加权的本类已用处理器时间
+   uint32_t nr_ready;		 // 本类的就绪任务数
+   uint32_t nr_switches;	 // 切换到本类任务的次数
+   uint32_t nr_ticks;		 // 本类任务累计运行的嘀嗒数
+};
+
+#define SCHED_CLASS_MLQ 0	 // 多级就绪队列, 见 sched_mlq.c
+#define SCHED_CLASS_FAIR 1	 // 按虚拟运行时间公平分配, 见 sched_fair.c
+#define SCHED_CLASS_CNT 2
+
+/* 启动时新任务默认所属的调度类, 可在编译时用 -DSCHED_CLASS_DEFAULT=1 改为 fair */
+#ifndef SCHED_CLASS_DEFAULT
+#define SCHED_CLASS_DEFAULT SCHED_CLASS_MLQ
+#endif
+
+extern struct sched_class mlq_sched_class;
+extern struct sched_class fair_sched_class;
+
+/* sched_ctl 返回的调度类情况 */
+struct sched_stat {
+   char names[SCHED_CLASS_CNT][8];
+   uint32_t nr_switches[SCHED_CLASS_CNT];	 // 各类累计的任务切换次数
+   uint32_t nr_ready[SCHED_CLASS_CNT];		 // 各类当前的就绪任务数
+   uint32_t nr_ticks[SCHED_CLASS_CNT];		 // 各类累计运行的嘀嗒数
+   uint32_t weight[SCHED_CLASS_CNT];		 // 各类分处理器时间的权重
+   int32_t default_class;			 // 新任务默认所属的调度类
+};
+
+extern uint32_t sched_nr_ready;	 // 各调度类就绪任务的总数
+
+/* 初始化各调度类 */
+void sched_init(void);
+
+/* 新任务 pthread 加入默认的调度类 */
+void sched_task_init(struct task_struct* pthread);
+
+/* 把就绪任务 pthread 加入其调度类, 须在关中断下调用 */
+void sched_enqueue(struct task_struct* pthread, enum sched_enqueue_reason reason);
+
+/* 把就绪任务 pthread 从其调度类中摘下, 须在关中断下调用 */
+void sched_dequeue(struct task_struct* pthread);
+
+/* 从加权已用时间最少的有就绪任务的类中取出下一个要运行的任务, 都没有就绪任务时返回 NULL. 须在关中断下调用 */
+struct task_struct* sched_pick_next(void);
+
+/* 时钟中断中调用, 当前任务该换下时调度 */
+void sched_tick(void);
+
+/* pid 不为0时把该任务改为 class_id 类, 为0时改新任务的默认类; class_id 为负表示不修改.
+ * stat 不为 NULL 时填入各类的情况. 成功返回0, 失败返回-1 */
+int32_t sys_sched_ctl(int32_t pid, int32_t class_id, struct sched_stat* stat);
+
+#endif
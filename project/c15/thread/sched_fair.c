@@ -0,0 +1,134 @@
+#include "sched.h"
+#include "thread.h"
+#include "global.h"
+#include "debug.h"
+#include "rbtree.h"
+#include "../userprog/process.h"
+
+/***********************   公平调度类   *****************************
+ * 每个任务记一个虚拟运行时间 vruntime: 运行一个嘀嗒, vruntime 增加
+ * FAIR_TICK_VRUNTIME * default_prio / priority, priority 越大涨得越慢, 分到的处理器越多.
+ * 就绪任务按 vruntime 排在红黑树中, 每次选最左边(vruntime 最小)的任务,
+ * 它的时间片是 FAIR_LATENCY_TICKS 在就绪任务间平分的份额, 至少 FAIR_MIN_TICKS.
+ * min_vruntime 只增不减, 新任务和被唤醒的任务从它附近开始, 以免睡了很久的任务
+ * 攒下大量运行时间, 醒来后长期霸占处理器. vruntime 会回绕, 一律比较差值.
+ ********************************************************************/
+#define FAIR_TICK_VRUNTIME 1024	 // priority 为 default_prio 的任务每嘀嗒增加的 vruntime
+#define FAIR_LATENCY_TICKS 20	 // 所有就绪任务都轮到一次的目标周期
+#define FAIR_MIN_TICKS 2	 // 每次上处理器至少运行的嘀嗒数
+#define FAIR_WAKEUP_BONUS (FAIR_TICK_VRUNTIME * FAIR_LATENCY_TICKS / 2)  // 被唤醒的任务可以领先 min_vruntime 的量
+
+static struct rb_root fair_tree;
+static struct rb_node* fair_leftmost;	 // 树中 vruntime 最小的结点
+static uint32_t fair_nr_ready;
+static uint32_t min_vruntime;
+
+/* vruntime a 是否在 b 之前, 按差值比较以容忍回绕 */
+static bool vruntime_before(uint32_t a, uint32_t b) {
+   return (int32_t)(a - b) < 0;
+}
+
+static void fair_init(void) {
+   rb_root_init(&fair_tree);
+   fair_leftmost = NULL;
+}
+
+static void fair_enqueue(struct task_struct* pthread, enum sched_enqueue_reason reason) {
+   if (reason == ENQUEUE_NEW || reason == ENQUEUE_WAKEUP) {
+      uint32_t floor = min_vruntime - (reason == ENQUEUE_WAKEUP ? FAIR_WAKEUP_BONUS : 0);
+      if (vruntime_before(pthread->vruntime, floor)) {
+	 pthread->vruntime = floor;
+      }
+   } else if (reason == ENQUEUE_YIELD && fair_leftmost != NULL) {
+      // 让出处理器的任务排到当前最靠前的任务之后, 否则它马上又被选中
+      uint32_t first = rb_entry(fair_leftmost, struct task_struct, run_node)->vruntime;
+      if (vruntime_before(pthread->vruntime, first)) {
+	 pthread->vruntime = first;
+      }
+   }
+
+   /* vruntime 相同的排在后面, 使它们先来先运行 */
+   struct rb_node** link = &fair_tree.node;
+   struct rb_node* parent = NULL;
+   bool leftmost = true;
+   while (*link != NULL) {
+      parent = *link;
+      if (vruntime_before(pthread->vruntime, rb_entry(parent, struct task_struct, run_node)->vruntime)) {
+	 link = &parent->left;
+      } else {
+	 link = &parent->right;
+	 leftmost = false;
+      }
+   }
+   rb_link_node(&pthread->run_node, parent, link);
+   rb_insert_color(&pthread->run_node, &fair_tree);
+   if (leftmost) {
+      fair_leftmost = &pthread->run_node;
+   }
+   fair_nr_ready++;
+}
+
+static void fair_dequeue(struct task_struct* pthread) {
+   if (fair_leftmost == &pthread->run_node) {
+      fair_leftmost = rb_next(fair_leftmost);
+   }
+   rb_erase(&pthread->run_node, &fair_tree);
+   fair_nr_ready--;
+}
+
+/* 按就绪任务数算出的时间片 */
+static uint32_t fair_slice(void) {
+   uint32_t slice = FAIR_LATENCY_TICKS / (fair_nr_ready + 1);
+   return slice < FAIR_MIN_TICKS ? FAIR_MIN_TICKS : slice;
+}
+
+/* 取 vruntime 最小的任务, 按就绪任务数分给它时间片 */
+static struct task_struct* fair_pick_next(void) {
+   if (fair_leftmost == NULL) {
+      return NULL;
+   }
+   struct task_struct* next = rb_entry(fair_leftmost, struct task_struct, run_node);
+   fair_dequeue(next);
+   if (vruntime_before(min_vruntime, next->vruntime)) {
+      min_vruntime = next->vruntime;
+   }
+   next->ticks = fair_slice();
+   return next;
+}
+
+/* 累加 vruntime, 时间片用完或已经明显领先于最靠前的就绪任务时换下 */
+static bool fair_tick(struct task_struct* cur) {
+   ASSERT(cur->priority > 0);
+   cur->vruntime += FAIR_TICK_VRUNTIME * default_prio / cur->priority;
+   if (cur->ticks > 0) {
+      cur->ticks--;
+   }
+   if (cur->ticks == 0) {
+      return true;
+   }
+   if (fair_leftmost == NULL) {
+      return false;
+   }
+   uint32_t first = rb_entry(fair_leftmost, struct task_struct, run_node)->vruntime;
+   return vruntime_before(first + FAIR_TICK_VRUNTIME * FAIR_MIN_TICKS, cur->vruntime);
+}
+
+/* 从别的类换来的任务 vruntime 至少追到 min_vruntime, 否则正在运行的任务换过来后
+ * 一直排在最前面, 别的任务都得等它追上. 时间片也换成本类的 */
+static void fair_switched_to(struct task_struct* pthread) {
+   if (vruntime_before(pthread->vruntime, min_vruntime)) {
+      pthread->vruntime = min_vruntime;
+   }
+   pthread->ticks = fair_slice();
+}
+
+struct sched_class fair_sched_class = {
+   .name = "fair",
+   .weight = 1,
+   .init = fair_init,
+   .enqueue = fair_enqueue,
+   .dequeue = fair_dequeue,
+   .pick_next = fair_pick_next,
+   .tick = fair_tick,
+   .switched_to = fair_switched_to
+};
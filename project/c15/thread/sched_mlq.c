@@ -0,0 +1,120 @@
+#include "sched.h"
+#include "thread.h"
+#include "global.h"
+#include "debug.h"
+#include "list.h"
+#include "../device/timer.h"
+
+/***********************   多级就绪队列   *****************************
+ * 原先只有一个先进先出的就绪队列, priority 只决定时间片的长短,
+ * 等键盘的 shell 被唤醒后也要排在所有计算型任务后面.
+ * 现在每个级别一个就绪队列, 0级最高, ready_bitmap 的第 i 位表示第 i 级非空,
+ * 调度时用 bsf 找到最高的非空级别, 取其队首, 与就绪任务的多少无关.
+ * 级别是动态的: 用完整个时间片降一级, 阻塞后被唤醒升一级,
+ * 于是常等 I/O 的交互任务浮在上面, 计算型任务沉到下面.
+ * 为免低级别的任务饿死, 每隔 SCHED_AGE_TICKS 把最低非空级别的队首提升一级.
+ * priority 仍只决定时间片的长短.
+ **********************************************************************/
+#define SCHED_AGE_TICKS 10	 // 每隔多少嘀嗒提升一次最低级别的任务
+
+static struct list ready_queues[SCHED_LEVELS];
+static uint32_t ready_bitmap;	 // 第 i 位为1表示第 i 级就绪队列非空
+static uint32_t last_age_tick;	 // 上次提升低级别任务时的 ticks
+
+/* 把 pthread 加入其级别的就绪队列尾 */
+static void ready_add(struct task_struct* pthread) {
+   ASSERT(pthread->level < SCHED_LEVELS);
+   struct list* queue = &ready_queues[pthread->level];
+   ASSERT(!elem_find(queue, &pthread->general_tag));
+   list_append(queue, &pthread->general_tag);
+   ready_bitmap |= 1 << pthread->level;
+}
+
+/* 把 pthread 从就绪队列中摘下 */
+static void ready_remove(struct task_struct* pthread) {
+   list_remove(&pthread->general_tag);
+   if (list_empty(&ready_queues[pthread->level])) {
+      ready_bitmap &= ~(1 << pthread->level);
+   }
+}
+
+/* 防止饿死: 把最低非空级别的队首线程提升一级, 排到上一级的队尾 */
+static void ready_age(void) {
+   uint32_t level;
+   asm ("bsrl %1, %0" : "=r" (level) : "rm" (ready_bitmap));
+   if (level == 0) {
+      return;
+   }
+   struct task_struct* pthread = elem2entry(struct task_struct, general_tag, ready_queues[level].head.next);
+   ready_remove(pthread);
+   pthread->level--;
+   ready_add(pthread);
+}
+
+static void mlq_init(void) {
+   uint32_t level = 0;
+   while (level < SCHED_LEVELS) {
+      list_init(&ready_queues[level++]);
+   }
+}
+
+/* 用完时间片的降一级并重新充满时间片, 被唤醒的升一级, 都排到该级的队尾.
+ * 让给别的类而被换下的留在原级别, 带着剩下的时间片 */
+static void mlq_enqueue(struct task_struct* pthread, enum sched_enqueue_reason reason) {
+   if (reason == ENQUEUE_EXPIRED) {
+      if (pthread->level < SCHED_LEVELS - 1) {
+	 pthread->level++;
+      }
+      pthread->ticks = pthread->priority;
+   } else if (reason == ENQUEUE_WAKEUP && pthread->level > 0) {
+      pthread->level--;
+   }
+   ready_add(pthread);
+}
+
+static void mlq_dequeue(struct task_struct* pthread) {
+   ASSERT(elem_find(&ready_queues[pthread->level], &pthread->general_tag));
+   ready_remove(pthread);
+}
+
+/* 弹出最高非空级别的队首线程 */
+static struct task_struct* mlq_pick_next(void) {
+   if (ready_bitmap == 0) {
+      return NULL;
+   }
+   if (ticks - last_age_tick >= SCHED_AGE_TICKS) {
+      last_age_tick = ticks;
+      ready_age();
+   }
+   uint32_t level;
+   asm ("bsfl %1, %0" : "=r" (level) : "rm" (ready_bitmap));
+   struct task_struct* next = elem2entry(struct task_struct, general_tag, ready_queues[level].head.next);
+   ready_remove(next);
+   return next;
+}
+
+/* 时间片用完才换下 */
+static bool mlq_tick(struct task_struct* cur) {
+   if (cur->ticks == 0) {
+      return true;
+   }
+   cur->ticks--;
+   return false;
+}
+
+/* 从别的类换来的任务和新任务一样从初始级别开始, 时间片重新充满 */
+static void mlq_switched_to(struct task_struct* pthread) {
+   pthread->level = SCHED_LEVEL_INIT;
+   pthread->ticks = pthread->priority;
+}
+
+struct sched_class mlq_sched_class = {
+   .name = "mlq",
+   .weight = 3,
+   .init = mlq_init,
+   .enqueue = mlq_enqueue,
+   .dequeue = mlq_dequeue,
+   .pick_next = mlq_pick_next,
+   .tick = mlq_tick,
+   .switched_to = mlq_switched_to
+};
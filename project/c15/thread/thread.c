@@ -9,6 +9,8 @@
 #include "../userprog/process.h"
 #include "sync.h"
 #include "../fs/file.h"
+#include "sched.h"
+#include "../device/timer.h"
 
 
 /* pid的位图,最大支持1024个pid */
@@ -23,7 +25,6 @@ struct pid_pool {
 
 struct task_struct* main_thread;    // 主线程PCB
 struct task_struct* idle_thread;    // idle线程
-struct list thread_ready_list;	    // 就绪队列
 struct list thread_all_list;	    // 所有任务队列
 static struct list_elem* thread_tag;// 用于保存队列中的线程结点
 
@@ -33,8 +34,17 @@ extern void init(void);
 static void idle(void* arg UNUSED) {
    while(1) {
       thread_block(TASK_BLOCKED);     
-      //执行hlt时必须要保证目前处在开中断的情况下
-      asm volatile ("sti; hlt" : : : "memory");
+      // 没有其它任务可运行时, 顺便为内存池准备清0的页框, 一有任务就绪就停下
+      while (sched_nr_ready == 0 && zero_page_refill());
+      // 关中断下确认仍没有就绪任务再停掉周期时钟, 以免错过这期间的唤醒
+      enum intr_status old_status = intr_disable();
+      if (sched_nr_ready == 0) {
+	 timer_nohz_enter();
+	 //执行hlt时必须要保证目前处在开中断的情况下, sti 后的 hlt 执行前不会响应中断
+	 asm volatile ("sti; hlt" : : : "memory");
+	 timer_nohz_exit();
+      }
+      intr_set_status(old_status);
    }
 }
 
@@ -116,7 +126,8 @@ void init_thread(struct task_struct* pthread, char* name, int prio) {
    pthread->self_kstack = (uint32_t*)((uint32_t)pthread + PG_SIZE);
    pthread->priority = prio;
    pthread->ticks = prio;
-   pthread->elapsed_ticks = 0;
+   sched_task_init(pthread);
+   pthread->runtime_ns = 0;
    pthread->pgdir = NULL;
    /* 标准输入输出先空出来 */
    pthread->fd_table[0] = 0;
@@ -140,10 +151,8 @@ struct task_struct* thread_start(char* name, int prio, thread_func function, voi
    init_thread(thread, name, prio);
    thread_create(thread, function, func_arg);
 
-   /* 确保之前不在队列中 */
-   ASSERT(!elem_find(&thread_ready_list, &thread->general_tag));
    /* 加入就绪线程队列 */
-   list_append(&thread_ready_list, &thread->general_tag);
+   thread_ready_add(thread);
 
    /* 确保之前不在队列中 */
    ASSERT(!elem_find(&thread_all_list, &thread->all_list_tag));
@@ -160,39 +169,50 @@ static void make_main_thread(void) {
    main_thread = running_thread();
    init_thread(main_thread, "main", 31);
 
-/* main函数是当前线程,当前线程不在thread_ready_list中,
+/* main函数是当前线程,当前线程不在就绪队列中,
  * 所以只将其加在thread_all_list中. */
    ASSERT(!elem_find(&thread_all_list, &main_thread->all_list_tag));
    list_append(&thread_all_list, &main_thread->all_list_tag);
 }
 
+/* 把新的就绪线程 pthread 加入其调度类的就绪队列 */
+void thread_ready_add(struct task_struct* pthread) {
+   enum intr_status old_status = intr_disable();
+   sched_enqueue(pthread, ENQUEUE_NEW);
+   intr_set_status(old_status);
+}
+
 /* 实现任务调度 */
 void schedule() {
    ASSERT(intr_get_status() == INTR_OFF);
 
    struct task_struct* cur = running_thread(); 
-   if (cur->status == TASK_RUNNING) { // 若此线程只是cpu时间片到了,将其加入到就绪队列尾
-      ASSERT(!elem_find(&thread_ready_list, &cur->general_tag));
-      list_append(&thread_ready_list, &cur->general_tag);
-      cur->ticks = cur->priority;     // 重新将当前线程的ticks再重置为其priority;
+   if (cur->status == TASK_RUNNING) { // 若此线程只是cpu时间片到了,将其加入到就绪队列
+      ASSERT(cur != idle_thread);
       cur->status = TASK_READY;
+      sched_enqueue(cur, cur->ticks == 0 ? ENQUEUE_EXPIRED : ENQUEUE_PREEMPTED);
    } else { 
       /* 若此线程需要某事件发生后才能继续上cpu运行,
       不需要将其加入队列,因为当前线程不在就绪队列中。*/
    }
 
-   /* 如果就绪队列中没有可运行的任务,就唤醒idle */
-   if (list_empty(&thread_ready_list)) {
-      thread_unblock(idle_thread);
-   }
-
-   ASSERT(!list_empty(&thread_ready_list));
    thread_tag = NULL;	  // thread_tag清空
-/* 将thread_ready_list队列中的第一个就绪线程弹出,准备将其调度上cpu. */
-   thread_tag = list_pop(&thread_ready_list);   
-   struct task_struct* next = elem2entry(struct task_struct, general_tag, thread_tag);
+/* 按调度类的先后取出下一个就绪线程, 都没有就绪线程时运行idle. */
+   struct task_struct* next = sched_pick_next();
+   if (next == NULL) {
+      ASSERT(idle_thread->status == TASK_BLOCKED);
+      next = idle_thread;
+   } else if (next != cur) {
+      next->sched_class->nr_switches++;
+   }
+   thread_tag = &next->general_tag;
    next->status = TASK_RUNNING;
 
+   /* 把这次运行的时间记到 cur 上, next 从现在开始计时 */
+   uint64_t now = clock_ns();
+   cur->runtime_ns += now - cur->exec_start;
+   next->exec_start = now;
+
    /* 击活任务页表等 */
    process_activate(next);
 
@@ -216,11 +236,7 @@ void thread_unblock(struct task_struct* pthread) {
    enum intr_status old_status = intr_disable();
    ASSERT(((pthread->status == TASK_BLOCKED) || (pthread->status == TASK_WAITING) || (pthread->status == TASK_HANGING)));
    if (pthread->status != TASK_READY) {
-      ASSERT(!elem_find(&thread_ready_list, &pthread->general_tag));
-      if (elem_find(&thread_ready_list, &pthread->general_tag)) {
-	 PANIC("thread_unblock: blocked thread in ready_list\n");
-      }
-      list_push(&thread_ready_list, &pthread->general_tag);    // 放到队列的最前面,使其尽快得到调度
+      sched_enqueue(pthread, ENQUEUE_WAKEUP);
       pthread->status = TASK_READY;
    } 
    intr_set_status(old_status);
@@ -230,9 +246,8 @@ void thread_unblock(struct task_struct* pthread) {
 void thread_yield(void) {
    struct task_struct* cur = running_thread();   
    enum intr_status old_status = intr_disable();
-   ASSERT(!elem_find(&thread_ready_list, &cur->general_tag));
-   list_append(&thread_ready_list, &cur->general_tag);
    cur->status = TASK_READY;
+   sched_enqueue(cur, ENQUEUE_YIELD);
    schedule();
    intr_set_status(old_status);
 }
@@ -289,7 +304,9 @@ static bool elem2thread_info(struct list_elem* pelem, int arg UNUSED) {
       case 5:
 	 pad_print(out_pad, 16, "DIED", 's');
    }
-   pad_print(out_pad, 16, &pthread->elapsed_ticks, 'x');
+   char runtime[16];
+   sprintf(runtime, "%d", (uint32_t)div_u64_rem(pthread->runtime_ns, 1000000, NULL));
+   pad_print(out_pad, 16, runtime, 's');
 
    memset(out_pad, 0, 16);
    ASSERT(strlen(pthread->name) < 17);
@@ -301,23 +318,27 @@ static bool elem2thread_info(struct list_elem* pelem, int arg UNUSED) {
 
 /* 打印任务列表 */
 void sys_ps(void) {
-   char* ps_title = "PID            PPID           STAT           TICKS          COMMAND\n";
+   char* ps_title = "PID            PPID           STAT           RUNTIME(MS)    COMMAND\n";
    sys_write(stdout_no, ps_title, strlen(ps_title));
    list_traversal(&thread_all_list, elem2thread_info, 0);
 }
 
 /* 回收thread_over的pcb和页表,并将其从调度队列中去除 */
 void thread_exit(struct task_struct* thread_over, bool need_schedule) {
+   /* 弹匣中的内存块可能要持锁还回去, 所以在关中断之前 */
+   mem_magazine_flush(thread_over);
+
    /* 要保证schedule在关中断情况下调用 */
    intr_disable();
-   thread_over->status = TASK_DIED;
 
    /* 如果thread_over不是当前线程,就有可能还在就绪队列中,将其从中删除 */
-   if (elem_find(&thread_ready_list, &thread_over->general_tag)) {
-      list_remove(&thread_over->general_tag);
+   if (thread_over->status == TASK_READY) {
+      sched_dequeue(thread_over);
    }
+   thread_over->status = TASK_DIED;
    if (thread_over->pgdir) {     // 如是进程,回收进程的页表
       mfree_page(PF_KERNEL, thread_over->pgdir, 1);
+      MEM_STAT_ADD(pgtable_pages, -1);
    }
 
    /* 从all_thread_list中去掉此任务 */
@@ -361,7 +382,7 @@ struct task_struct* pid2thread(int32_t pid) {
 void thread_init(void) {
    put_str("thread_init start\n");
 
-   list_init(&thread_ready_list);
+   sched_init();
    list_init(&thread_all_list);
    pid_pool_init();
 
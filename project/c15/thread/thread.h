@@ -4,13 +4,31 @@
 #include "list.h"
 #include "bitmap.h"
 #include "memory.h"
+#include "rbtree.h"
 
 #define TASK_NAME_LEN 16
 #define MAX_FILES_OPEN_PER_PROC 8
+#define MAX_FILE_REGIONS 4
+#define SCHED_LEVELS 8	 // mlq 调度类就绪队列的级数, 0级最高
+#define SCHED_LEVEL_INIT 2	 // 新任务在 mlq 调度类中的级别
 /* 自定义通用函数类型,它将在很多线程函数中做为形参类型 */
 typedef void thread_func(void*);
 typedef int16_t pid_t;
 
+struct inode;
+struct sched_class;
+
+/* 文件映射区: 进程体中内容来自可执行文件的一段虚拟地址,
+ * 缺页时才从文件中读入, [vaddr+filesz, vaddr+memsz)是bss */
+struct file_region {
+   struct inode* inode;	 // 映像文件, 占有一次打开计数, 为NULL表示此项未用
+   uint32_t offset;	 // 段在文件中的偏移
+   uint32_t vaddr;	 // 段的起始虚拟地址
+   uint32_t filesz;	 // 段在文件中的大小
+   uint32_t memsz;	 // 段在内存中的大小
+   bool writable;	 // 段是否可写, 只读段的页可以在进程间共享
+};
+
 /* 进程或线程的状态 */
 enum task_status {
    TASK_RUNNING,
@@ -83,24 +101,31 @@ struct task_struct {
    char name[TASK_NAME_LEN];
    uint8_t priority;
    uint8_t ticks;	   // 每次在处理器上执行的时间嘀嗒数
-/* 此任务自上cpu运行后至今占用了多少cpu嘀嗒数,
- * 也就是此任务执行了多久*/
-   uint32_t elapsed_ticks;
+   struct sched_class* sched_class;	 // 所属的调度类
+   uint8_t level;	   // mlq 类: 所在就绪队列的级别, 0级最高, 随阻塞和用完时间片动态调整
+   uint32_t vruntime;	   // fair 类: 按 priority 加权的虚拟运行时间
+   struct rb_node run_node;	 // fair 类: 用于加入按 vruntime 排序的红黑树
+/* 此任务自上cpu运行后至今占用了多少纳秒的cpu时间,
+ * 也就是此任务执行了多久, 在换下处理器时累加*/
+   uint64_t runtime_ns;
+   uint64_t exec_start;	 // 这次上处理器时的 clock_ns
 /* general_tag的作用是用于线程在一般的队列中的结点 */
    struct list_elem general_tag;				    
 /* all_list_tag的作用是用于线程队列thread_all_list中的结点 */
    struct list_elem all_list_tag;
    uint32_t* pgdir;              // 进程自己页表的虚拟地址
-   struct virtual_addr userprog_vaddr;   // 用户进程的虚拟地址
+   struct list vmas;		 // 用户进程的虚拟内存区, 按地址升序排列
    struct mem_block_desc u_block_desc[DESC_CNT];   // 用户进程内存块描述符
+   struct mem_magazine mags[DESC_CNT];	 // 各规格内存块的弹匣, sys_malloc/sys_free 先走这里
+   uint32_t brk;		 // 用户进程brk堆的结束地址, 堆从USER_BRK_START开始
    int32_t fd_table[MAX_FILES_OPEN_PER_PROC];	// 已打开文件数组
+   struct file_region file_regions[MAX_FILE_REGIONS];	// 进程体的文件映射区
    uint32_t cwd_inode_nr;	 // 进程所在的工作目录的inode编号
    pid_t parent_pid;		 // 父进程pid
    int8_t  exit_status;         // 进程结束时自己调用exit传入的参数
    uint32_t stack_magic;	 // 用这串数字做栈的边界标记,用于检测栈的溢出
 };
 
-extern struct list thread_ready_list;
 extern struct list thread_all_list;
 
 void thread_create(struct task_struct* pthread, thread_func function, void* func_arg);
@@ -112,6 +137,7 @@ void thread_init(void);
 void thread_block(enum task_status stat);
 void thread_unblock(struct task_struct* pthread);
 void thread_yield(void);
+void thread_ready_add(struct task_struct* pthread);
 pid_t fork_pid(void);
 void sys_ps(void);
 void thread_exit(struct task_struct* thread_over, bool need_schedule);
@@ -6,6 +6,11 @@
 #include "global.h"
 #include "memory.h"
 #include "../fs/file.h"
+#include "process.h"
+#include "wait_exit.h"
+#include "vma.h"
+
+#define EXEC_ARG_MAX 2048     // 命令行参数字符串的总长度上限, 参数要放进用户栈所在的一页中
 
 extern void intr_exit(void);
 typedef uint32_t Elf32_Word, Elf32_Addr, Elf32_Off;
@@ -42,6 +47,9 @@ struct Elf32_Phdr {
 };
 
 /* 段类型 */
+/* 段权限 */
+#define PF_W 2		 // 可写
+
 enum segment_type {
    PT_NULL,            // 忽略
    PT_LOAD,            // 可加载程序段
@@ -52,44 +60,148 @@ enum segment_type {
    PT_PHDR             // 程序头表
 };
 
-/* 将文件描述符fd指向的文件中,偏移为offset,大小为filesz的段加载到虚拟地址为vaddr的内存 */
-static bool segment_load(int32_t fd, uint32_t offset, uint32_t filesz, uint32_t vaddr) {
+/* 将文件描述符fd指向的文件中,偏移为offset,大小为filesz的段映射到虚拟地址为vaddr的内存,
+ * 段在内存中占memsz字节, 超出filesz的部分(bss)为0.
+ * 段内容并不马上读入, 而是记录成文件映射区, 每页在首次访问时才从文件读入 */
+static bool segment_load(int32_t fd, uint32_t offset, uint32_t filesz, uint32_t memsz, uint32_t vaddr, bool writable) {
    uint32_t vaddr_first_page = vaddr & 0xfffff000;    // vaddr地址所在的页框
    uint32_t size_in_first_page = PG_SIZE - (vaddr & 0x00000fff);     // 加载到内存后,文件在第一个页框中占用的字节大小
    uint32_t occupy_pages = 0;
    /* 若一个页框容不下该段 */
-   if (filesz > size_in_first_page) {
-      uint32_t left_size = filesz - size_in_first_page;
+   if (memsz > size_in_first_page) {
+      uint32_t left_size = memsz - size_in_first_page;
       occupy_pages = DIV_ROUND_UP(left_size, PG_SIZE) + 1;	     // 1是指vaddr_first_page
    } else {
       occupy_pages = 1;
    }
 
-   /* 为进程分配内存 */
-   uint32_t page_idx = 0;
-   uint32_t vaddr_page = vaddr_first_page;
-   while (page_idx < occupy_pages) {
-      uint32_t* pde = pde_ptr(vaddr_page);
-      uint32_t* pte = pte_ptr(vaddr_page);
+   /* 只占住虚拟地址, 物理页在首次访问时由缺页异常分配.
+    * 如果前一个段已经用了第一页, 这一页仍归前一个段 */
+   struct task_struct* cur = running_thread();
+   if (!vma_add(cur, vaddr_first_page, vaddr_first_page + occupy_pages * PG_SIZE, \
+	 writable ? VMA_READ | VMA_WRITE : VMA_READ, VMA_IMAGE)) {
+      return false;
+   }
+   if (filesz == 0) {	 // 纯bss段, 缺页时分配的就是清0的页
+      return true;
+   }
 
-      /* 如果pde不存在,或者pte不存在就分配内存.
-       * pde的判断要在pte之前,否则pde若不存在会导致
-       * 判断pte时缺页异常 */
-      if (!(*pde & 0x00000001) || !(*pte & 0x00000001)) {
-	 if (get_a_page(PF_USER, vaddr_page) == NULL) {
-	    return false;
-	 }
-      } // 如果原进程的页表已经分配了,利用现有的物理页,直接覆盖进程体
-      vaddr_page += PG_SIZE;
-      page_idx++;
+   /* 找个空闲的文件映射区记录下此段 */
+   uint32_t region_idx = 0;
+   while (region_idx < MAX_FILE_REGIONS && cur->file_regions[region_idx].inode != NULL) {
+      region_idx++;
    }
+   if (region_idx < MAX_FILE_REGIONS) {
+      struct file_region* region = &cur->file_regions[region_idx];
+      region->inode = file_table[fd_local2global(fd)].fd_inode;
+      region->inode->i_open_cnts++;	 // 映射区关闭前映像文件不能被删除
+      region->offset = offset;
+      region->vaddr = vaddr;
+      region->filesz = filesz;
+      region->memsz = memsz;
+      region->writable = writable;
+      return true;
+   }
+
+   /* 映射区用完了, 只好立即读入, 读入时缺页异常会建立映射 */
    sys_lseek(fd, offset, SEEK_SET);
-   sys_read(fd, (void*)vaddr, filesz);
+   if (sys_read(fd, (void*)vaddr, filesz) != (int32_t)filesz) {
+      return false;
+   }
+   /* 文件内容最后一页中超出filesz的部分(bss的开头)需要清0,
+    * 之后整页的bss尚未映射, 缺页时分配的就是清0的页 */
+   if (memsz > filesz) {
+      uint32_t bss_start = vaddr + filesz;
+      uint32_t bss_end = vaddr + memsz;
+      uint32_t page_end = (bss_start + PG_SIZE - 1) & 0xfffff000;
+      if (page_end > bss_end) {
+	 page_end = bss_end;
+      }
+      memset((void*)bss_start, 0, page_end - bss_start);
+   }
+   return true;
+}
+
+/* 缺页异常中调用: page_vaddr所在页刚映射了清0的页框,
+ * 若此页落在当前进程的文件映射区中, 就从映像文件读入相应的内容.
+ * 一页可能跨两个段(如代码段末尾和数据段开头), 所以要查遍所有映射区 */
+bool file_region_fill(uint32_t page_vaddr) {
+   struct task_struct* cur = running_thread();
+   uint32_t region_idx = 0;
+   while (region_idx < MAX_FILE_REGIONS) {
+      struct file_region* region = &cur->file_regions[region_idx++];
+      if (region->inode == NULL) {
+	 continue;
+      }
+      /* 求此页与段在文件中那部分的交集 */
+      uint32_t start = page_vaddr > region->vaddr ? page_vaddr : region->vaddr;
+      uint32_t end = page_vaddr + PG_SIZE;
+      if (end > region->vaddr + region->filesz) {
+	 end = region->vaddr + region->filesz;
+      }
+      if (start >= end) {
+	 continue;
+      }
+      struct file image = {
+	 .fd_pos = region->offset + (start - region->vaddr),
+	 .fd_flag = O_RDONLY,
+	 .fd_inode = region->inode
+      };
+      if (file_read(&image, (void*)start, end - start) != (int32_t)(end - start)) {
+	 return false;
+      }
+   }
    return true;
 }
 
-/* 从文件系统上加载用户程序pathname,成功则返回程序的起始地址,否则返回-1 */
-static int32_t load(const char* pathname) {
+/* 判断page_vaddr所在页能否与运行同一映像的其它进程共享:
+ * 此页只落在只读的文件映射区中时返回true, *i_no返回映像文件的inode编号 */
+bool file_region_shared(uint32_t page_vaddr, uint32_t* i_no) {
+   struct task_struct* cur = running_thread();
+   bool shared = false;
+   uint32_t region_idx = 0;
+   while (region_idx < MAX_FILE_REGIONS) {
+      struct file_region* region = &cur->file_regions[region_idx++];
+      if (region->inode == NULL || page_vaddr >= region->vaddr + region->memsz || \
+	    page_vaddr + PG_SIZE <= region->vaddr) {
+	 continue;
+      }
+      if (region->writable) {	 // 与可写段共用一页(如代码段末尾和数据段开头)就只能私有
+	 return false;
+      }
+      *i_no = region->inode->i_no;
+      shared = true;
+   }
+   return shared;
+}
+
+/* 关闭进程的所有文件映射区 */
+void file_regions_release(struct task_struct* pthread) {
+   uint32_t region_idx = 0;
+   while (region_idx < MAX_FILE_REGIONS) {
+      struct file_region* region = &pthread->file_regions[region_idx++];
+      if (region->inode != NULL) {
+	 inode_close(region->inode);
+	 region->inode = NULL;
+      }
+   }
+}
+
+/* 释放当前进程旧的进程体, 使用户空间回到刚创建时的样子,
+ * 新的用户栈区建不起来时返回false, 此时旧的进程体已经释放 */
+static bool exec_vspace_reset(struct task_struct* cur) {
+   process_vspace_release(cur);
+   file_regions_release(cur);
+   vma_release(cur);
+   block_desc_init(cur->u_block_desc);
+   mem_magazine_flush(cur);	 // 弹匣中的块在旧的用户空间中, 丢掉
+   cur->brk = USER_BRK_START;
+   return vma_space_init(cur);
+}
+
+/* 从文件系统上加载用户程序pathname,成功则返回程序的起始地址,否则返回-1
+ * elf头校验通过后会释放旧的进程体, 此后失败时*released为true, 进程已无法恢复 */
+static int32_t load(const char* pathname, bool* released) {
    int32_t ret = -1;
    struct Elf32_Ehdr elf_header;
    struct Elf32_Phdr prog_header;
@@ -116,6 +228,13 @@ static int32_t load(const char* pathname) {
       goto done;
    }
 
+   /* 校验通过, 旧的进程体不再需要, 父进程写时复制共享的页框也在这里解除共享 */
+   *released = true;
+   if (!exec_vspace_reset(running_thread())) {
+      ret = -1;
+      goto done;
+   }
+
    Elf32_Off prog_header_offset = elf_header.e_phoff; 
    Elf32_Half prog_header_size = elf_header.e_phentsize;
 
@@ -135,7 +254,8 @@ static int32_t load(const char* pathname) {
 
       /* 如果是可加载段就调用segment_load加载到内存 */
       if (PT_LOAD == prog_header.p_type) {
-	 if (!segment_load(fd, prog_header.p_offset, prog_header.p_filesz, prog_header.p_vaddr)) {
+	 if (!segment_load(fd, prog_header.p_offset, prog_header.p_filesz, prog_header.p_memsz, \
+	       prog_header.p_vaddr, prog_header.p_flags & PF_W)) {
 	    ret = -1;
 	    goto done;
 	 }
@@ -153,29 +273,70 @@ done:
 
 /* 用path指向的程序替换当前进程 */
 int32_t sys_execv(const char* path, const char* argv[]) {
+   /* 路径和参数都在旧的用户空间中, 而旧的进程体在加载时就会释放, 所以先复制到内核 */
+   char* arg_buf = get_kernel_pages(1);
+   if (arg_buf == NULL) {
+      return -1;
+   }
+   uint32_t path_len = strlen(path) + 1;
+   if (path_len > MAX_PATH_LEN) {
+      free_kernel_pages(arg_buf, 1);
+      return -1;
+   }
+   memcpy(arg_buf, path, path_len);
+   char* args = arg_buf + MAX_PATH_LEN;    // 参数字符串依次紧挨着存放
+   uint32_t args_len = 0;
    uint32_t argc = 0;
    while (argv[argc]) {
+      uint32_t arg_len = strlen(argv[argc]) + 1;
+      if (args_len + arg_len + (argc + 2) * sizeof(char*) > EXEC_ARG_MAX) {
+	 free_kernel_pages(arg_buf, 1);
+	 return -1;
+      }
+      memcpy(args + args_len, argv[argc], arg_len);
+      args_len += arg_len;
       argc++;
    }
-   int32_t entry_point = load(path);     
+
+   bool released = false;
+   int32_t entry_point = load(arg_buf, &released);     
    if (entry_point == -1) {	 // 若加载失败则返回-1
+      free_kernel_pages(arg_buf, 1);
+      if (released) {
+	 // 旧的进程体已经释放了, 无处可返回
+	 sys_exit(-1);
+      }
       return -1;
    }
-   
+
+   /* 把参数放在用户栈顶: 先是参数字符串, 其下是argv指针数组.
+    * 用户栈页是按需分配的, 写入时由缺页异常建立 */
+   char* user_args = (char*)(0xc0000000 - args_len);
+   memcpy(user_args, args, args_len);
+   char** user_argv = (char**)(((uint32_t)user_args & ~3) - (argc + 1) * sizeof(char*));
+   uint32_t arg_idx = 0;
+   char* arg = user_args;
+   while (arg_idx < argc) {
+      user_argv[arg_idx++] = arg;
+      arg += strlen(arg) + 1;
+   }
+   user_argv[argc] = NULL;
+
    struct task_struct* cur = running_thread();
    /* 修改进程名 */
-   memcpy(cur->name, path, TASK_NAME_LEN);
+   memcpy(cur->name, arg_buf, TASK_NAME_LEN);
    cur->name[TASK_NAME_LEN-1] = 0;
+   free_kernel_pages(arg_buf, 1);
 
    struct intr_stack* intr_0_stack = (struct intr_stack*)((uint32_t)cur + PG_SIZE - sizeof(struct intr_stack));
    /* 参数传递给用户进程 */
-   intr_0_stack->ebx = (int32_t)argv;
+   intr_0_stack->ebx = (int32_t)user_argv;
    intr_0_stack->ecx = argc;
    intr_0_stack->eip = (void*)entry_point;
-   /* 使新用户进程的栈地址为最高用户空间地址 */
-   intr_0_stack->esp = (void*)0xc0000000;
+   /* 新用户进程的栈从argv指针数组之下开始 */
+   intr_0_stack->esp = (void*)user_argv;
 
    /* exec不同于fork,为使新进程更快被执行,直接从中断返回 */
    asm volatile ("movl %0, %%esp; jmp intr_exit" : : "g" (intr_0_stack) : "memory");
    return 0;
-}
\ No newline at end of file
+}
@@ -1,5 +1,10 @@
 #ifndef __USERPROG_EXEC_H
 #define __USERPROG_EXEC_H
 #include "stdint.h"
+#include "global.h"
+struct task_struct;
 int32_t sys_execv(const char* path, const char*  argv[]);
+bool file_region_fill(uint32_t page_vaddr);
+bool file_region_shared(uint32_t page_vaddr, uint32_t* i_no);
+void file_regions_release(struct task_struct* pthread);
 #endif
\ No newline at end of file
@@ -6,39 +6,35 @@
 #include "../thread/thread.h"    
 #include "string.h"
 #include "../fs/file.h"
+#include "vma.h"
+#include "swap.h"
 
 extern void intr_exit(void);
 
-/* 将父进程的 pcb、虚拟地址位图拷贝给子进程 */
-static int32_t copy_pcb_vaddrbitmap_stack0(struct task_struct* child_thread, struct task_struct* parent_thread) {
+/* 将父进程的 pcb、虚拟内存区拷贝给子进程 */
+static int32_t copy_pcb_vmas_stack0(struct task_struct* child_thread, struct task_struct* parent_thread) {
     // a. 复制 pcb 所在的整个页, 里面包含进程 pcb 信息及特级0极的栈, 里面包含了返回地址, 然后再单独修改个别部分
     memcpy(child_thread, parent_thread, PG_SIZE);
 
     // 单独修改
     child_thread->pid = fork_pid();
-    child_thread->elapsed_ticks = 0;
+    child_thread->runtime_ns = 0;
     child_thread->status = TASK_READY;
     // 为新进程把时间片充满
     child_thread->ticks = child_thread->priority;
     child_thread->parent_pid = parent_thread->pid;
     child_thread->general_tag.prev = child_thread->general_tag.next = NULL;
     child_thread->all_list_tag.prev = child_thread->all_list_tag.next = NULL;
-    // 初始化子进程内存块描述符
+    // 初始化子进程内存块描述符, 复制来的弹匣也清空
     block_desc_init(child_thread->u_block_desc);
+    mem_magazine_flush(child_thread);
 
-    // b. 复制父进程的虚拟地址池的位图
-    uint32_t bitmap_pg_cnt = DIV_ROUND_UP((0xc0000000 - USER_VADDR_START) / PG_SIZE / 8 , PG_SIZE);
-    void* vaddr_btmp = get_kernel_pages(bitmap_pg_cnt);
-    if(vaddr_btmp == NULL) {
+    // b. 复制父进程的虚拟内存区, 此时 child_thread->vmas 还是父进程链表的表头
+    if(!vma_copy(child_thread, parent_thread)) {
+        release_pid(child_thread->pid);
         return -1;
     }
 
-    // 此时 child_thread->userprog_vaddr.vaddr_bitmap.bits 还是指向父进程虚拟地址的位图地址
-    // 下面将 child_thread->userprog_vaddr.vaddr_bitmap.bits 指向自己的位图 vaddr_btmp
-    // 复制父进程的虚拟内存位图 并把自己刚分配好的独立位图给我们的子进程赋值
-    memcpy(vaddr_btmp, child_thread->userprog_vaddr.vaddr_bitmap.bits, bitmap_pg_cnt * PG_SIZE);
-    child_thread->userprog_vaddr.vaddr_bitmap.bits = vaddr_btmp;
-
     // 进程后面加个名字
     ASSERT(strlen(child_thread->name) < 11);
     strcat(child_thread->name, "_fork");
@@ -47,48 +43,107 @@ static int32_t copy_pcb_vaddrbitmap_stack0(struct task_struct* child_thread, str
 }
 
 
-/* 复制子进程的进程体(代码和数据)及用户栈 */
-static void copy_body_stack3(struct task_struct* child_thread, struct task_struct* parent_thread, void* buf_page) {
-    uint8_t* vaddr_btmp = parent_thread->userprog_vaddr.vaddr_bitmap.bits;
-    uint32_t btmp_bytes_len = parent_thread->userprog_vaddr.vaddr_bitmap.btmp_bytes_len;
-    uint32_t vaddr_start = parent_thread->userprog_vaddr.vaddr_start;
-    uint32_t idx_byte = 0;
-    uint32_t idx_bit = 0;
-    uint32_t prog_vaddr = 0;
-
-    // 在父进程的用户空间中查找已有数据的页
-    while(idx_byte < btmp_bytes_len) {
-        if(vaddr_btmp[idx_byte]) {
-            idx_bit = 0;
-
-            while(idx_bit < 8) {
-                if ((BITMAP_MASK << idx_bit) & vaddr_btmp[idx_byte]) {
-                    prog_vaddr = (idx_byte * 8 + idx_bit) * PG_SIZE + vaddr_start;
-
-                    // 下面的操作是将父进程用户空间中的数据通过内核空间做中转, 最终复制到子进程的用户空间
-                    // a. 将父进程在用户空间中的数据复制到内核缓冲区 buf_page
-                    // 目的是下面切换到子进程的页表后, 还能访问到父进程的数据
-                    memcpy(buf_page, (void*) prog_vaddr, PG_SIZE);
-
-                    //  b. 将页表切换到子进程, 目的是避免下面申请内存的函数将 pte 及 pde 安装在父进程的页表中
-                    page_dir_activate(child_thread);
-
-                    // c. 申请虚拟地址 prog_vaddr
-                    get_a_page_without_opvaddrbitmap(PF_USER, prog_vaddr);
-
-                    // d. 从内核缓冲区中将父进程数据复制到子进程的用户空间
-                    memcpy((void*) prog_vaddr, buf_page, PG_SIZE);
+/* 写时复制地共享父进程的进程体(代码和数据)及用户栈:
+ * 不再复制页框, 只为子进程复制用户空间的页表, 父子双方的可写页都改为只读并标记 PG_COW,
+ * 页框的引用数加1, 以后谁先写谁在缺页异常中复制出自己的页框.
+ * 整个 sys_fork 都在关中断下进行, 复制期间页表项不会被换出改掉 */
+static int32_t copy_body_stack3(struct task_struct* child_thread, struct task_struct* parent_thread) {
+    uint32_t* parent_pgdir = parent_thread->pgdir;
+    uint32_t* child_pgdir = child_thread->pgdir;
+
+    // 用户页只会映射在虚拟内存区中, 只需逐段复制, 页表不存在的 4M 整个跳过
+    struct list_elem* elem = parent_thread->vmas.head.next;
+    while(elem != &parent_thread->vmas.tail) {
+        struct vm_area* area = elem2entry(struct vm_area, vma_tag, elem);
+        uint32_t vaddr = area->start;
+        while(vaddr < area->end) {
+            uint32_t pde_idx = vaddr >> 22;
+            uint32_t table_end = (pde_idx + 1) << 22;
+            if(table_end > area->end) {
+                table_end = area->end;
+            }
+            uint32_t pde = parent_pgdir[pde_idx];
+            if(!(pde & PG_P_1)) {
+                vaddr = table_end;
+                continue;
+            }
 
-                    // e. 恢复父进程页表
-                    page_dir_activate(parent_thread);
+            // 一个页表可能被几段共用, 第一次用到时才为子进程分配, 从内核内存池分配并清0
+            if(!(child_pgdir[pde_idx] & PG_P_1)) {
+                uint32_t table_phyaddr = (uint32_t) palloc_pages(PF_KERNEL, 0);
+                if(table_phyaddr == 0) {
+                    return -1;
                 }
+                MEM_STAT_ADD(pgtable_pages, 1);
+                uint32_t* new_table = kmap(table_phyaddr);
+                memset(new_table, 0, PG_SIZE);
+                kunmap(new_table);
+                child_pgdir[pde_idx] = table_phyaddr | (pde & 0x00000fff);
+            }
 
-                idx_bit++;
+            // 子进程的页表通过 kmap 临时映射后填写,
+            // 当前仍是父进程的页表, 可以直接通过 pte_ptr 访问父进程的页表
+            uint32_t* child_table = kmap(child_pgdir[pde_idx] & 0xfffff000);
+            uint32_t* parent_pte = pte_ptr(vaddr);
+            uint32_t pte_idx = (vaddr >> 12) & 0x3ff;
+            while(vaddr < table_end) {
+                uint32_t pte = *parent_pte;
+                if(pte & PG_P_1) {
+                    if(pte & PG_RW_W) {
+                        pte = (pte & ~PG_RW_W) | PG_COW;
+                        *parent_pte = pte;
+                    }
+                    page_share(pte & 0xfffff000);
+                } else if(pte & PG_SWAP) {
+                    // 已换出的页, 子进程与父进程共用交换槽, 各自换入时再读回自己的页框
+                    swap_entry_dup(pte);
+                }
+                child_table[pte_idx++] = pte;
+                parent_pte++;
+                vaddr += PG_SIZE;
             }
+            kunmap(child_table);
         }
+        elem = elem->next;
+    }
+
+    // 父进程的页表项改成了只读, 重新加载 cr3 一次性刷新 tlb
+    page_dir_activate(parent_thread);
+    return 0;
+}
 
-        idx_byte++;
+/* 撤销 copy_body_stack3 已完成的部分: 放掉子进程页表项持有的页框引用和交换槽,
+ * 父进程中因此不再共享的写时复制页恢复可写, 再释放子进程的页表 */
+static void undo_body_stack3(struct task_struct* child_thread, struct task_struct* parent_thread) {
+    uint32_t* child_pgdir = child_thread->pgdir;
+    uint32_t pde_idx = 0;
+    while(pde_idx < 768) {
+        if(!(child_pgdir[pde_idx] & PG_P_1)) {
+            pde_idx++;
+            continue;
+        }
+        uint32_t table_phyaddr = child_pgdir[pde_idx] & 0xfffff000;
+        uint32_t* child_table = kmap(table_phyaddr);
+        uint32_t pte_idx = 0;
+        while(pte_idx < 1024) {
+            uint32_t pte = child_table[pte_idx];
+            if(pte & PG_P_1) {
+                // 父进程仍映射着这个页框, 这里只是减少引用数
+                pfree(pte & 0xfffff000);
+                cow_page_reuse((pde_idx << 22) | (pte_idx << 12));
+            } else if(pte & PG_SWAP) {
+                swap_entry_free(pte);
+            }
+            pte_idx++;
+        }
+        kunmap(child_table);
+        pfree(table_phyaddr);
+        MEM_STAT_ADD(pgtable_pages, -1);
+        child_pgdir[pde_idx++] = 0;
     }
+
+    // 父进程的页表项可能又改回了可写, 同样重新加载 cr3
+    page_dir_activate(parent_thread);
 }
 
 /* 为子进程构建 thread_stack 和修改返回值 */
@@ -155,30 +210,36 @@ static void update_inode_open_cnts(struct task_struct* thread) {
       }
       local_fd++;
    }
+
+   /* 子进程也共享了父进程的文件映射区 */
+   uint32_t region_idx = 0;
+   while (region_idx < MAX_FILE_REGIONS) {
+      if (thread->file_regions[region_idx].inode != NULL) {
+	 thread->file_regions[region_idx].inode->i_open_cnts++;
+      }
+      region_idx++;
+   }
 }
 
 
-/* 拷贝父进程本身所占资源给子进程 */
+/* 拷贝父进程本身所占资源给子进程, 失败时已拷贝的部分都会撤销, 只剩 pcb 所在的页由调用者释放 */
 static int32_t copy_process(struct task_struct* child_thread, struct task_struct* parent_thread) {
-    // 内核缓冲区, 作为父进程用户空间的数据复制到子进程用户空间的中转
-    void* buf_page = get_kernel_pages(1);
-    if(buf_page == NULL) {
-        return -1;
-    }
-
-    // a. 复制父进程的 pcb、虚拟地址位图、内核栈到子进程
-    if(copy_pcb_vaddrbitmap_stack0(child_thread, parent_thread) == -1) {
+    // a. 复制父进程的 pcb、虚拟内存区、内核栈到子进程
+    if(copy_pcb_vmas_stack0(child_thread, parent_thread) == -1) {
         return -1;
     }
 
     // b. 为子进程创建页表, 此页表仅包括内核空间
     child_thread->pgdir = create_page_dir();
     if(child_thread->pgdir == NULL) {
-        return -1;
+        goto fail_vmas;
     }
 
     // c. 复制父进程进程体及用户栈给子进程
-    copy_body_stack3(child_thread, parent_thread, buf_page);
+    if(copy_body_stack3(child_thread, parent_thread) == -1) {
+        undo_body_stack3(child_thread, parent_thread);
+        goto fail_pgdir;
+    }
 
     // d. 构建子进程 thread_stack 和修改返回值 pid
     build_child_stack(child_thread);
@@ -186,9 +247,15 @@ static int32_t copy_process(struct task_struct* child_thread, struct task_struct
     // e. 更新文件 inode 的打开数
     update_inode_open_cnts(child_thread);
 
-    mfree_page(PF_KERNEL, buf_page, 1);
-
     return 0;
+
+fail_pgdir:
+    free_kernel_pages(child_thread->pgdir, 1);
+    MEM_STAT_ADD(pgtable_pages, -1);
+fail_vmas:
+    vma_release(child_thread);
+    release_pid(child_thread->pid);
+    return -1;
 }
 
 
@@ -204,12 +271,12 @@ pid_t sys_fork(void) {
     ASSERT(INTR_OFF == intr_get_status() && parent_thread->pgdir != NULL);
 
     if(copy_process(child_thread, parent_thread) == -1) {
+        free_kernel_pages(child_thread, 1);
         return -1;
     }
 
     // 添加到就绪线程队列和所有线程队列, 子进程由调试器安排运行
-    ASSERT(!elem_find(&thread_ready_list, &child_thread->general_tag));
-    list_append(&thread_ready_list, &child_thread->general_tag);
+    thread_ready_add(child_thread);
     ASSERT(!elem_find(&thread_all_list, &child_thread->all_list_tag));
     list_append(&thread_all_list, &child_thread->all_list_tag);
 
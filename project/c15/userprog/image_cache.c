@@ -0,0 +1,165 @@
+#include "image_cache.h"
+#include "memory.h"
+#include "global.h"
+#include "debug.h"
+#include "list.h"
+#include "slab.h"
+#include "interrupt.h"
+
+/***********************  可执行映像缓存  ***************************
+ * 同一个程序被反复 exec 时, 只读段(代码和只读数据)的内容每次都一样,
+ * 所以第一次缺页从文件读入后就把页框留在缓存中, 以后的进程缺页时
+ * 直接以只读+写时复制的方式映射同一个页框, 不再读盘和复制。
+ * 缓存按(inode编号, 虚拟地址)查找, 它自己占页框的一个引用,
+ * 页框在映像文件被改写、被删除或内存紧张时才释放。
+ * 链表操作很短, 用关中断保证原子, 以便在缺页异常中使用。
+ ******************************************************************/
+
+#define IMAGE_HASH_SIZE 64
+
+/* 缓存中的一页 */
+struct image_page {
+   uint32_t i_no;		 // 映像文件的inode编号
+   uint32_t page_vaddr;	 // 此页在进程中的虚拟地址
+   uint32_t phy_addr;	 // 页框的物理地址
+   struct list_elem hash_tag;	 // 用于加入 image_hash 中的桶
+   struct list_elem lru_tag;	 // 用于加入 image_lru, 越靠前越久没用过
+};
+
+static struct list image_hash[IMAGE_HASH_SIZE];
+static struct list image_lru;
+static struct kmem_cache image_page_cache;
+
+/* 返回(i_no, page_vaddr)所在的哈希桶 */
+static struct list* image_bucket(uint32_t i_no, uint32_t page_vaddr) {
+   return &image_hash[((page_vaddr >> 12) + i_no * 31) % IMAGE_HASH_SIZE];
+}
+
+/* 在桶中找(i_no, page_vaddr)对应的缓存页, 须在关中断下调用 */
+static struct image_page* image_lookup(uint32_t i_no, uint32_t page_vaddr) {
+   struct list* bucket = image_bucket(i_no, page_vaddr);
+   struct list_elem* elem = bucket->head.next;
+   while (elem != &bucket->tail) {
+      struct image_page* ipage = elem2entry(struct image_page, hash_tag, elem);
+      if (ipage->i_no == i_no && ipage->page_vaddr == page_vaddr) {
+	 return ipage;
+      }
+      elem = elem->next;
+   }
+   return NULL;
+}
+
+/* 初始化可执行映像缓存 */
+void image_cache_init(void) {
+   uint32_t idx = 0;
+   while (idx < IMAGE_HASH_SIZE) {
+      list_init(&image_hash[idx++]);
+   }
+   list_init(&image_lru);
+   kmem_cache_create(&image_page_cache, "image_page", sizeof(struct image_page), NULL);
+}
+
+/* 查找映像文件 i_no 中映射到 page_vaddr 的只读页,
+ * 命中则为调用者增加一个共享映射并返回页框物理地址, 否则返回0 */
+uint32_t image_cache_get(uint32_t i_no, uint32_t page_vaddr) {
+   uint32_t phy_addr = 0;
+   enum intr_status old_status = intr_disable();
+   struct image_page* ipage = image_lookup(i_no, page_vaddr);
+   if (ipage != NULL) {
+      phy_addr = ipage->phy_addr;
+      page_share(phy_addr);
+      // 移到队尾, 表示最近用过
+      list_remove(&ipage->lru_tag);
+      list_append(&image_lru, &ipage->lru_tag);
+   }
+   intr_set_status(old_status);
+   return phy_addr;
+}
+
+/* 把刚从映像文件读入的只读页框 phy_addr 放入缓存, 缓存自己占一个映射 */
+void image_cache_put(uint32_t i_no, uint32_t page_vaddr, uint32_t phy_addr) {
+   struct image_page* ipage = kmem_cache_alloc(&image_page_cache);
+   if (ipage == NULL) {	 // 缓存不了也不影响正确性
+      return;
+   }
+   ipage->i_no = i_no;
+   ipage->page_vaddr = page_vaddr;
+   ipage->phy_addr = phy_addr;
+
+   enum intr_status old_status = intr_disable();
+   if (image_lookup(i_no, page_vaddr) != NULL) {
+      // 别的进程同时读入了同一页并已放入缓存
+      intr_set_status(old_status);
+      kmem_cache_free(&image_page_cache, ipage);
+      return;
+   }
+   page_share(phy_addr);
+   list_push(image_bucket(i_no, page_vaddr), &ipage->hash_tag);
+   list_append(&image_lru, &ipage->lru_tag);
+   intr_set_status(old_status);
+}
+
+/* 从缓存中摘下ipage, 并放弃缓存占有的映射, 须在关中断下调用 */
+static void image_page_drop(struct image_page* ipage) {
+   list_remove(&ipage->hash_tag);
+   list_remove(&ipage->lru_tag);
+   free_a_phy_page(ipage->phy_addr);   // 还有进程映射着时只减少引用数
+}
+
+/* 映像文件 i_no 的内容变了(被写或被删除), 丢弃它的所有缓存页 */
+void image_cache_invalidate(uint32_t i_no) {
+   struct image_page* ipage;
+   do {
+      ipage = NULL;
+      enum intr_status old_status = intr_disable();
+      struct list_elem* elem = image_lru.head.next;
+      while (elem != &image_lru.tail) {
+	 struct image_page* cur = elem2entry(struct image_page, lru_tag, elem);
+	 if (cur->i_no == i_no) {
+	    ipage = cur;
+	    image_page_drop(ipage);
+	    break;
+	 }
+	 elem = elem->next;
+      }
+      intr_set_status(old_status);
+      if (ipage != NULL) {
+	 kmem_cache_free(&image_page_cache, ipage);
+      }
+   } while (ipage != NULL);
+}
+
+/* 内存紧张时释放最多 cnt 个已没有进程映射的缓存页, 返回实际释放的页数.
+ * 从最久没用过的开始释放 */
+uint32_t image_cache_shrink(uint32_t cnt) {
+   uint32_t freed = 0;
+   while (freed < cnt) {
+      struct image_page* ipage = NULL;
+      enum intr_status old_status = intr_disable();
+      struct list_elem* elem = image_lru.head.next;
+      while (elem != &image_lru.tail) {
+	 struct image_page* cur = elem2entry(struct image_page, lru_tag, elem);
+	 if (page_map_cnt(cur->phy_addr) == 1) {    // 只剩缓存自己
+	    ipage = cur;
+	    image_page_drop(ipage);
+	    break;
+	 }
+	 elem = elem->next;
+      }
+      intr_set_status(old_status);
+      if (ipage == NULL) {
+	 break;
+      }
+      kmem_cache_free(&image_page_cache, ipage);
+      freed++;
+   }
+   return freed;
+}
+
+/* 返回缓存占用的页框数 */
+uint32_t image_cache_pages(void) {
+   enum intr_status old_status = intr_disable();
+   uint32_t cnt = list_len(&image_lru);
+   intr_set_status(old_status);
+   return cnt;
+}
@@ -0,0 +1,24 @@
+#ifndef __USERPROG_IMAGE_CACHE_H
+#define __USERPROG_IMAGE_CACHE_H
+#include "stdint.h"
+
+/* 初始化可执行映像缓存 */
+void image_cache_init(void);
+
+/* 查找映像文件 i_no 中映射到 page_vaddr 的只读页,
+ * 命中则为调用者增加一个共享映射并返回页框物理地址, 否则返回0 */
+uint32_t image_cache_get(uint32_t i_no, uint32_t page_vaddr);
+
+/* 把刚从映像文件读入的只读页框 phy_addr 放入缓存, 缓存自己占一个映射 */
+void image_cache_put(uint32_t i_no, uint32_t page_vaddr, uint32_t phy_addr);
+
+/* 映像文件 i_no 的内容变了(被写或被删除), 丢弃它的所有缓存页 */
+void image_cache_invalidate(uint32_t i_no);
+
+/* 内存紧张时释放最多 cnt 个已没有进程映射的缓存页, 返回实际释放的页数 */
+uint32_t image_cache_shrink(uint32_t cnt);
+
+/* 返回缓存占用的页框数 */
+uint32_t image_cache_pages(void);
+
+#endif
@@ -8,6 +8,7 @@
 #include "interrupt.h"
 #include "string.h"
 #include "console.h"
+#include "vma.h"
 
 extern void intr_exit(void);
 
@@ -24,7 +25,7 @@ void start_process(void* filename_) {
     proc_stack->eip = function;	 // 待执行的用户程序地址
     proc_stack->cs = SELECTOR_U_CODE;
     proc_stack->eflags = (EFLAGS_IOPL_0 | EFLAGS_MBS | EFLAGS_IF_1);
-    proc_stack->esp = (void*)((uint32_t)get_a_page(PF_USER, USER_STACK3_VADDR) + PG_SIZE) ;
+    proc_stack->esp = (void*)0xc0000000;	 // 用户栈不预先分配, 第一次压栈时由缺页异常分配
     proc_stack->ss = SELECTOR_U_DATA; 
     asm volatile ("movl %0, %%esp; jmp intr_exit" : : "g" (proc_stack) : "memory");
 }
@@ -70,6 +71,7 @@ uint32_t* create_page_dir(void) {
         console_put_str("create_page_dir: get_kernel_page failed!");
         return NULL;
     }
+    MEM_STAT_ADD(pgtable_pages, 1);
 
     /************************** 1  先复制页表  *************************************/
     /*  page_dir_vaddr + 0x300*4 是内核页目录的第768项 */
@@ -84,32 +86,50 @@ uint32_t* create_page_dir(void) {
     return page_dir_vaddr;
 }
 
-/* 创建用户进程虚拟地址位图 */
-void create_user_vaddr_bitmap(struct task_struct* user_prog) {
-    user_prog->userprog_vaddr.vaddr_start = USER_VADDR_START;
-    uint32_t bitmap_pg_cnt = DIV_ROUND_UP((0xc0000000 - USER_VADDR_START) / PG_SIZE / 8 , PG_SIZE);
-    user_prog->userprog_vaddr.vaddr_bitmap.bits = get_kernel_pages(bitmap_pg_cnt);
-    user_prog->userprog_vaddr.vaddr_bitmap.btmp_bytes_len = (0xc0000000 - USER_VADDR_START) / PG_SIZE / 8;
-    bitmap_init(&user_prog->userprog_vaddr.vaddr_bitmap);
+/* 释放当前进程 p_thread 用户空间中的所有页框及页表, 页目录项清0,
+ * 写时复制共享的页框只减少引用数 */
+void process_vspace_release(struct task_struct* p_thread) {
+    ASSERT(p_thread == running_thread() && p_thread->pgdir != NULL);
+    // 用户页只会映射在虚拟内存区中, 逐段解除映射即可, 页表随之释放
+    struct list_elem* elem = p_thread->vmas.head.next;
+    while (elem != &p_thread->vmas.tail) {
+        struct vm_area* area = elem2entry(struct vm_area, vma_tag, elem);
+        page_range_unmap(PF_USER, area->start, (area->end - area->start) / PG_SIZE);
+        elem = elem->next;
+    }
 }
 
 /* 创建用户进程 */
 void process_execute(void* filename, char* name) { 
     /* pcb内核的数据结构,由内核来维护进程信息,因此要在内核内存池中申请 */
     struct task_struct* thread = get_kernel_pages(1);
+    if (thread == NULL) {
+        console_put_str("process_execute: get_kernel_page failed!");
+        return;
+    }
     init_thread(thread, name, default_prio); 
-    create_user_vaddr_bitmap(thread);
+    if (!vma_space_init(thread)) {
+        console_put_str("process_execute: vma_space_init failed!");
+        goto fail;
+    }
     thread_create(thread, start_process, filename);//start_process(filename)
     thread->pgdir = create_page_dir();
-
-    thread->pgdir = create_page_dir();
+    if (thread->pgdir == NULL) {
+        vma_release(thread);
+        goto fail;
+    }
     block_desc_init(thread->u_block_desc);	// 初始化进程的内存块描述符
+    thread->brk = USER_BRK_START;
 
     enum intr_status old_status = intr_disable();
-    ASSERT(!elem_find(&thread_ready_list, &thread->general_tag));
-    list_append(&thread_ready_list, &thread->general_tag);
+    thread_ready_add(thread);
 
     ASSERT(!elem_find(&thread_all_list, &thread->all_list_tag));
     list_append(&thread_all_list, &thread->all_list_tag);
     intr_set_status(old_status);
+    return;
+
+fail:
+    release_pid(thread->pid);
+    free_kernel_pages(thread, 1);
 }
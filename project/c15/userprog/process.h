@@ -5,10 +5,14 @@
 #define default_prio 31
 #define USER_STACK3_VADDR  (0xc0000000 - 0x1000)
 #define USER_VADDR_START 0x8048000
+#define USER_STACK_SIZE_MAX 0x800000	 // 用户栈按需向下增长, 最多8M
+/* brk堆的起始地址. 内核为进程 sys_malloc 时从虚拟地址位图的低端找页,
+ * brk堆要连续增长, 所以放在远离它们的高处, 最多长到用户栈的下边界 */
+#define USER_BRK_START 0x40000000
 void process_execute(void* filename, char* name);
 void start_process(void* filename_);
 void process_activate(struct task_struct* p_thread);
 void page_dir_activate(struct task_struct* p_thread);
 uint32_t* create_page_dir(void);
-void create_user_vaddr_bitmap(struct task_struct* user_prog);
+void process_vspace_release(struct task_struct* p_thread);
 #endif
\ No newline at end of file
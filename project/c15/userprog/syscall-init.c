@@ -6,6 +6,9 @@
 #include "../device/console.h"
 #include "string.h"
 #include "../kernel/memory.h"
+#include "../kernel/ksm.h"
+#include "../thread/sched.h"
+#include "../device/timer.h"
 #include "../fs/fs.h"
 #include "fork.h"
 #include "../fs/file.h"
@@ -52,5 +55,10 @@ void syscall_init(void) {
     syscall_table[SYS_EXECV]	 = sys_execv;
     syscall_table[SYS_EXIT]  = sys_exit;
     syscall_table[SYS_WAIT]  = sys_wait;
+    syscall_table[SYS_SBRK]  = sys_sbrk;
+    syscall_table[SYS_MEMINFO]  = sys_meminfo;
+    syscall_table[SYS_KSM_CTL]  = sys_ksm_ctl;
+    syscall_table[SYS_SCHED_CTL]  = sys_sched_ctl;
+    syscall_table[SYS_CLOCK_GETTIME]  = sys_clock_gettime;
     put_str("syscall_init done\n");
 }